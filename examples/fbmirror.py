@@ -12,28 +12,17 @@ For help with commandline arguments, run `python fbmirror.py --help`
 """
 
 
+import time
+
 import click
-import numpy as np
 
 import adafruit_blinka_raspberry_pi5_piomatter as piomatter
 import adafruit_blinka_raspberry_pi5_piomatter.click as piomatter_click
 from adafruit_blinka_raspberry_pi5_piomatter.pixelmappers import simple_multilane_mapper
 
-with open("/sys/class/graphics/fb0/virtual_size") as f:
-    screenx, screeny = [int(word) for word in f.read().split(",")]
-
-with open("/sys/class/graphics/fb0/bits_per_pixel") as f:
-    bits_per_pixel = int(f.read())
-
-assert bits_per_pixel == 16
+linux_framebuffer = piomatter.MappedFramebuffer("/dev/fb0")
 
-bytes_per_pixel = bits_per_pixel // 8
-dtype = {2: np.uint16, 4: np.uint32}[bytes_per_pixel]
-
-with open("/sys/class/graphics/fb0/stride") as f:
-    stride = int(f.read())
-
-linux_framebuffer = np.memmap('/dev/fb0',mode='r', shape=(screeny, stride // bytes_per_pixel), dtype=dtype)
+colorspace = {16: piomatter.Colorspace.RGB565, 32: piomatter.Colorspace.RGB888}[linux_framebuffer.bits_per_pixel]
 
 @click.command
 @click.option("--x-offset", "xoffset", type=int, help="The x offset of top left corner of the region to mirror",  default=0)
@@ -45,12 +34,15 @@ def main(xoffset, yoffset, width, height, serpentine, rotation, pinout, n_planes
         geometry = piomatter.Geometry(width=width, height=height, n_planes=n_planes, n_addr_lines=n_addr_lines, n_temporal_planes=n_temporal_planes, n_lanes=n_lanes, map=pixelmap)
     else:
         geometry = piomatter.Geometry(width=width, height=height, n_planes=n_planes, n_addr_lines=n_addr_lines, n_temporal_planes=n_temporal_planes, rotation=rotation, serpentine=serpentine)
-    framebuffer = np.zeros(shape=(geometry.height, geometry.width), dtype=dtype)
-    matrix = piomatter.PioMatter(colorspace=piomatter.Colorspace.RGB565, pinout=pinout, framebuffer=framebuffer, geometry=geometry)
-
-    while True:
-        framebuffer[:,:] = linux_framebuffer[yoffset:yoffset+height, xoffset:xoffset+width]
-        matrix.show()
+    # The matrix reads its region of the screen straight from the mapping
+    matrix = piomatter.PioMatter(colorspace=colorspace, pinout=pinout, framebuffer=linux_framebuffer, geometry=geometry, x_offset=xoffset, y_offset=yoffset)
+    # Most of a desktop is static from one frame to the next
+    matrix.incremental = True
+    matrix.start_mirroring()
+
+    while matrix.mirroring:
+        time.sleep(1)
+    matrix.stop_mirroring()
 
 if __name__ == '__main__':
     main()
@@ -37,29 +37,17 @@ or if `/boot/firmware/cmdline.txt` specifies a resolution such as
 `...  video=HDMI-A-1:640x480M@60D`.
 """
 
+import time
+
 import click
-import numpy as np
-import PIL.Image as Image
 
 import adafruit_blinka_raspberry_pi5_piomatter as piomatter
 import adafruit_blinka_raspberry_pi5_piomatter.click as piomatter_click
 from adafruit_blinka_raspberry_pi5_piomatter.pixelmappers import simple_multilane_mapper
 
-with open("/sys/class/graphics/fb0/virtual_size") as f:
-    screenx, screeny = [int(word) for word in f.read().split(",")]
-
-with open("/sys/class/graphics/fb0/bits_per_pixel") as f:
-    bits_per_pixel = int(f.read())
-
-assert bits_per_pixel == 16
+linux_framebuffer = piomatter.MappedFramebuffer("/dev/fb0")
 
-bytes_per_pixel = bits_per_pixel // 8
-dtype = {2: np.uint16, 4: np.uint32}[bytes_per_pixel]
-
-with open("/sys/class/graphics/fb0/stride") as f:
-    stride = int(f.read())
-
-linux_framebuffer = np.memmap('/dev/fb0',mode='r', shape=(screeny, stride // bytes_per_pixel), dtype=dtype)
+colorspace = {16: piomatter.Colorspace.RGB565, 32: piomatter.Colorspace.RGB888}[linux_framebuffer.bits_per_pixel]
 
 
 @click.command
@@ -73,25 +61,15 @@ def main(xoffset, yoffset, scale, width, height, serpentine, rotation, pinout, n
         geometry = piomatter.Geometry(width=width, height=height, n_planes=n_planes, n_addr_lines=n_addr_lines, n_temporal_planes=n_temporal_planes, n_lanes=n_lanes, map=pixelmap)
     else:
         geometry = piomatter.Geometry(width=width, height=height, n_planes=n_planes, n_temporal_planes=n_temporal_planes, n_addr_lines=n_addr_lines, rotation=rotation, serpentine=serpentine)
-    matrix_framebuffer = np.zeros(shape=(geometry.height, geometry.width, 3), dtype=np.uint8)
-    matrix = piomatter.PioMatter(colorspace=piomatter.Colorspace.RGB888Packed, pinout=pinout, framebuffer=matrix_framebuffer, geometry=geometry)
-
-    while True:
-        tmp = linux_framebuffer[yoffset:yoffset + height * scale, xoffset:xoffset + width * scale]
-        # Convert the RGB565 framebuffer into RGB888Packed (so that we can use PIL image operations to rescale it)
-        r = (tmp & 0xf800) >> 8
-        r = r | (r >> 5)
-        r = r.astype(np.uint8)
-        g = (tmp & 0x07e0) >> 3
-        g = g | (g >> 6)
-        g = g.astype(np.uint8)
-        b = (tmp & 0x001f) << 3
-        b = b | (b >> 5)
-        b = b.astype(np.uint8)
-        img = Image.fromarray(np.stack([r, g, b], -1))
-        img = img.resize((width, height))
-        matrix_framebuffer[:, :] = np.array(img)
-        matrix.show()
+    # The region is averaged down as it is converted for the panels, straight
+    # from the mapping, so no scaled copy of the screen is made
+    region = (xoffset, yoffset, width * scale, height * scale)
+    matrix = piomatter.PioMatter(colorspace=colorspace, pinout=pinout, framebuffer=linux_framebuffer, geometry=geometry, scale_from=region)
+    matrix.start_mirroring()
+
+    while matrix.mirroring:
+        time.sleep(1)
+    matrix.stop_mirroring()
 
 if __name__ == '__main__':
     main()
@@ -30,12 +30,18 @@ matrix = piomatter.PioMatter(colorspace=piomatter.Colorspace.RGB888Packed,
                              framebuffer=framebuffer,
                              geometry=geometry)
 
+# Decode every frame once; the matrix then plays them without any more work
+# in Python
+frames = []
+durations = []
 with Image.open(gif_file) as img:
     print(f"frames: {img.n_frames}")
-    while True:
-        for i in range(img.n_frames):
-            img.seek(i)
-            canvas.paste(img, (0,0))
-            framebuffer[:] = np.asarray(canvas)
-            matrix.show()
-            time.sleep(0.1)
+    for i in range(img.n_frames):
+        img.seek(i)
+        canvas.paste(img, (0,0))
+        frames.append(np.asarray(canvas) + 0)
+        durations.append(img.info.get("duration", 100) / 1000)
+
+matrix.load_sequence(frames, durations)
+while matrix.playing:
+    time.sleep(1)
@@ -0,0 +1,61 @@
+#!/usr/bin/python3
+"""
+Send a series of images to a matrix running the native ingest daemon
+(``src/simple_websocket_server.cpp``) over UDP
+
+Run the daemon on the Pi, for instance for a 64x32 panel:
+
+$ simple_server --width 64 --height 32 --group 239.1.2.3
+
+and then send it frames from any machine on the network:
+
+$ python send_frames.py 239.1.2.3 "/path/to/images/*.png"
+
+The images are scaled to the display, sorted, and played repeatedly at 30
+frames per second until interrupted with ctrl-c. This needs only numpy and
+PIL, not the piomatter module.
+"""
+
+import glob
+import itertools
+import socket
+import struct
+import sys
+import time
+
+import numpy as np
+import PIL.Image as Image
+
+width, height = 64, 32
+port = 5568
+fps = 30
+# Small enough to cross any Ethernet without IP fragmentation
+fragment_size = 1400
+
+
+def packets(sequence, frame):
+    """Split a frame into datagrams, in the wire format of piomatter/ingest.h"""
+    n = (len(frame) + fragment_size - 1) // fragment_size
+    for i in range(n):
+        header = struct.pack('<IBBHIHHIIQ', 0x31464d50, 1, 0, n, sequence, i,
+                             0, len(frame), fragment_size, 0)
+        yield header + frame[i * fragment_size:(i + 1) * fragment_size]
+
+
+def rgb888(image):
+    """The daemon's default Colorspace: one little-endian 0x00RRGGBB word per pixel"""
+    rgb = np.asarray(image.convert('RGB').resize((width, height)), dtype=np.uint32)
+    return ((rgb[..., 0] << 16) | (rgb[..., 1] << 8) | rgb[..., 2]).astype('<u4').tobytes()
+
+
+frames = [rgb888(Image.open(path)) for path in sorted(glob.glob(sys.argv[2]))]
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+# Reach controllers on other subnets of the wall's network
+sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 4)
+
+next_time = time.monotonic()
+for sequence, frame in zip(itertools.count(), itertools.cycle(frames)):
+    for packet in packets(sequence & 0xffffffff, frame):
+        sock.sendto(packet, (sys.argv[1], port))
+    next_time += 1 / fps
+    time.sleep(max(0, next_time - time.monotonic()))
@@ -7,27 +7,45 @@ HUB75 matrix driver for Raspberry Pi 5 using PIO
 .. autosummary::
     :toctree: _generate
     :recursive:
-    :class: Orientation Pinout Colorspace Geometry PioMatter
+    :class: Orientation Pinout Colorspace Geometry MappedFramebuffer PioMatter PresentMode ScaleFilter ShowFuture StreamFileWriter SubmitPolicy
 
     Orientation
     Pinout
     Colorspace
     Geometry
+    MappedFramebuffer
     PioMatter
+    PresentMode
+    ScaleFilter
+    ShowFuture
+    StreamFileWriter
+    SubmitPolicy
 """
 
 from ._piomatter import (
     Colorspace,
     Geometry,
+    MappedFramebuffer,
     Orientation,
     Pinout,
     PioMatter,
+    PresentMode,
+    ScaleFilter,
+    ShowFuture,
+    StreamFileWriter,
+    SubmitPolicy,
 )
 
 __all__ = [
     'Colorspace',
     'Geometry',
+    'MappedFramebuffer',
     'Orientation',
     'Pinout',
     'PioMatter',
+    'PresentMode',
+    'ScaleFilter',
+    'ShowFuture',
+    'StreamFileWriter',
+    'SubmitPolicy',
 ]
@@ -0,0 +1,441 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "pio_mock.h"
+#include "piomatter/piomatter.h"
+
+// Host-side benchmark of the render kernels, and of whole piomatter objects
+// running against the mock PIO in piolib/pio_mock.c, so that it runs the same
+// on a desktop and on a Pi. With --check, it instead checks the refresh
+// thread's handling of timed frames against the mock, and fails if they are
+// shown at the wrong time.
+//
+// Usage: benchmark [pixel_clock_hz [seconds_per_case]]
+//        benchmark --check
+
+namespace {
+
+constexpr size_t panel_width = 64;
+constexpr size_t n_addr_lines = 4;
+
+double pixel_clock = piomatter::default_pixel_clock;
+double seconds_per_case = 0.05;
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds_since(clock_type::time_point t0) {
+    return std::chrono::duration<double>(clock_type::now() - t0).count();
+}
+
+// The mean time of one call of `f` in ns, over at least seconds_per_case
+template <typename F> double time_ns(F &&f) {
+    f();
+    size_t n = 1;
+    for (;;) {
+        auto t0 = clock_type::now();
+        for (size_t i = 0; i < n; i++) {
+            f();
+        }
+        double elapsed = seconds_since(t0);
+        if (elapsed >= seconds_per_case) {
+            return elapsed * 1e9 / n;
+        }
+        n *= 2;
+    }
+}
+
+// `n_lanes` bands of rows stacked top to bottom, each band fed by one lane
+piomatter::matrix_map make_lane_map(size_t width, size_t n_lanes) {
+    const size_t n_addr = 1u << n_addr_lines;
+    piomatter::matrix_map result;
+    for (size_t addr = 0; addr < n_addr; addr++) {
+        for (size_t x = 0; x < width; x++) {
+            for (size_t lane = 0; lane < n_lanes; lane++) {
+                result.push_back((lane * n_addr + addr) * width + x);
+            }
+        }
+    }
+    return result;
+}
+
+// Each lane drives a chain of `n_panels` 64x32 panels, two lanes per chain
+piomatter::matrix_geometry make_geometry(size_t n_panels, size_t n_lanes,
+                                         int n_planes, int n_temporal_planes) {
+    size_t width = panel_width * n_panels;
+    size_t height = n_lanes << n_addr_lines;
+    return piomatter::matrix_geometry(
+        width, n_addr_lines, n_planes, n_temporal_planes, width, height,
+        make_lane_map(width, n_lanes), n_lanes);
+}
+
+std::vector<uint32_t> make_pixels(size_t n) {
+    std::vector<uint32_t> result(n);
+    uint32_t state = 12345;
+    for (auto &px : result) {
+        state = state * 1103515245 + 12345;
+        px = state >> 8;
+    }
+    return result;
+}
+
+void print_kernel_header() {
+    printf("%-8s %5s %6s %6s %8s %11s %11s %11s %11s %11s %9s\n", "pinout",
+           "lanes", "panels", "planes", "temporal", "convert", "render_rgb10",
+           "render", "render<N>", "bytes/frame", "refreshHz");
+    printf("%-8s %5s %6s %6s %8s %11s %11s %11s %11s\n", "", "", "", "", "",
+           "ns/px", "ns/px", "ns/px", "ns/px");
+}
+
+// Time colorspace conversion, protomatter_render_rgb10 for every schedule,
+// and the fused protomatter_render that piomatter uses, both for any lane
+// count and specialized for n_lanes, in ns per pixel. A frame is one pass
+// through the whole schedule sequence, and the refresh rate is how many of
+// those the PIO can play per second at pixel_clock.
+template <typename pinout, size_t n_lanes>
+void bench_kernels(const char *name, size_t n_panels, int n_planes,
+                   int n_temporal_planes) {
+    auto geometry =
+        make_geometry(n_panels, n_lanes, n_planes, n_temporal_planes);
+    size_t n_pixels = geometry.width * geometry.height;
+    auto pixels = make_pixels(n_pixels);
+    std::span<const uint32_t> span(pixels);
+
+    piomatter::colorspace_rgb888 converter;
+    double convert_ns = time_ns([&] { converter.convert(span); });
+
+    auto rgb10 = converter.convert(span);
+    std::vector<uint32_t> stream;
+    double render_rgb10_ns = time_ns([&] {
+        const auto &schedules = geometry.schedules;
+        uint32_t old_active_time = schedules.back().back().active_time;
+        for (const auto &sched : schedules) {
+            piomatter::protomatter_render_rgb10<pinout>(
+                stream, geometry, sched, old_active_time, rgb10.data());
+            old_active_time = sched.back().active_time;
+        }
+    });
+
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    std::vector<std::vector<uint32_t>> streams;
+    piomatter::render_scratch scratch;
+    double render_ns = time_ns([&] {
+        piomatter::protomatter_render<pinout>(streams, geometry, skeleton,
+                                              converter, span, scratch);
+    });
+    double render_lanes_ns = time_ns([&] {
+        piomatter::protomatter_render<pinout, piomatter::colorspace_rgb888,
+                                      n_lanes>(streams, geometry, skeleton,
+                                               converter, span, scratch);
+    });
+
+    size_t n_words = 0;
+    uint64_t cycles = 0;
+    for (const auto &s : streams) {
+        n_words += s.size();
+        cycles += piomatter::stream_cycles(s);
+    }
+    double refresh_hz = pixel_clock * piomatter::CLOCKS_PER_DATA / cycles;
+
+    printf("%-8s %5zu %6zu %6d %8d %11.2f %11.2f %11.2f %11.2f %11zu %9.1f\n",
+           name, n_lanes, n_panels, n_planes, n_temporal_planes,
+           convert_ns / n_pixels, render_rgb10_ns / n_pixels,
+           render_ns / n_pixels, render_lanes_ns / n_pixels,
+           n_words * sizeof(uint32_t), refresh_hz);
+}
+
+template <typename pinout, size_t n_lanes>
+void bench_kernel_matrix(const char *name) {
+    for (size_t n_panels : {1, 2, 4, 8}) {
+        for (int n_planes : {1, 5, 10}) {
+            for (int n_temporal_planes : {0, 2, 4}) {
+                if (n_temporal_planes && n_temporal_planes >= n_planes) {
+                    continue;
+                }
+                bench_kernels<pinout, n_lanes>(name, n_panels, n_planes,
+                                               n_temporal_planes);
+            }
+        }
+    }
+}
+
+// Time the fused render of a 128x64 Bonnet frame from a 1920x1080 image
+// scaled down to it, against rendering from an image of the panel's size,
+// in us per frame. Scaling reads every source pixel for the box filter, so
+// for large reductions it costs far more than the render itself.
+void bench_scale() {
+    using pinout = piomatter::adafruit_matrix_bonnet_pinout;
+    constexpr size_t src_width = 1920, src_height = 1080;
+    piomatter::matrix_geometry geometry(128, 5, 10, 0, 128, 64, true,
+                                        piomatter::orientation_normal);
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    auto pixels = make_pixels(src_width * src_height);
+    std::span<const uint32_t> span(pixels);
+    std::vector<std::vector<uint32_t>> streams;
+    piomatter::render_scratch scratch;
+
+    piomatter::colorspace_rgb888 converter;
+    double direct_ns = time_ns([&] {
+        piomatter::protomatter_render<pinout>(streams, geometry, skeleton,
+                                              converter, span, scratch);
+    });
+    printf("%-9s %11.1f\n", "unscaled", direct_ns / 1e3);
+    using filter = piomatter::scale_filter;
+    for (auto f : {filter::box, filter::bilinear}) {
+        converter.scale = std::make_shared<const piomatter::source_scaler>(
+            piomatter::source_scale{0, 0, src_width, src_height, src_width, f},
+            geometry.width, geometry.height);
+        double scaled_ns = time_ns([&] {
+            piomatter::protomatter_render<pinout>(streams, geometry, skeleton,
+                                                  converter, span, scratch);
+        });
+        printf("%-9s %11.1f\n", f == filter::box ? "box" : "bilinear",
+               scaled_ns / 1e3);
+    }
+}
+
+pio_mock_xfer_counts mock_xfer_counts() {
+    PIO pio = pio_open_helper(0);
+    pio_mock_xfer_counts total{0, 0};
+    for (uint sm = 0; sm < pio_get_sm_count(pio); sm++) {
+        auto counts = pio_mock_get_xfer_counts(pio, sm);
+        total.calls += counts.calls;
+        total.bytes += counts.bytes;
+    }
+    return total;
+}
+
+void print_system_header() {
+    printf("%-8s %5s %6s %8s %11s %11s %11s %11s\n", "pinout", "lanes",
+           "panels", "threads", "show us", "shows/s", "refreshHz",
+           "bytes/frame");
+}
+
+// Run a piomatter against the mock PIO, calling show() as fast as it allows
+template <typename pinout>
+void bench_system(const char *name, size_t n_lanes, size_t n_panels,
+                  size_t render_threads) {
+    auto geometry = make_geometry(n_panels, n_lanes, 10, 0);
+    auto pixels = make_pixels(geometry.width * geometry.height);
+    piomatter::piomatter_options options;
+    options.render_threads = render_threads;
+    options.pixel_clock = pixel_clock;
+    piomatter::piomatter<pinout> matter(std::span<const uint32_t>(pixels),
+                                        geometry, options);
+
+    auto &stats = matter.stats;
+    stats.reset();
+    auto before = mock_xfer_counts();
+    auto t0 = clock_type::now();
+    double elapsed;
+    size_t n_shows = 0;
+    do {
+        matter.show();
+        n_shows++;
+        elapsed = seconds_since(t0);
+    } while (elapsed < 10 * seconds_per_case);
+    auto after = mock_xfer_counts();
+
+    uint64_t schedules_sent = stats.schedules_sent;
+    double n_frames = double(schedules_sent) / geometry.schedules.size();
+    double show_us = elapsed * 1e6 / n_shows;
+    printf("%-8s %5zu %6zu %8zu %11.1f %11.1f %11.1f %11.0f\n", name,
+           n_lanes, n_panels, render_threads, show_us, n_shows / elapsed,
+           n_frames / elapsed,
+           n_frames ? (after.bytes - before.bytes) / n_frames : 0.);
+}
+
+bool failed = false;
+
+const char *check(bool ok) {
+    failed = failed || !ok;
+    return ok ? "ok" : "MISMATCH";
+}
+
+// How long a pass through every schedule takes on the mock, which sends one
+// word per pixel clock
+uint64_t mock_pass_ns(const piomatter::matrix_geometry &geometry) {
+    auto skeleton = piomatter::make_stream_skeleton<
+        piomatter::adafruit_matrix_bonnet_pinout>(geometry);
+    size_t n_words = 0;
+    for (const auto &stream : skeleton.streams) {
+        n_words += stream.size();
+    }
+    return uint64_t(n_words * 1e9 / pixel_clock);
+}
+
+// Spin until `done`, for up to a second, and give the CLOCK_TAI time at
+// which it was seen, or 0 if it never was
+template <typename F> uint64_t wait_for(F &&done) {
+    uint64_t deadline = piomatter::tains64() + 1000000000;
+    for (;;) {
+        uint64_t now = piomatter::tains64();
+        if (done()) {
+            return now;
+        }
+        if (now > deadline) {
+            return 0;
+        }
+        std::this_thread::yield();
+    }
+}
+
+using check_matter =
+    piomatter::piomatter<piomatter::adafruit_matrix_bonnet_pinout>;
+
+// A timed frame waits for the pass through the schedules that starts nearest
+// its target, and an untimed frame submitted after it waits behind it
+void check_timed_present() {
+    auto geometry = make_geometry(1, 2, 10, 4);
+    auto pixels = make_pixels(geometry.width * geometry.height);
+    piomatter::piomatter_options options;
+    options.pixel_clock = pixel_clock;
+    check_matter matter(std::span<const uint32_t>(pixels), geometry, options);
+    auto &stats = matter.stats;
+    uint64_t pass_ns = mock_pass_ns(geometry);
+    bool ok = wait_for([&] { return stats.frames_shown == 1; }) != 0;
+
+    uint64_t target = piomatter::tains64() + 20 * pass_ns;
+    matter.show_at(target);
+    matter.show();
+    uint64_t timed_shown = wait_for([&] { return stats.frames_shown >= 2; });
+    uint64_t untimed_shown = wait_for([&] { return stats.frames_shown >= 3; });
+    // Allow a little longer than a pass for scheduling on the host
+    uint64_t slack = pass_ns + 2000000;
+    ok = ok && timed_shown && untimed_shown &&
+         timed_shown + pass_ns / 2 >= target &&
+         timed_shown <= target + slack && untimed_shown >= timed_shown &&
+         untimed_shown <= timed_shown + slack &&
+         stats.present_error.count == 1 && stats.presents_late == 0;
+    printf("timed present: %s, shown %+.1fms from target, then %.1fms later "
+           "(pass %.1fms)\n",
+           check(ok), (double(timed_shown) - double(target)) / 1e6,
+           (double(untimed_shown) - double(timed_shown)) / 1e6,
+           pass_ns / 1e6);
+}
+
+// The destructor doesn't wait for a staged frame's target
+void check_staged_exit() {
+    auto geometry = make_geometry(1, 2, 10, 4);
+    auto pixels = make_pixels(geometry.width * geometry.height);
+    piomatter::piomatter_options options;
+    options.pixel_clock = pixel_clock;
+    auto matter = std::make_unique<check_matter>(
+        std::span<const uint32_t>(pixels), geometry, options);
+    uint64_t pass_ns = mock_pass_ns(geometry);
+    bool ok = wait_for([&] { return matter->stats.frames_shown == 1; }) != 0;
+    matter->show_at(piomatter::tains64() + UINT64_C(10000000000));
+    std::this_thread::sleep_for(std::chrono::nanoseconds(3 * pass_ns));
+    ok = ok && matter->stats.frames_shown == 1;
+    auto t0 = clock_type::now();
+    matter.reset();
+    double elapsed = seconds_since(t0);
+    ok = ok && elapsed < 0.1 + 2 * pass_ns / 1e9;
+    printf("exit with a staged frame: %s, %.1fms\n", check(ok),
+           elapsed * 1e3);
+}
+
+// Count the frames that go on display other than at the start of a pass
+// through the schedules, submitting them at assorted points in the pass
+size_t mid_pass_swaps(piomatter::present_mode present) {
+    auto geometry = make_geometry(1, 2, 10, 4);
+    auto pixels = make_pixels(geometry.width * geometry.height);
+    piomatter::piomatter_options options;
+    options.pixel_clock = pixel_clock;
+    options.present = present;
+    check_matter matter(std::span<const uint32_t>(pixels), geometry, options);
+    auto &stats = matter.stats;
+    const size_t n_schedules = geometry.schedules.size();
+    uint64_t pass_ns = mock_pass_ns(geometry);
+    size_t result = 0;
+    uint32_t state = 1;
+    for (uint64_t shown = 1; shown <= 20; shown++) {
+        if (!wait_for([&] { return stats.frames_shown == shown; })) {
+            return SIZE_MAX;
+        }
+        // The refresh thread counts the schedule only once it is sent, so
+        // the count read just after a swap is that of the pass before it
+        if (shown > 1 && stats.schedules_sent % n_schedules != 0) {
+            result++;
+        }
+        state = state * 1103515245 + 12345;
+        std::this_thread::sleep_for(
+            std::chrono::nanoseconds((state >> 16) % pass_ns));
+        matter.show();
+    }
+    return result;
+}
+
+// present_mode::sequence_boundary only swaps frames as a pass starts, which
+// immediate mode, as a control, doesn't wait for
+void check_sequence_boundary() {
+    size_t boundary =
+        mid_pass_swaps(piomatter::present_mode::sequence_boundary);
+    size_t immediate = mid_pass_swaps(piomatter::present_mode::immediate);
+    printf("sequence boundary: %s, %zu of 19 frames swapped mid-pass, %zu "
+           "when immediate\n",
+           check(boundary == 0 && immediate > 0 && immediate != SIZE_MAX),
+           boundary, immediate);
+}
+
+int run_checks() {
+    check_timed_present();
+    check_staged_exit();
+    check_sequence_boundary();
+    return failed ? EXIT_FAILURE : 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc == 2 && !strcmp(argv[1], "--check")) {
+        return run_checks();
+    }
+    if (argc > 1) {
+        pixel_clock = atof(argv[1]);
+    }
+    if (argc > 2) {
+        seconds_per_case = atof(argv[2]);
+    }
+    if (pixel_clock <= 0 || seconds_per_case <= 0) {
+        fprintf(stderr,
+                "usage: %s [pixel_clock_hz [seconds_per_case]]\n"
+                "       %s --check\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    printf("pixel clock %.0f Hz, %s\n\n", pixel_clock,
+#if PIOMATTER_NEON
+           "NEON"
+#else
+           "scalar"
+#endif
+    );
+
+    print_kernel_header();
+    bench_kernel_matrix<piomatter::adafruit_matrix_bonnet_pinout, 2>("bonnet");
+    bench_kernel_matrix<piomatter::active3_pinout, 2>("active3");
+    bench_kernel_matrix<piomatter::active3_pinout, 4>("active3");
+    bench_kernel_matrix<piomatter::active3_pinout, 6>("active3");
+
+    printf("\n1920x1080 to 128x64, bonnet, 10 planes\n%-9s %11s\n", "filter",
+           "render us");
+    bench_scale();
+
+    // The mock paces transfers at two PIO cycles per word and doesn't model
+    // delays, so its refresh rate is an upper bound on the real one
+    printf("\n");
+    print_system_header();
+    for (size_t n_panels : {1, 4}) {
+        bench_system<piomatter::adafruit_matrix_bonnet_pinout>(
+            "bonnet", 2, n_panels, 0);
+        bench_system<piomatter::active3_pinout>("active3", 6, n_panels, 0);
+        bench_system<piomatter::active3_pinout>("active3", 6, n_panels, 2);
+    }
+    return 0;
+}
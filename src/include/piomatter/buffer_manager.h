@@ -1,18 +1,31 @@
 #pragma once
-#include "thread_queue.h"
+#include <stdexcept>
+
+#include "spsc_queue.h"
 
 namespace piomatter {
 
 struct buffer_manager {
     enum { no_buffer = -1, exit_request = -2 };
 
-    buffer_manager() {
-        free_buffers.push(0);
-        free_buffers.push(1);
-        free_buffers.push(2);
+    // The blitter always holds one buffer, so at least 2 are needed; the
+    // queues have room for 15 plus an exit request
+    static constexpr size_t min_buffers = 2, max_buffers = 15;
+
+    buffer_manager(size_t n_buffers = 3) {
+        if (n_buffers < min_buffers || n_buffers > max_buffers) {
+            throw std::runtime_error("buffer count must be from 2 to 15");
+        }
+        for (size_t i = 0; i < n_buffers; i++) {
+            free_buffers.push(i);
+        }
     }
 
     int get_free_buffer() { return free_buffers.pop_blocking(); }
+    int try_get_free_buffer() {
+        auto r = free_buffers.pop_nonblocking();
+        return r ? r.value() : no_buffer;
+    }
     void put_free_buffer(int i) { free_buffers.push(i); }
 
     int get_filled_buffer() {
@@ -20,12 +33,36 @@ struct buffer_manager {
         return r ? r.value() : no_buffer;
     }
 
+    // Like get_filled_buffer, but when several buffers have been filled,
+    // return only the most recent one and free the others, adding their
+    // number to n_dropped
+    int get_newest_filled_buffer(uint64_t &n_dropped) {
+        int r = get_filled_buffer();
+        if (r < 0) {
+            return r;
+        }
+        int newer;
+        while ((newer = get_filled_buffer()) != no_buffer) {
+            if (newer == exit_request) {
+                return newer;
+            }
+            put_free_buffer(r);
+            n_dropped++;
+            r = newer;
+        }
+        return r;
+    }
+
+    // Like get_filled_buffer, but sleeps until a buffer (or an exit request)
+    // arrives instead of returning no_buffer
+    int wait_filled_buffer() { return filled_buffers.pop_blocking(); }
+
     void put_filled_buffer(int i) { filled_buffers.push(i); }
 
     void request_exit() { filled_buffers.push(exit_request); }
 
   private:
-    thread_queue<int> free_buffers, filled_buffers;
+    spsc_queue<int, 16> free_buffers, filled_buffers;
 };
 
 } // namespace piomatter
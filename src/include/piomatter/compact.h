@@ -0,0 +1,147 @@
+#pragma once
+
+#include "piomatter/render.h"
+#include <cstdint>
+#include <vector>
+
+namespace piomatter {
+
+// The compact stream format, for protomatter_compact.pio, adds a repeat
+// command to the standard format's data and delay commands, so that a run of
+// identical pixels takes two words instead of one word per pixel:
+// MSB ... LSB
+// 0 ddd......ddd: 31-bit delay, then one data word
+// 1 1 cc.....ccc: 30-bit data count, then that many data words
+// 1 0 cc.....ccc: 30-bit repeat count, then one data word that is clocked
+//                 out that many times
+//
+// Data words still carry every pin rather than only the RGB lanes of
+// several pixels: a narrower `out pins` group would have to span the RGB
+// pins, which aren't contiguous, and that span holds the clock, latch and
+// address pins too (GPIO 5-23 on the Bonnet, 2-27 on the Active3), so it
+// could still only fit one pixel per word.
+constexpr uint32_t compact_command_delay = 0;
+constexpr uint32_t compact_command_data = 3u << 30;
+constexpr uint32_t compact_command_repeat = 2u << 30;
+
+// Shorter runs are no smaller as a repeat command than as literal words
+constexpr size_t compact_min_repeat = 4;
+
+namespace detail {
+// The cycles from a command's first `out` to the `out pins` of its first
+// data word. The previous data word stays on the pins meanwhile.
+constexpr uint32_t standard_lead_cycles = 3;
+constexpr uint32_t compact_delay_lead_cycles = 3;
+constexpr uint32_t compact_data_lead_cycles = 5;
+} // namespace detail
+
+// The number of PIO cycles protomatter_compact.pio takes to play a stream
+inline uint64_t compact_stream_cycles(const std::vector<uint32_t> &stream) {
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < stream.size();) {
+        uint32_t header = stream[i++];
+        if (!(header & command_data)) {
+            cycles += DELAY_OVERHEAD + (header + 1) * CLOCKS_PER_DELAY;
+            i++;
+        } else if ((header & compact_command_data) == compact_command_repeat) {
+            size_t n = (header & ~compact_command_data) + 1;
+            cycles +=
+                detail::compact_data_lead_cycles + 2 + n * CLOCKS_PER_DATA;
+            i++;
+        } else {
+            size_t n = (header & ~compact_command_data) + 1;
+            cycles += detail::compact_data_lead_cycles + n * CLOCKS_PER_DATA;
+            i += n;
+        }
+    }
+    return cycles;
+}
+
+// Re-encode a standard stream for protomatter_compact.pio.
+//
+// Runs of identical data words become repeat commands, but only where the
+// panel is dark (/OE inactive) during the run and the word before it, so the
+// longer decoding of data and repeat commands is never lit. Delays decode
+// exactly as in protomatter.pio and are adjusted for the command after them,
+// so the time each lit word spends on the pins, and with it the brightness
+// of each bit plane, is the same as for the standard stream.
+//
+// Runs shorter than min_repeat are sent literally.
+template <typename pinout>
+void compact_stream(std::vector<uint32_t> &result,
+                    const std::vector<uint32_t> &stream,
+                    size_t min_repeat = compact_min_repeat) {
+    auto lit = [](uint32_t word) {
+        return (word & pinout::oe_bit) == pinout::oe_active;
+    };
+
+    result.clear();
+    result.reserve(stream.size());
+
+    // A delay can only be re-encoded once the command after it is known
+    bool have_delay = false;
+    uint32_t delay = 0, delay_word = 0;
+    auto flush_delay = [&](uint32_t next_lead_cycles) {
+        if (!have_delay) {
+            return;
+        }
+        // Both programs hold the delay word for y + 3 cycles plus the lead
+        // of the command that follows
+        uint32_t want = delay + detail::standard_lead_cycles;
+        uint32_t y = want > next_lead_cycles ? want - next_lead_cycles : 0;
+        result.push_back(compact_command_delay | y);
+        result.push_back(delay_word);
+        have_delay = false;
+    };
+
+    // Every stream ends with the panel dark, ready for the next
+    uint32_t prev_word = pinout::oe_inactive;
+    size_t i = 0;
+    while (i < stream.size()) {
+        uint32_t header = stream[i++];
+        if (!(header & command_data)) {
+            flush_delay(detail::compact_delay_lead_cycles);
+            delay = header;
+            delay_word = prev_word = stream[i++];
+            have_delay = true;
+            continue;
+        }
+
+        size_t n = (header & ~command_data) + 1;
+        const uint32_t *words = &stream[i];
+        i += n;
+        size_t literal_begin = 0;
+        auto flush_literal = [&](size_t end) {
+            if (end == literal_begin) {
+                return;
+            }
+            flush_delay(detail::compact_data_lead_cycles);
+            result.push_back(compact_command_data | (end - literal_begin - 1));
+            result.insert(result.end(), words + literal_begin, words + end);
+        };
+        for (size_t x = 0; x < n;) {
+            size_t run_end = x + 1;
+            while (run_end < n && words[run_end] == words[x]) {
+                run_end++;
+            }
+            // If the word before the run is lit, send the run's first word
+            // literally so that it is dark instead
+            size_t run_begin = x + lit(x ? words[x - 1] : prev_word);
+            if (!lit(words[x]) && run_end - run_begin >= min_repeat) {
+                flush_literal(run_begin);
+                flush_delay(detail::compact_data_lead_cycles);
+                result.push_back(compact_command_repeat |
+                                 (run_end - run_begin - 1));
+                result.push_back(words[x]);
+                literal_begin = run_end;
+            }
+            x = run_end;
+        }
+        flush_literal(n);
+        prev_word = words[n - 1];
+    }
+    // The stream is followed by the next one, which starts with data
+    flush_delay(detail::compact_data_lead_cycles);
+}
+
+} // namespace piomatter
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace piomatter {
+
+// Pre-rendered frames for a piomatter to play, each the streams that it
+// sends for every schedule, in the format it sends them or, for a sequence
+// that it dims and re-encodes as it plays, in the standard format
+struct frame_source {
+    using bufseq_type = std::vector<std::vector<uint32_t>>;
+
+    virtual ~frame_source() {}
+    virtual size_t size() const = 0;
+    virtual uint64_t duration_ns(size_t i) const = 0;
+    // Store the streams of frame i. Frames are asked for in order, going
+    // back to 0 when a sequence loops.
+    virtual void get(size_t i, bufseq_type &streams) = 0;
+};
+
+// Frames kept in memory
+struct memory_frame_source : frame_source {
+    size_t size() const override { return frames.size(); }
+    uint64_t duration_ns(size_t i) const override { return durations_ns[i]; }
+    void get(size_t i, bufseq_type &streams) override { streams = frames[i]; }
+
+    std::vector<bufseq_type> frames;
+    std::vector<uint64_t> durations_ns;
+};
+
+} // namespace piomatter
@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace piomatter {
+
+// The wire format of frames pushed to a matrix over the network. Each UDP
+// datagram, or each WebSocket binary message, is an ingest_packet_header
+// followed by one fragment of a frame. Frames are split into fragments of
+// fragment_size bytes, the last of them possibly shorter, and fragment i
+// holds the frame's bytes from i * fragment_size. All fields are little
+// endian.
+//
+// A frame is either the bytes of a framebuffer in the receiver's colorspace,
+// or pre-rendered streams: for each schedule, the number of words in its
+// stream, and then the words of each stream in turn, in the receiver's
+// stream format.
+constexpr uint32_t ingest_magic = 0x31464d50; // "PMF1"
+constexpr uint8_t ingest_version = 1;
+
+enum ingest_kind : uint8_t { ingest_pixels, ingest_streams };
+
+// A sequence number this far from the newest one seen means that the sender
+// restarted, rather than that packets are late or lost
+constexpr int32_t ingest_resync_frames = 1 << 16;
+
+struct ingest_packet_header {
+    uint32_t magic;
+    uint8_t version, kind;
+    uint16_t fragment_count;
+    // Numbers frames in the order they are to be shown, wrapping around
+    uint32_t sequence;
+    uint16_t fragment_index, reserved;
+    uint32_t frame_size, fragment_size;
+    // For ingest_streams, the stream_format_id() the streams were rendered
+    // for; otherwise 0
+    uint64_t format_id;
+};
+static_assert(sizeof(ingest_packet_header) == 32);
+
+struct ingest_stats {
+    uint64_t packets = 0;
+    uint64_t frames_received = 0;
+    // Frames that were missing from the sequence, or were superseded before
+    // all of their fragments arrived
+    uint64_t frames_dropped = 0;
+    // Fragments of frames older than the newest one seen, which arrived too
+    // late to be shown
+    uint64_t packets_late = 0;
+    uint64_t packets_duplicate = 0;
+    uint64_t packets_invalid = 0;
+};
+
+// Puts frames back together from their fragments, as they arrive in any
+// order. Pixel frames are written straight into the framebuffer; the frame
+// being received is abandoned as soon as a fragment of a newer one arrives,
+// so a lost packet costs one frame rather than stalling the stream.
+struct frame_assembler {
+    enum result { pending, pixels_ready, streams_ready, rejected };
+
+    frame_assembler(std::span<uint8_t> framebuffer, size_t max_stream_bytes)
+        : framebuffer(framebuffer), max_stream_bytes(max_stream_bytes) {}
+
+    result add(std::span<const uint8_t> packet) {
+        stats.packets++;
+        ingest_packet_header h;
+        if (packet.size() < sizeof(h)) {
+            return invalid();
+        }
+        memcpy(&h, packet.data(), sizeof(h));
+        auto payload = packet.subspan(sizeof(h));
+        if (h.magic != ingest_magic || h.version != ingest_version) {
+            return invalid();
+        }
+
+        if (!active || h.sequence != current.sequence) {
+            int32_t ahead = h.sequence - newest;
+            bool resync = !have_newest || ahead <= -ingest_resync_frames ||
+                          ahead > ingest_resync_frames;
+            if (!resync && ahead <= 0) {
+                stats.packets_late++;
+                return rejected;
+            }
+            if (!valid_frame(h)) {
+                return invalid();
+            }
+            if (active) {
+                stats.frames_dropped++;
+            }
+            if (!resync) {
+                stats.frames_dropped += ahead - 1;
+            }
+            newest = h.sequence;
+            have_newest = true;
+            active = true;
+            current = h;
+            n_received = 0;
+            received.assign(h.fragment_count, false);
+            if (h.kind == ingest_streams) {
+                stream_words.resize((h.frame_size + 3) / 4);
+            }
+        } else if (h.kind != current.kind ||
+                   h.fragment_count != current.fragment_count ||
+                   h.frame_size != current.frame_size ||
+                   h.fragment_size != current.fragment_size ||
+                   h.format_id != current.format_id) {
+            return invalid();
+        }
+
+        if (h.fragment_index >= h.fragment_count) {
+            return invalid();
+        }
+        size_t offset = size_t(h.fragment_index) * h.fragment_size;
+        if (payload.size() !=
+            std::min<size_t>(h.fragment_size, h.frame_size - offset)) {
+            return invalid();
+        }
+        if (received[h.fragment_index]) {
+            stats.packets_duplicate++;
+            return pending;
+        }
+        uint8_t *dest = h.kind == ingest_pixels
+                            ? framebuffer.data()
+                            : reinterpret_cast<uint8_t *>(stream_words.data());
+        memcpy(dest + offset, payload.data(), payload.size());
+        received[h.fragment_index] = true;
+        if (++n_received < h.fragment_count) {
+            return pending;
+        }
+        active = false;
+        stats.frames_received++;
+        return h.kind == ingest_pixels ? pixels_ready : streams_ready;
+    }
+
+    // The bytes of the streams frame that add() last returned streams_ready
+    // for
+    std::span<const uint8_t> streams() const {
+        return {reinterpret_cast<const uint8_t *>(stream_words.data()),
+                current.frame_size};
+    }
+    uint64_t format_id() const { return current.format_id; }
+
+    ingest_stats stats;
+
+  private:
+    result invalid() {
+        stats.packets_invalid++;
+        return rejected;
+    }
+
+    bool valid_frame(const ingest_packet_header &h) const {
+        if (h.kind == ingest_pixels) {
+            if (h.frame_size != framebuffer.size()) {
+                return false;
+            }
+        } else if (h.kind != ingest_streams ||
+                   h.frame_size > max_stream_bytes) {
+            return false;
+        }
+        return h.frame_size && h.fragment_size &&
+               h.fragment_count ==
+                   (uint64_t(h.frame_size) + h.fragment_size - 1) /
+                       h.fragment_size;
+    }
+
+    std::span<uint8_t> framebuffer;
+    size_t max_stream_bytes;
+    bool active = false, have_newest = false;
+    ingest_packet_header current{};
+    uint32_t newest = 0;
+    size_t n_received = 0;
+    std::vector<bool> received;
+    // Word aligned, so that the streams can be used in place
+    std::vector<uint32_t> stream_words;
+};
+
+// Split the bytes of a streams frame into its streams. Returns false if they
+// aren't `n_schedules` streams as described in the wire format.
+inline bool split_streams(std::span<const uint8_t> frame, size_t n_schedules,
+                          std::vector<std::span<const uint32_t>> &streams) {
+    if (frame.size() % 4 != 0 || frame.size() / 4 < n_schedules) {
+        return false;
+    }
+    std::span<const uint32_t> words(
+        reinterpret_cast<const uint32_t *>(frame.data()), frame.size() / 4);
+    auto sizes = words.first(n_schedules);
+    words = words.subspan(n_schedules);
+    streams.clear();
+    for (auto size : sizes) {
+        if (size > words.size()) {
+            return false;
+        }
+        streams.push_back(words.first(size));
+        words = words.subspan(size);
+    }
+    return words.empty();
+}
+
+namespace detail {
+inline std::array<uint8_t, 20> sha1(std::string_view data) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                     0xc3d2e1f0};
+    std::string msg(data);
+    uint64_t n_bits = uint64_t(data.size()) * 8;
+    msg += '\x80';
+    while (msg.size() % 64 != 56) {
+        msg += '\0';
+    }
+    for (int i = 7; i >= 0; i--) {
+        msg += char(n_bits >> (i * 8));
+    }
+    auto rol = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const auto *p =
+                reinterpret_cast<const uint8_t *>(&msg[chunk + 4 * i]);
+            w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+                   uint32_t(p[2]) << 8 | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::array<uint8_t, 20> result;
+    for (int i = 0; i < 20; i++) {
+        result[i] = h[i / 4] >> (24 - 8 * (i % 4));
+    }
+    return result;
+}
+
+inline std::string base64(std::span<const uint8_t> data) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < data.size()) {
+            v |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < data.size()) {
+            v |= data[i + 2];
+        }
+        result += digits[(v >> 18) & 63];
+        result += digits[(v >> 12) & 63];
+        result += i + 1 < data.size() ? digits[(v >> 6) & 63] : '=';
+        result += i + 2 < data.size() ? digits[v & 63] : '=';
+    }
+    return result;
+}
+} // namespace detail
+
+// The response to a WebSocket opening handshake, or nothing if `request`
+// isn't one. The request is everything up to and including its blank line.
+inline std::optional<std::string>
+websocket_handshake(std::string_view request) {
+    constexpr std::string_view field = "sec-websocket-key:";
+    std::optional<std::string> key;
+    for (size_t pos = 0; pos < request.size();) {
+        size_t end = request.find("\r\n", pos);
+        if (end == std::string_view::npos) {
+            end = request.size();
+        }
+        auto line = request.substr(pos, end - pos);
+        pos = end + 2;
+        if (line.size() < field.size() ||
+            !std::equal(field.begin(), field.end(), line.begin(),
+                        [](char a, char b) { return a == tolower(b); })) {
+            continue;
+        }
+        auto value = line.substr(field.size());
+        auto first = value.find_first_not_of(" \t");
+        auto last = value.find_last_not_of(" \t");
+        if (first != std::string_view::npos) {
+            key = std::string(value.substr(first, last - first + 1));
+        }
+    }
+    if (!key) {
+        return std::nullopt;
+    }
+    auto digest =
+        detail::sha1(*key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    return "HTTP/1.1 101 Switching Protocols\r\n"
+           "Upgrade: websocket\r\n"
+           "Connection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " +
+           detail::base64(digest) + "\r\n\r\n";
+}
+
+enum websocket_opcode : uint8_t {
+    websocket_continuation = 0,
+    websocket_text = 1,
+    websocket_binary = 2,
+    websocket_close = 8,
+    websocket_ping = 9,
+    websocket_pong = 10,
+};
+
+struct websocket_frame {
+    bool fin, masked;
+    uint8_t opcode;
+    std::array<uint8_t, 4> mask;
+    uint64_t payload_size;
+    // The size of the frame's header, before the payload
+    size_t header_size;
+};
+
+// Parse the header of the WebSocket frame at the start of `data`. Returns
+// false if `data` doesn't hold all of it yet.
+inline bool parse_websocket_frame(std::span<const uint8_t> data,
+                                  websocket_frame &frame) {
+    if (data.size() < 2) {
+        return false;
+    }
+    frame.fin = data[0] & 0x80;
+    frame.opcode = data[0] & 0x0f;
+    frame.masked = data[1] & 0x80;
+    frame.payload_size = data[1] & 0x7f;
+    size_t pos = 2;
+    size_t n_size_bytes = frame.payload_size == 126   ? 2
+                          : frame.payload_size == 127 ? 8
+                                                      : 0;
+    if (data.size() < pos + n_size_bytes + (frame.masked ? 4 : 0)) {
+        return false;
+    }
+    if (n_size_bytes) {
+        frame.payload_size = 0;
+        for (size_t i = 0; i < n_size_bytes; i++) {
+            frame.payload_size = frame.payload_size << 8 | data[pos++];
+        }
+    }
+    if (frame.masked) {
+        std::copy_n(&data[pos], 4, frame.mask.begin());
+        pos += 4;
+    }
+    frame.header_size = pos;
+    return true;
+}
+
+// The header of an unmasked frame sent by a server
+inline std::vector<uint8_t> websocket_frame_header(uint8_t opcode,
+                                                   size_t payload_size) {
+    std::vector<uint8_t> result{uint8_t(0x80 | opcode)};
+    if (payload_size < 126) {
+        result.push_back(payload_size);
+    } else {
+        int n_size_bytes = payload_size < 65536 ? 2 : 8;
+        result.push_back(n_size_bytes == 2 ? 126 : 127);
+        for (int i = n_size_bytes - 1; i >= 0; i--) {
+            result.push_back(uint64_t(payload_size) >> (i * 8));
+        }
+    }
+    return result;
+}
+
+} // namespace piomatter
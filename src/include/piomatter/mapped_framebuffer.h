@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "piomatter/piomatter.h"
+
+namespace piomatter {
+
+// A read-only mapping of an image that something else draws: a Linux
+// framebuffer device such as /dev/fb0, or a DMA-BUF exported by a display,
+// GPU or video driver. A piomatter renders straight from the mapping through
+// a window_geometry, so mirroring part of a screen copies no pixels.
+struct mapped_framebuffer {
+    // Map the whole virtual area of a framebuffer device
+    explicit mapped_framebuffer(const std::string &path) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        fb_var_screeninfo var;
+        fb_fix_screeninfo fix;
+        if (ioctl(fd, FBIOGET_VSCREENINFO, &var) != 0 ||
+            ioctl(fd, FBIOGET_FSCREENINFO, &fix) != 0) {
+            int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        width = var.xres_virtual;
+        height = var.yres_virtual;
+        stride = fix.line_length;
+        bits_per_pixel = var.bits_per_pixel;
+        map(std::min(size_t{fix.smem_len}, stride * height), 0);
+    }
+
+    // Map a DMA-BUF holding a `width` x `height` image whose rows are
+    // `stride` bytes apart, starting `offset` bytes in. The descriptor is
+    // duplicated, so the caller may close theirs.
+    mapped_framebuffer(int dmabuf_fd, size_t width, size_t height,
+                       size_t stride, size_t bits_per_pixel,
+                       size_t offset = 0)
+        : width(width), height(height), stride(stride),
+          bits_per_pixel(bits_per_pixel), dmabuf(true) {
+        if (stride * 8 < width * bits_per_pixel) {
+            throw std::range_error("stride is too small for the width");
+        }
+        fd = fcntl(dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "dup dmabuf");
+        }
+        map(offset + stride * height, offset);
+    }
+
+    mapped_framebuffer(const mapped_framebuffer &) = delete;
+    mapped_framebuffer &operator=(const mapped_framebuffer &) = delete;
+
+    ~mapped_framebuffer() {
+        munmap(const_cast<uint8_t *>(base), map_size);
+        close(fd);
+    }
+
+    // The image as elements of T, `stride / sizeof(T)` to a row
+    template <typename T> std::span<const T> pixels() const {
+        return {reinterpret_cast<const T *>(base + offset),
+                stride * height / sizeof(T)};
+    }
+
+    // Bracket reading the pixels, so that the CPU sees what devices wrote to
+    // a DMA-BUF. Each returns 0 or an errno value.
+    int begin_read() const { return sync(DMA_BUF_SYNC_START); }
+    int end_read() const { return sync(DMA_BUF_SYNC_END); }
+
+    // Wait for the next vertical sync of a framebuffer device. Returns false
+    // at once if the device can't report them.
+    bool wait_vsync() const {
+        if (dmabuf) {
+            return false;
+        }
+        __u32 crtc = 0;
+        return ioctl(fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+    }
+
+    size_t width = 0, height = 0;
+    // In bytes
+    size_t stride = 0;
+    size_t bits_per_pixel = 0;
+
+  private:
+    void map(size_t size, size_t start) {
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "mmap");
+        }
+        base = static_cast<const uint8_t *>(addr);
+        map_size = size;
+        offset = start;
+        if (stride * height > size - offset) {
+            height = (size - offset) / stride;
+        }
+    }
+
+    int sync(__u64 flags) const {
+        if (!dmabuf) {
+            return 0;
+        }
+        dma_buf_sync arg{flags | DMA_BUF_SYNC_READ};
+        while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &arg) != 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                return errno;
+            }
+        }
+        return 0;
+    }
+
+    int fd = -1;
+    bool dmabuf = false;
+    const uint8_t *base = nullptr;
+    size_t map_size = 0, offset = 0;
+};
+
+// Calls show() on a piomatter that renders from a mapped framebuffer, from a
+// thread of its own, until destroyed. With `vsync`, each frame follows a
+// vertical sync of the framebuffer, if it reports them. Otherwise frames are
+// paced at `max_fps`, or 0 to show them as fast as the piomatter takes them.
+struct framebuffer_mirror {
+    framebuffer_mirror(piomatter_base &matter,
+                       const mapped_framebuffer &source, bool vsync,
+                       double max_fps)
+        : matter(matter), source(source), vsync(vsync), max_fps(max_fps) {
+        thread = std::thread{&framebuffer_mirror::run, this};
+    }
+
+    framebuffer_mirror(const framebuffer_mirror &) = delete;
+    framebuffer_mirror &operator=(const framebuffer_mirror &) = delete;
+
+    ~framebuffer_mirror() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stop_requested.notify_all();
+        thread.join();
+    }
+
+    // The errno value that stopped the mirror, or 0 while it runs
+    std::atomic<int> error{0};
+
+  private:
+    void run() {
+        using clock = std::chrono::steady_clock;
+        auto period = std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(max_fps > 0 ? 1 / max_fps : 0));
+        auto next = clock::now();
+        bool use_vsync = vsync;
+        for (;;) {
+            if (use_vsync) {
+                use_vsync = source.wait_vsync();
+            }
+            if (!use_vsync && max_fps > 0) {
+                next = std::max(next + period, clock::now());
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stop_requested.wait_until(lock, next,
+                                              [this] { return stopping; })) {
+                    return;
+                }
+            }
+            int err = source.begin_read();
+            if (err == 0) {
+                err = matter.show();
+                source.end_read();
+            }
+            if (err > 0) {
+                error = err;
+                return;
+            }
+        }
+    }
+
+    piomatter_base &matter;
+    const mapped_framebuffer &source;
+    bool vsync;
+    double max_fps;
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread thread;
+};
+
+} // namespace piomatter
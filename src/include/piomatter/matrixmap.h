@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cmath>
+#include <compare>
+#include <cstdint>
+#include <span>
+#include <utility>
 #include <stdexcept>
 #include <vector>
 
@@ -83,6 +88,7 @@ matrix_map make_matrixmap(size_t width, size_t height, size_t n_addr_lines,
 
 struct schedule_entry {
     uint32_t shift, active_time;
+    auto operator<=>(const schedule_entry &) const = default;
 };
 
 using schedule = std::vector<schedule_entry>;
@@ -107,6 +113,28 @@ schedule_sequence rescale_schedule(schedule_sequence ss, size_t pixels_across) {
     return ss;
 }
 
+// A copy of a schedule sequence with each entry's OE time scaled by
+// `brightness` and by `plane_duty[shift]`, if given. Entries that were lit
+// keep at least one pixel clock, so every plane still shows at low
+// brightness, though the lowest then lose their exact ratios.
+inline schedule_sequence dim_schedule(schedule_sequence ss, double brightness,
+                                      std::span<const double> plane_duty = {}) {
+    for (auto &s : ss) {
+        for (auto &ent : s) {
+            double scale = brightness;
+            if (ent.shift < plane_duty.size()) {
+                scale *= plane_duty[ent.shift];
+            }
+            uint32_t active_time = std::lround(ent.active_time * scale);
+            if (ent.active_time && scale > 0 && !active_time) {
+                active_time = 1;
+            }
+            ent.active_time = active_time;
+        }
+    }
+    return ss;
+}
+
 schedule_sequence make_simple_schedule(int n_planes, size_t pixels_across) {
     if (n_planes < 1 || n_planes > 10) {
         throw std::range_error("n_planes out of range");
@@ -157,6 +185,95 @@ schedule_sequence make_temporal_dither_schedule(int n_planes,
     return rescale_schedule(result, pixels_across);
 }
 
+// `count` consecutive pixels of one lane whose framebuffer indices are
+// start, start + stride, start + 2 * stride, ...
+struct map_run {
+    int start, stride;
+    uint32_t count;
+};
+
+// The part of a matrix map for one address row: `n` entries, in the map's
+// order of pixel then lane. It is given either by the map's own indices or,
+// when the map is piecewise affine, by runs, so that walking it needs no
+// index loads.
+struct row_map {
+    const int *indices;
+    // For each lane in turn, its runs in pixel order. Used when indices is
+    // null.
+    std::span<const map_run> runs;
+    // The number of runs of each lane, which must be the same for all lanes
+    size_t runs_per_lane;
+    size_t n_lanes, n;
+    // The address row, whose entries start at addr * n in the whole map
+    size_t addr;
+
+    // Call f(i, index) for each entry i of the row and its framebuffer index
+    template <typename F> void for_each(F &&f) const {
+        if (indices) {
+            for (size_t i = 0; i < n; i++) {
+                f(i, indices[i]);
+            }
+            return;
+        }
+        const map_run *run = runs.data();
+        for (size_t lane = 0; lane < n_lanes; lane++) {
+            size_t i = lane;
+            for (size_t r = 0; r < runs_per_lane; r++, run++) {
+                int index = run->start;
+                for (uint32_t j = 0; j < run->count; j++) {
+                    f(i, index);
+                    i += n_lanes;
+                    index += run->stride;
+                }
+            }
+        }
+    }
+};
+
+namespace detail {
+// Split each lane of each address row of a map into affine runs. Returns no
+// runs if that's not a smaller description of the map, which is also the
+// case if the lanes of some row need different numbers of runs.
+inline std::vector<map_run> make_map_runs(const matrix_map &map,
+                                          size_t pixels_across,
+                                          size_t n_lanes, size_t n_rows,
+                                          size_t &runs_per_lane) {
+    std::vector<map_run> result;
+    runs_per_lane = 0;
+    for (size_t row = 0; row < n_rows; row++) {
+        const int *indices = &map[row * pixels_across * n_lanes];
+        for (size_t lane = 0; lane < n_lanes; lane++) {
+            size_t n_runs = 0;
+            for (size_t x = 0; x < pixels_across;) {
+                map_run run{indices[x * n_lanes + lane], 0, 1};
+                if (x + 1 < pixels_across) {
+                    run.stride = indices[(x + 1) * n_lanes + lane] - run.start;
+                }
+                while (x + run.count < pixels_across &&
+                       indices[(x + run.count) * n_lanes + lane] ==
+                           run.start + int(run.count) * run.stride) {
+                    run.count++;
+                }
+                result.push_back(run);
+                n_runs++;
+                x += run.count;
+            }
+            if (row == 0 && lane == 0) {
+                runs_per_lane = n_runs;
+            } else if (n_runs != runs_per_lane) {
+                return {};
+            }
+        }
+    }
+    // A run takes the space of 3 indices, and it only pays to skip the index
+    // loads for runs of a few pixels
+    if (result.size() * 4 > map.size()) {
+        return {};
+    }
+    return result;
+}
+} // namespace detail
+
 struct matrix_geometry {
     template <typename Cb>
     matrix_geometry(size_t pixels_across, size_t n_addr_lines, int n_planes,
@@ -170,8 +287,8 @@ struct matrix_geometry {
     matrix_geometry(size_t pixels_across, size_t n_addr_lines, int n_planes,
                     int n_temporal_planes, size_t width, size_t height,
                     matrix_map map, size_t n_lanes)
-        : matrix_geometry(pixels_across, n_addr_lines, width, height, map,
-                          n_lanes,
+        : matrix_geometry(pixels_across, n_addr_lines, width, height,
+                          std::move(map), n_lanes,
                           make_temporal_dither_schedule(n_planes, pixels_across,
                                                         n_temporal_planes)) {}
 
@@ -180,17 +297,59 @@ struct matrix_geometry {
                     const schedule_sequence &schedules)
         : pixels_across(pixels_across), n_addr_lines(n_addr_lines),
           n_lanes(n_lanes), width(width), height(height),
-          map(map), schedules{schedules} {
+          map(std::move(map)), schedules{schedules} {
         size_t pixels_down = n_lanes << n_addr_lines;
-        if (map.size() != pixels_down * pixels_across) {
+        if (this->map.size() != pixels_down * pixels_across) {
             throw std::range_error(
                 "map size does not match calculated pixel count");
         }
+        runs = detail::make_map_runs(this->map, pixels_across, n_lanes,
+                                     size_t{1} << n_addr_lines, runs_per_lane);
+    }
+
+    // The entries of the map for address row `addr`
+    row_map row(size_t addr) const {
+        size_t n = n_lanes * pixels_across;
+        if (runs.empty()) {
+            return {&map[n * addr], {}, 0, n_lanes, n, addr};
+        }
+        size_t runs_per_row = runs_per_lane * n_lanes;
+        return {nullptr,
+                std::span(runs).subspan(runs_per_row * addr, runs_per_row),
+                runs_per_lane, n_lanes, n, addr};
     }
 
     size_t pixels_across, n_addr_lines, n_lanes;
     size_t width, height;
     matrix_map map;
     schedule_sequence schedules;
+    // The map as affine runs, or empty if it is better left as indices
+    std::vector<map_run> runs;
+    size_t runs_per_lane = 0;
 };
+
+// The number of pixels an image must hold for a window of a geometry's size
+// at (x, y), with rows `stride` pixels apart
+inline size_t window_extent(const matrix_geometry &geometry, size_t x,
+                            size_t y, size_t stride) {
+    return (y + geometry.height - 1) * stride + x + geometry.width;
+}
+
+// A copy of `geometry` whose map reads its width x height pixels from the
+// window at (x, y) of a larger image, with rows `stride` pixels apart,
+// instead of from an image of exactly its own size
+inline matrix_geometry window_geometry(const matrix_geometry &geometry,
+                                       size_t x, size_t y, size_t stride) {
+    if (x + geometry.width > stride) {
+        throw std::range_error("window is wider than the image stride");
+    }
+    matrix_map map(geometry.map);
+    for (auto &index : map) {
+        size_t row = index / geometry.width, col = index % geometry.width;
+        index = (y + row) * stride + x + col;
+    }
+    return matrix_geometry(geometry.pixels_across, geometry.n_addr_lines,
+                           geometry.width, geometry.height, std::move(map),
+                           geometry.n_lanes, geometry.schedules);
+}
 } // namespace piomatter
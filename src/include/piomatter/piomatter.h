@@ -1,19 +1,35 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
+#include <utility>
 
 #include "hardware/pio.h"
 
 #include "piomatter/buffer_manager.h"
+#include "piomatter/compact.h"
+#include "piomatter/frame_source.h"
 #include "piomatter/matrixmap.h"
 #include "piomatter/pins.h"
 #include "piomatter/protomatter.pio.h"
+#include "piomatter/protomatter_compact.pio.h"
 #include "piomatter/render.h"
+#include "piomatter/render_pool.h"
+#include "piomatter/stats.h"
+#include "piomatter/stream_file.h"
+#include "piomatter/thread_queue.h"
 
 namespace piomatter {
 
 static int pio_sm_xfer_data_large(PIO pio, int sm, int direction, size_t size,
-                                  uint32_t *databuf) {
+                                  uint32_t *databuf, size_t *n_chunks) {
 #if 0
     // it would be NICE to gracefully fall back to blocked transfer, but sadly
     // once the large xfer ioctl fails, future small xfers fail too.
@@ -39,6 +55,7 @@ static int pio_sm_xfer_data_large(PIO pio, int sm, int direction, size_t size,
     while (size) {
         size_t xfersize = std::min(size_t{MAX_XFER}, size);
         int r = pio_sm_xfer_data(pio, sm, direction, xfersize, databuf);
+        ++*n_chunks;
         if (r != 0) {
             return r;
         }
@@ -54,57 +71,519 @@ static uint64_t monotonicns64() {
     return tp.tv_sec * UINT64_C(1000000000) + tp.tv_nsec;
 }
 
+// The clock that show_at() targets are on. PTP daemons keep it in step
+// across machines.
+static uint64_t tains64() {
+    struct timespec tp;
+    clock_gettime(CLOCK_TAI, &tp);
+    return tp.tv_sec * UINT64_C(1000000000) + tp.tv_nsec;
+}
+
 constexpr size_t MAX_XFER = 65532;
+// The driver's buffers of MAX_XFER bytes, which hold data that a transfer
+// has returned from but the state machine hasn't yet played
+constexpr size_t xfer_buffers = 3;
+
+// Due to https://github.com/raspberrypi/utils/issues/116 it's not possible to
+// keep the RP1 state machine fed at high rates. This pixel clock is
+// approximately the best sustainable with current FW & kernel.
+constexpr double default_pixel_clock = 2700000;
+// Calibration tries pixel clocks from default_pixel_clock up to
+// piomatter_options::max_pixel_clock, in steps of calibration_step. It only
+// measures what the DMA can sustain, not what the panels accept, so the
+// default limit is one that common panels and cables handle.
+constexpr double default_max_pixel_clock = 2 * default_pixel_clock;
+constexpr double calibration_step = 1.1;
+// How much longer than expected a calibration test may take
+constexpr double calibration_tolerance = 1.03;
+
+// What show() does when every buffer is either on display or waiting to be
+enum class submit_policy {
+    // Wait for the refresh thread to release a buffer
+    block,
+    // As block, but the refresh thread only ever picks up the newest filled
+    // buffer, so frames that were superseded before being shown are dropped
+    drop_oldest,
+    // Skip the frame and return piomatter_base::frame_skipped immediately
+    never_block,
+};
+
+// When the refresh thread puts a new frame on display
+enum class present_mode {
+    // At the next schedule. With temporal dithering, the pass through the
+    // schedules in progress then mixes planes from the old and new frames.
+    immediate,
+    // Only at the start of a pass through all of the schedules, so each
+    // pass shows a single frame, at the cost of up to a pass of latency
+    sequence_boundary,
+};
+
+// Settings for a piomatter that are fixed when it is constructed
+struct piomatter_options {
+    // The number of extra threads that share the rendering work of show()
+    // with the calling thread, each taking a band of address rows. 0 renders
+    // on the calling thread only.
+    size_t render_threads = 0;
+    // The number of frame buffers, including the one on display
+    size_t n_buffers = 3;
+    submit_policy policy = submit_policy::block;
+    present_mode present = present_mode::immediate;
+    // Send streams in the compact format, which takes fewer words for runs
+    // of identical pixels, using protomatter_compact.pio
+    bool compact = false;
+    // The pixel clock in Hz. 0 uses default_pixel_clock, or the result of
+    // calibration if calibrate is set.
+    double pixel_clock = 0;
+    // Find the fastest pixel clock, up to max_pixel_clock, that this
+    // system's DMA can keep fed, by timing test transfers at increasing
+    // clocks while the panel is dark
+    bool calibrate = false;
+    // The fastest pixel clock calibration may choose. Calibration can't
+    // tell whether the panels keep up, so raise this only for panels known
+    // to run faster.
+    double max_pixel_clock = default_max_pixel_clock;
+    // Show this rectangle of the framebuffer scaled to the geometry, which
+    // then need only give the matrix's own size. Scaling happens as pixels
+    // are converted, so no scaled copy of the framebuffer is made.
+    std::optional<source_scale> scale;
+    // Leave the panels dark until the first show(), instead of showing the
+    // framebuffer from the constructor, so that construction does no
+    // rendering
+    bool defer_show = false;
+};
 
 struct piomatter_base {
     piomatter_base() {}
     piomatter_base(const piomatter_base &) = delete;
     piomatter_base &operator=(const piomatter_base &) = delete;
 
+    // Returned by show() instead of an errno value when the frame was dropped
+    // under submit_policy::never_block
+    static constexpr int frame_skipped = -1;
+
     virtual ~piomatter_base() {}
     virtual int show() = 0;
+    // Take a copy of the framebuffer and render it on a background thread.
+    // The future's value is what show() would have returned. Only one
+    // asynchronous render is in flight at a time; calling this again first
+    // waits for the previous one.
+    virtual std::shared_future<int> show_async() = 0;
+    // Like show() and show_async(), but the frame goes on display at the
+    // start of the pass through the schedules nearest to present_at_ns on
+    // CLOCK_TAI, rather than as soon as possible. With every controller of a
+    // wall synchronized to one clock, such as by PTP, giving them all the
+    // same target swaps their frames together. Later frames wait for a timed
+    // one to be displayed. A target of 0 is the same as show().
+    virtual int show_at(uint64_t present_at_ns) = 0;
+    virtual std::shared_future<int> show_async_at(uint64_t present_at_ns) = 0;
+    // Put streams rendered elsewhere on display, one for each schedule in
+    // the format this piomatter sends, as stream_file_writer or a renderer
+    // for the same pinout and geometry makes them. Returns as show() does.
+    // Standard streams must match the skeleton apart from their RGB bits,
+    // as matches_skeleton() checks, so they can't change the timing.
+    // Compact streams can't be checked, so they must come from a trusted
+    // source.
+    virtual int
+    show_streams(std::span<const std::span<const uint32_t>> streams) = 0;
+    // Render each of `frames` once, each a copy of the framebuffer's bytes,
+    // and play them from a thread of their own, showing frame i for
+    // durations_ns[i]. With `loop` the sequence repeats until stopped;
+    // otherwise it stops after the last frame, which stays on display. This
+    // replaces any sequence already playing, and show() and show_async()
+    // stop it.
+    virtual void load_sequence(std::span<const std::span<const uint8_t>> frames,
+                               std::span<const uint64_t> durations_ns,
+                               bool loop) = 0;
+    // Play the frames of a stream file as load_sequence() plays its frames.
+    // The file must have been written for this piomatter's pinout, geometry
+    // and stream format.
+    virtual void play_file(std::shared_ptr<const stream_file> file,
+                           bool loop) = 0;
+    virtual void stop_sequence() = 0;
+    // Whether a sequence loaded by load_sequence() or play_file() is still
+    // playing
+    virtual bool sequence_playing() const = 0;
+    // Scale the OE time of every bit plane by `brightness`, from 0 to 1, and
+    // that of plane k (9 being the most significant of rgb10) by
+    // plane_duty[k], if given. The frame on display is re-submitted with its
+    // OE and delay words patched, without rendering it again, and later
+    // frames are rendered at the new brightness. Pre-rendered frames, which
+    // are made at full brightness, are patched as they are put on display,
+    // except that compact frames from play_file() and show_streams() are
+    // shown as they were made.
+    virtual void set_brightness(double brightness,
+                                std::span<const double> plane_duty = {}) = 0;
+    virtual double brightness() const = 0;
+    virtual std::vector<double> plane_duty() const = 0;
+    // Replace the gamma and colour correction LUTs. With no `regions`,
+    // luts[0] converts every pixel; otherwise entry i of the matrix map is
+    // converted by luts[regions[i]]. Frames rendered after this returns use
+    // the new LUTs, and none is rendered with a mix of old and new.
+    // Pre-rendered frames keep the LUTs they were made with.
+    virtual void set_luts(std::span<const gamma_lut> luts,
+                          std::span<const uint8_t> regions = {}) = 0;
 
-    double fps;
+    // Schedules sent per second, measured over the most recent one
+    std::atomic<double> fps{0};
+    piomatter_stats stats;
+    // The pixel clock in use, in Hz
+    double pixel_clock = 0;
+    // When set, show() only re-renders the address rows whose source pixels
+    // changed since the buffer being filled was last rendered
+    std::atomic<bool> incremental{false};
 };
 
+// A nonzero `lanes` renders with kernels specialized for geometries with that
+// many lanes, which is all the constructor will accept
 template <class pinout = adafruit_matrix_bonnet_pinout,
-          class colorspace = colorspace_rgb888>
+          class colorspace = colorspace_rgb888, size_t lanes = 0>
 struct piomatter : piomatter_base {
     using buffer_type = std::vector<uint32_t>;
     using bufseq_type = std::vector<buffer_type>;
     piomatter(std::span<typename colorspace::data_type const> framebuffer,
-              const matrix_geometry &geometry)
-        : framebuffer(framebuffer), geometry{geometry}, converter{},
+              const matrix_geometry &geometry,
+              const piomatter_options &options = {})
+        : piomatter(framebuffer,
+                    std::make_shared<const matrix_geometry>(geometry),
+                    options) {}
+
+    // Share the geometry instead of copying it, which for a large custom map
+    // saves the time and the memory of a copy
+    piomatter(std::span<typename colorspace::data_type const> framebuffer,
+              std::shared_ptr<const matrix_geometry> shared,
+              const piomatter_options &options = {})
+        : framebuffer(framebuffer), buffers(options.n_buffers),
+          row_hashes(options.n_buffers), present_at(options.n_buffers),
+          submitted_at(options.n_buffers),
+          manager{options.n_buffers},
+          policy{options.policy}, present{options.present},
+          compact{options.compact},
+          compact_buffers(options.compact ? options.n_buffers : 0),
+          shared_geometry{std::move(shared)}, geometry{*shared_geometry},
+          full_skeleton{shared_stream_skeleton<pinout>(geometry)},
+          skeleton{full_skeleton}, converter{},
           blitter_thread{} {
         if (geometry.n_addr_lines > std::size(pinout::PIN_ADDR)) {
             throw std::runtime_error("too many address lines requested");
         }
+        if (lanes && geometry.n_lanes != lanes) {
+            throw std::runtime_error("geometry has the wrong number of lanes");
+        }
+        if (options.scale) {
+            converter.scale = std::make_shared<const source_scaler>(
+                *options.scale, geometry.width, geometry.height);
+            if (converter.scale->extent() >
+                framebuffer.size_bytes() / colorspace::data_size_in_bytes(1)) {
+                throw std::range_error(
+                    "the scaled rectangle does not fit in the framebuffer");
+            }
+        }
+        if (options.render_threads) {
+            pool = std::make_unique<render_pool>(options.render_threads);
+        }
+        scratch.resize(options.render_threads + 1);
+        pixel_clock = options.pixel_clock ? options.pixel_clock
+                                          : default_pixel_clock;
         program_init();
+        if (options.calibrate && !options.pixel_clock) {
+            calibrate_pixel_clock(options.max_pixel_clock);
+        }
         blitter_thread = std::move(std::thread{&piomatter::blit_thread, this});
-        show();
+        if (!options.defer_show) {
+            show();
+        }
     }
 
-    int show() override {
-        int err = pending_error_errno.exchange(0); // we're handling this error
+    int show() override { return show_at(0); }
+
+    std::shared_future<int> show_async() override { return show_async_at(0); }
+
+    int show_at(uint64_t present_at_ns) override {
+        uint64_t t = monotonicns64();
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        stop_sequence_locked();
+        return show_from(framebuffer, present_at_ns, t);
+    }
+
+    std::shared_future<int> show_async_at(uint64_t present_at_ns) override {
+        uint64_t t = monotonicns64();
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        stop_sequence_locked();
+        snapshot.assign(framebuffer.begin(), framebuffer.end());
+        async_present_at = present_at_ns;
+        async_submitted_at = t;
+        async_promise = std::promise<int>{};
+        async_result = async_promise.get_future().share();
+        if (!async_thread.joinable()) {
+            async_thread = std::thread{&piomatter::async_render_thread, this};
+        }
+        async_requests.push(true);
+        return async_result;
+    }
+
+    int show_streams(
+        std::span<const std::span<const uint32_t>> streams) override {
+        if (streams.size() != skeleton->streams.size()) {
+            throw std::invalid_argument("wrong number of streams");
+        }
+        for (size_t i = 0; i < streams.size(); i++) {
+            // Compact streams are never longer than standard ones, which
+            // is what the DMA buffers are sized for
+            if (compact ? streams[i].size() > skeleton->streams[i].size()
+                        : streams[i].size() != skeleton->streams[i].size()) {
+                throw std::invalid_argument(
+                    "stream is the wrong size for this geometry");
+            }
+            if (!compact && !matches_skeleton<pinout>(
+                                streams[i], full_skeleton->streams[i])) {
+                throw std::invalid_argument(
+                    "stream has words that aren't pixel data");
+            }
+        }
+        uint64_t t = monotonicns64();
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        stop_sequence_locked();
+        int err = pending_error_errno.exchange(0);
         if (err != 0) {
             return err;
         }
-        int buffer_idx = manager.get_free_buffer();
-        auto &bufseq = buffers[buffer_idx];
-        bufseq.resize(geometry.schedules.size());
-        auto converted = converter.convert(framebuffer);
-        auto old_active_time = geometry.schedules.back().back().active_time;
-        for (size_t i = 0; i < geometry.schedules.size(); i++) {
-            protomatter_render_rgb10<pinout>(bufseq[i], geometry,
-                                             geometry.schedules[i],
-                                             old_active_time, converted.data());
-            old_active_time = geometry.schedules[i].back().active_time;
+        int buffer_idx = policy == submit_policy::never_block
+                             ? manager.try_get_free_buffer()
+                             : manager.get_free_buffer();
+        if (buffer_idx == buffer_manager::no_buffer) {
+            stats.frames_skipped++;
+            return frame_skipped;
         }
-        manager.put_filled_buffer(buffer_idx);
+        auto &out = compact ? compact_buffers[buffer_idx] : buffers[buffer_idx];
+        out.resize(streams.size());
+        for (size_t i = 0; i < streams.size(); i++) {
+            out[i].assign(streams[i].begin(), streams[i].end());
+        }
+        // Compact streams can't be patched, and are shown as they were made
+        if (!compact) {
+            apply_brightness(out);
+        }
+        row_hashes[buffer_idx].clear();
+        last_rendered = buffer_manager::no_buffer;
+        put_filled_buffer(buffer_idx, 0, t);
         return 0;
     }
 
+    void load_sequence(std::span<const std::span<const uint8_t>> frames,
+                       std::span<const uint64_t> durations_ns,
+                       bool loop) override {
+        if (frames.size() != durations_ns.size()) {
+            throw std::invalid_argument("each frame needs a duration");
+        }
+        for (const auto &frame : frames) {
+            if (frame.size() != framebuffer.size_bytes()) {
+                throw std::invalid_argument(
+                    "sequence frames must be the size of the framebuffer");
+            }
+        }
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        stop_sequence_locked();
+
+        // Consecutive frames that render the same are kept once, for their
+        // total duration
+        auto source = std::make_shared<memory_frame_source>();
+        auto &rendered = source->frames;
+        auto &durations = source->durations_ns;
+        bufseq_type streams;
+        for (size_t i = 0; i < frames.size(); i++) {
+            std::span<const typename colorspace::data_type> pixels(
+                reinterpret_cast<const typename colorspace::data_type *>(
+                    frames[i].data()),
+                framebuffer.size());
+            // At full brightness, like every other pre-rendered frame, so
+            // that the brightness in effect applies when it is shown. Frames
+            // are kept as standard streams even in compact mode, since only
+            // those can be dimmed, and are re-encoded as they are shown.
+            render(streams, *full_skeleton, pixels, nullptr);
+            if (!rendered.empty() && rendered.back() == streams) {
+                durations.back() += durations_ns[i];
+                continue;
+            }
+            rendered.push_back(streams);
+            durations.push_back(durations_ns[i]);
+        }
+        start_sequence_locked(std::move(source), loop, compact);
+    }
+
+    void play_file(std::shared_ptr<const stream_file> file,
+                   bool loop) override {
+        if (file->header().format_id !=
+                stream_format_id<pinout>(*full_skeleton, compact) ||
+            file->n_schedules() != skeleton->streams.size()) {
+            throw std::invalid_argument(
+                "the stream file was made for a different pinout, geometry "
+                "or stream format");
+        }
+        // No stream may be longer than the DMA buffers that hold it
+        for (size_t frame = 0; frame < file->n_frames(); frame++) {
+            for (size_t i = 0; i < skeleton->streams.size(); i++) {
+                if (file->block(frame, i).n_words >
+                    skeleton->streams[i].size()) {
+                    throw std::runtime_error(
+                        "not a valid piomatter stream file");
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        stop_sequence_locked();
+        start_sequence_locked(std::make_shared<stream_file_player>(file),
+                              loop);
+    }
+
+    void stop_sequence() override {
+        std::lock_guard<std::mutex> lock(show_mutex);
+        stop_sequence_locked();
+    }
+
+    bool sequence_playing() const override { return playing; }
+
+    void set_brightness(double brightness,
+                        std::span<const double> plane_duty = {}) override {
+        if (!(brightness >= 0 && brightness <= 1)) {
+            throw std::invalid_argument("brightness must be from 0 to 1");
+        }
+        if (plane_duty.size() > 10) {
+            throw std::invalid_argument("there are only 10 bit planes");
+        }
+        for (double duty : plane_duty) {
+            if (!(duty >= 0)) {
+                throw std::invalid_argument("plane duty can't be negative");
+            }
+        }
+        auto dimmed = make_stream_skeleton<pinout>(
+            geometry, dim_schedule(geometry.schedules, brightness, plane_duty));
+        // The bits that differ between full brightness and this one
+        auto patch = std::make_shared<bufseq_type>(dimmed.streams.size());
+        bool unchanged = true;
+        for (size_t i = 0; i < dimmed.streams.size(); i++) {
+            const auto &from = full_skeleton->streams[i];
+            const auto &to = dimmed.streams[i];
+            auto &words = (*patch)[i];
+            words.resize(to.size());
+            for (size_t j = 0; j < words.size(); j++) {
+                words[j] = from[j] ^ to[j];
+                unchanged = unchanged && !words[j];
+            }
+        }
+
+        uint64_t t = monotonicns64();
+        std::lock_guard<std::mutex> lock(show_mutex);
+        wait_async();
+        {
+            std::lock_guard<std::mutex> patch_lock(patch_mutex);
+            brightness_patch = unchanged ? nullptr : std::move(patch);
+            current_brightness = brightness;
+            current_plane_duty.assign(plane_duty.begin(), plane_duty.end());
+        }
+        auto previous = std::exchange(
+            skeleton, unchanged ? full_skeleton
+                                : std::make_shared<const stream_skeleton>(
+                                      std::move(dimmed)));
+
+        int last = last_rendered;
+        auto last_hashes =
+            last == buffer_manager::no_buffer ? std::vector<uint64_t>{}
+                                              : row_hashes[last];
+        // Rows rendered at the old brightness can't be reused
+        for (auto &hashes : row_hashes) {
+            hashes.clear();
+        }
+        // While a sequence plays, its next frame takes the new brightness,
+        // unless it is a compact stream file; only its thread may take free
+        // buffers
+        if (playing || last == buffer_manager::no_buffer) {
+            return;
+        }
+        int buffer_idx = policy == submit_policy::never_block
+                             ? manager.try_get_free_buffer()
+                             : manager.get_free_buffer();
+        if (buffer_idx == buffer_manager::no_buffer) {
+            return;
+        }
+        // Swap the old skeleton's bits for the new one's. The RGB bits
+        // aren't in either, so they are left as they were.
+        const auto &from = buffers[last];
+        auto &to = buffers[buffer_idx];
+        to.resize(from.size());
+        for (size_t i = 0; i < from.size(); i++) {
+            to[i].resize(from[i].size());
+            const uint32_t *a = previous->streams[i].data();
+            const uint32_t *b = skeleton->streams[i].data();
+            for (size_t j = 0; j < from[i].size(); j++) {
+                to[i][j] = from[i][j] ^ a[j] ^ b[j];
+            }
+        }
+        row_hashes[buffer_idx] = std::move(last_hashes);
+        if (compact) {
+            encode_compact(buffer_idx);
+        }
+        last_rendered = buffer_idx;
+        put_filled_buffer(buffer_idx, 0, t);
+    }
+
+    double brightness() const override {
+        std::lock_guard<std::mutex> lock(patch_mutex);
+        return current_brightness;
+    }
+
+    std::vector<double> plane_duty() const override {
+        std::lock_guard<std::mutex> lock(patch_mutex);
+        return current_plane_duty;
+    }
+
+    void set_luts(std::span<const gamma_lut> luts,
+                  std::span<const uint8_t> regions = {}) override {
+        if constexpr (requires { converter.lut; }) {
+            if (luts.empty()) {
+                throw std::invalid_argument("at least one LUT is needed");
+            }
+            std::shared_ptr<const lut_regions> new_regions;
+            if (!regions.empty()) {
+                if (regions.size() != geometry.map.size()) {
+                    throw std::range_error(
+                        "regions must have one entry per matrix map entry");
+                }
+                for (auto region : regions) {
+                    if (region >= luts.size()) {
+                        throw std::range_error("region has no LUT");
+                    }
+                }
+                new_regions = std::make_shared<const lut_regions>(
+                    lut_regions{{luts.begin(), luts.end()},
+                                {regions.begin(), regions.end()}});
+            }
+
+            std::lock_guard<std::mutex> lock(show_mutex);
+            wait_async();
+            converter.lut = luts[0];
+            converter.regions = std::move(new_regions);
+            // Rows converted with the old LUTs can't be reused
+            for (auto &hashes : row_hashes) {
+                hashes.clear();
+            }
+        } else {
+            throw std::invalid_argument(
+                "this colorspace is linear and has no LUT");
+        }
+    }
+
     ~piomatter() {
+        stop_sequence_locked();
+        if (async_thread.joinable()) {
+            async_requests.push(false);
+            async_thread.join();
+        }
+
         if (pio != NULL && sm >= 0) {
 
             pin_deinit_one(pinout::PIN_OE);
@@ -117,9 +596,17 @@ struct piomatter : piomatter_base {
             for (size_t i = 0; i < geometry.n_addr_lines; i++) {
                 pin_deinit_one(pinout::PIN_ADDR[i]);
             }
+            // Each program fills the instruction memory, so it must be freed
+            // before another piomatter can load one
+            if (program) {
+                pio_remove_program(pio, program, program_offset);
+            }
             pio_sm_unclaim(pio, sm);
         }
 
+        // The refresh thread doesn't look for the exit request while it
+        // holds a timed buffer back
+        blit_exiting = true;
         manager.request_exit();
         if (blitter_thread.joinable()) {
             blitter_thread.join();
@@ -127,13 +614,204 @@ struct piomatter : piomatter_base {
     }
 
   private:
+    int show_from(std::span<typename colorspace::data_type const> source,
+                  uint64_t present_at_ns, uint64_t submitted_ns) {
+        int err = pending_error_errno.exchange(0); // we're handling this error
+        if (err != 0) {
+            return err;
+        }
+        uint64_t t0 = monotonicns64();
+        int buffer_idx = policy == submit_policy::never_block
+                             ? manager.try_get_free_buffer()
+                             : manager.get_free_buffer();
+        if (buffer_idx == buffer_manager::no_buffer) {
+            stats.frames_skipped++;
+            return frame_skipped;
+        }
+        uint64_t t1 = monotonicns64();
+        stats.wait_free.record(t1 - t0);
+        auto &bufseq = buffers[buffer_idx];
+        auto &hashes = row_hashes[buffer_idx];
+        if (!incremental) {
+            hashes.clear();
+        }
+        render(bufseq, *skeleton, source, incremental ? &hashes : nullptr);
+        uint64_t t2 = monotonicns64();
+        stats.render.record(t2 - t1);
+        if (compact) {
+            encode_compact(buffer_idx);
+            stats.encode.record(monotonicns64() - t2);
+        }
+        last_rendered = buffer_idx;
+        put_filled_buffer(buffer_idx, present_at_ns, submitted_ns);
+        return 0;
+    }
+
+    // Queue a buffer for display, at a CLOCK_TAI time or, given 0, as soon
+    // as possible. Its present latency is measured from submitted_ns.
+    void put_filled_buffer(int buffer_idx, uint64_t present_at_ns,
+                           uint64_t submitted_ns) {
+        present_at[buffer_idx] = present_at_ns;
+        submitted_at[buffer_idx] = submitted_ns;
+        manager.put_filled_buffer(buffer_idx);
+    }
+
+    // The streams that are actually sent for a buffer
+    const bufseq_type &output_buffer(int buffer_idx) const {
+        return compact ? compact_buffers[buffer_idx] : buffers[buffer_idx];
+    }
+
+    // Re-encode a buffer's standard streams as the compact ones it sends
+    void encode_compact(int buffer_idx) {
+        const auto &bufseq = buffers[buffer_idx];
+        auto &compact_bufseq = compact_buffers[buffer_idx];
+        compact_bufseq.resize(bufseq.size());
+        for (size_t i = 0; i < bufseq.size(); i++) {
+            compact_stream<pinout>(compact_bufseq[i], bufseq[i]);
+        }
+    }
+
+    // Dim standard streams made at full brightness to the brightness in
+    // effect
+    void apply_brightness(bufseq_type &streams) {
+        std::shared_ptr<const bufseq_type> patch;
+        {
+            std::lock_guard<std::mutex> lock(patch_mutex);
+            patch = brightness_patch;
+        }
+        if (!patch) {
+            return;
+        }
+        for (size_t i = 0; i < streams.size(); i++) {
+            const uint32_t *bits = (*patch)[i].data();
+            for (size_t j = 0; j < streams[i].size(); j++) {
+                streams[i][j] ^= bits[j];
+            }
+        }
+    }
+
+    // Only one thread may take free buffers at a time, so this is called
+    // with show_mutex held, or from the destructor
+    void stop_sequence_locked() {
+        if (!sequence_thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sequence_mutex);
+            sequence_stopping = true;
+        }
+        sequence_stop_requested.notify_all();
+        sequence_thread.join();
+        playing = false;
+    }
+
+    // Called with show_mutex held, after stop_sequence_locked(). With
+    // `encode`, the source's frames are standard streams, which are dimmed
+    // and re-encoded for compact mode as they are shown.
+    void start_sequence_locked(std::shared_ptr<frame_source> source, bool loop,
+                               bool encode = false) {
+        if (source->size() == 0) {
+            return;
+        }
+        sequence = std::move(source);
+        sequence_loop = loop;
+        sequence_encode = encode;
+        last_rendered = buffer_manager::no_buffer;
+        sequence_stopping = false;
+        playing = true;
+        sequence_thread = std::thread{&piomatter::play_sequence, this};
+    }
+
+    // Put each pre-rendered frame of the sequence on display in turn. Each
+    // is copied into a free buffer, which costs a small fraction of
+    // rendering it, and deadlines are kept on a fixed timeline so that
+    // durations don't drift.
+    void play_sequence() {
+        using clock = std::chrono::steady_clock;
+        auto next = clock::now();
+        const size_t n_frames = sequence->size();
+        for (size_t i = 0; i < n_frames;) {
+            uint64_t t = monotonicns64();
+            int buffer_idx = manager.get_free_buffer();
+            if (sequence_encode) {
+                sequence->get(i, buffers[buffer_idx]);
+                apply_brightness(buffers[buffer_idx]);
+                encode_compact(buffer_idx);
+            } else {
+                sequence->get(i, compact ? compact_buffers[buffer_idx]
+                                         : buffers[buffer_idx]);
+                if (!compact) {
+                    apply_brightness(buffers[buffer_idx]);
+                }
+            }
+            // The buffer no longer holds the render that its hashes are of
+            row_hashes[buffer_idx].clear();
+            put_filled_buffer(buffer_idx, 0, t);
+
+            next = std::max(next + std::chrono::nanoseconds(
+                                       sequence->duration_ns(i)),
+                            clock::now());
+            std::unique_lock<std::mutex> lock(sequence_mutex);
+            if (sequence_stop_requested.wait_until(
+                    lock, next, [this] { return sequence_stopping; })) {
+                break;
+            }
+            if (++i == n_frames && sequence_loop) {
+                i = 0;
+            }
+        }
+        playing = false;
+    }
+
+    void wait_async() {
+        if (async_result.valid()) {
+            async_result.wait();
+        }
+    }
+
+    void async_render_thread() {
+        while (async_requests.pop_blocking()) {
+            // show_async() doesn't touch the promise again until this one
+            // has been fulfilled
+            auto promise = std::move(async_promise);
+            promise.set_value(
+                show_from(snapshot, async_present_at, async_submitted_at));
+        }
+    }
+
+    void render(bufseq_type &bufseq, const stream_skeleton &skel,
+                std::span<typename colorspace::data_type const> source,
+                std::vector<uint64_t> *hashes) {
+        const size_t n_addr = 1u << geometry.n_addr_lines;
+        bool reuse = protomatter_render_prepare(bufseq, skel, n_addr, hashes);
+        auto render_band = [&](size_t band) {
+            size_t n_bands = scratch.size();
+            protomatter_render_rows<pinout, colorspace, lanes>(
+                bufseq, geometry, skel, converter, source, scratch[band],
+                hashes, reuse, n_addr * band / n_bands,
+                n_addr * (band + 1) / n_bands);
+        };
+        if (pool) {
+            pool->run(render_band);
+        } else {
+            render_band(0);
+        }
+    }
+
     void program_init() {
         pio = pio0;
+        // A single state machine drives every lane. All of the supported
+        // pinouts share one set of CLK, LAT, /OE and address pins between
+        // their connectors, and `out pins` can only drive a contiguous range
+        // of pins, which on these boards always takes in those shared pins
+        // along with other lanes' RGB pins. Splitting lanes between state
+        // machines would have them fight over the same pins.
         sm = pio_claim_unused_sm(pio, true);
         if (sm < 0) {
             throw std::runtime_error("pio_claim_unused_sm");
         }
-        int r = pio_sm_config_xfer(pio, sm, PIO_DIR_TO_SM, MAX_XFER, 3);
+        int r = pio_sm_config_xfer(pio, sm, PIO_DIR_TO_SM, MAX_XFER,
+                                   xfer_buffers);
         if (r) {
             throw std::runtime_error("pio_sm_config_xfer");
         }
@@ -143,31 +821,37 @@ struct piomatter : piomatter_base {
             .length = 32,
             .origin = -1,
         };
+        static const struct pio_program protomatter_compact_program = {
+            .instructions = protomatter_compact,
+            .length = 32,
+            .origin = -1,
+        };
 
-        uint offset = pio_add_program(pio, &protomatter_program);
+        program = compact ? &protomatter_compact_program : &protomatter_program;
+        uint offset = pio_add_program(pio, program);
         if (offset == PIO_ORIGIN_INVALID) {
+            program = nullptr;
             throw std::runtime_error("pio_add_program");
         }
+        program_offset = offset;
 
         pio_sm_clear_fifos(pio, sm);
         pio_sm_set_clkdiv(pio, sm, 1.0);
 
         pio_sm_config c = pio_get_default_sm_config();
-        sm_config_set_wrap(&c, offset + protomatter_wrap_target,
-                           offset + protomatter_wrap);
+        if (compact) {
+            sm_config_set_wrap(&c, offset + protomatter_compact_wrap_target,
+                               offset + protomatter_compact_wrap);
+        } else {
+            sm_config_set_wrap(&c, offset + protomatter_wrap_target,
+                               offset + protomatter_wrap);
+        }
         // 1 side-set pin
         sm_config_set_sideset(&c, 2, true, false);
         sm_config_set_out_shift(&c, /* shift_right= */ false,
                                 /* auto_pull = */ true, 32);
         sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
-        // Due to https://github.com/raspberrypi/utils/issues/116 it's not
-        // possible to keep the RP1 state machine fed at high rates. This target
-        // frequency is approximately the best sustainable clock with current
-        // FW & kernel.
-        constexpr double target_freq =
-            2700000 * 2; // 2.7MHz pixel clock, 2 PIO cycles per pixel
-        double div = clock_get_hz(clk_sys) / target_freq;
-        sm_config_set_clkdiv(&c, div);
+        sm_config_set_clkdiv(&c, clock_divider(pixel_clock));
         sm_config_set_out_pins(&c, 0, 28);
         sm_config_set_sideset_pins(&c, pinout::PIN_CLK);
         pio_sm_init(pio, sm, offset, &c);
@@ -185,6 +869,89 @@ struct piomatter : piomatter_base {
         }
     }
 
+    double clock_divider(double clock) {
+        // 2 PIO cycles per pixel
+        return clock_get_hz(clk_sys) / (clock * CLOCKS_PER_DATA);
+    }
+
+    // Send the stream for one schedule of a buffer
+    int xfer(int buffer_idx, size_t seq_idx) {
+        const auto &data = output_buffer(buffer_idx)[seq_idx];
+        auto datasize = sizeof(uint32_t) * data.size();
+        auto dataptr = const_cast<uint32_t *>(&data[0]);
+        size_t n_chunks = 0;
+        int r = pio_sm_xfer_data_large(pio, sm, PIO_DIR_TO_SM, datasize,
+                                       dataptr, &n_chunks);
+        stats.xfer_ioctls += n_chunks;
+        return r;
+    }
+
+    // Play a dark test frame in buffer 0 at increasing pixel clocks up to
+    // max_clock, and keep the fastest at which it takes no longer than it
+    // should. A clock that the DMA can't keep up with leaves the state
+    // machine stalled on an empty FIFO, which makes the frame slow. This
+    // finds the limit of the DMA, not of the panels.
+    void calibrate_pixel_clock(double max_clock) {
+        auto &test = compact ? compact_buffers[0] : buffers[0];
+        test.resize(skeleton->streams.size());
+        uint64_t frame_cycles = 0;
+        for (size_t i = 0; i < test.size(); i++) {
+            // With no repeats, the test is as long as any real frame
+            if (compact) {
+                compact_stream<pinout>(test[i], skeleton->streams[i], SIZE_MAX);
+                frame_cycles += compact_stream_cycles(test[i]);
+            } else {
+                test[i] = skeleton->streams[i];
+                frame_cycles += stream_cycles(test[i]);
+            }
+        }
+
+        // A transfer returns once its data is queued, and up to a full
+        // queue, the driver's buffers and the joined TX FIFO, may still be
+        // waiting to be played
+        size_t frame_bytes = 0;
+        for (const auto &stream : test) {
+            frame_bytes += stream.size() * sizeof(uint32_t);
+        }
+        size_t queued_bytes = xfer_buffers * MAX_XFER + 8 * sizeof(uint32_t);
+        size_t n_fill = (queued_bytes + frame_bytes - 1) / frame_bytes;
+
+        auto keeps_up = [&](double clock) {
+            pio_sm_set_clkdiv(pio, sm, clock_divider(clock));
+            double frame_time = frame_cycles / (clock * CLOCKS_PER_DATA);
+            // Time enough frames for ~50ms. Timing starts once the queue has
+            // filled, and ends a queue's worth of frames later, once the
+            // timed ones have certainly been played. The queue is full at
+            // both ends, so what was sent in between is what was played.
+            size_t n_frames = n_fill + 1 + size_t(0.05 / frame_time);
+            uint64_t t0 = 0;
+            for (size_t frame = 0; frame < n_fill + n_frames; frame++) {
+                if (frame == n_fill) {
+                    t0 = monotonicns64();
+                }
+                for (size_t i = 0; i < test.size(); i++) {
+                    if (xfer(0, i) != 0) {
+                        return false;
+                    }
+                }
+            }
+            double elapsed = (monotonicns64() - t0) / 1e9;
+            return elapsed < n_frames * frame_time * calibration_tolerance;
+        };
+
+        double best = default_pixel_clock;
+        for (double clock = default_pixel_clock; clock <= max_clock;
+             clock *= calibration_step) {
+            if (!keeps_up(clock)) {
+                break;
+            }
+            best = clock;
+        }
+        pixel_clock = best;
+        pio_sm_set_clkdiv(pio, sm, clock_divider(pixel_clock));
+        stats.reset();
+    }
+
     void pin_init_one(int pin) {
         pio_gpio_init(pio, pin);
         pio_sm_set_consecutive_pindirs(pio, sm, pin, 1, true);
@@ -195,55 +962,171 @@ struct piomatter : piomatter_base {
         pio_sm_set_consecutive_pindirs(pio, sm, pin, 1, false);
     }
 
+    int next_filled_buffer(int cur_buffer_idx) {
+        // Until the first frame arrives there is nothing to show, so sleep
+        // rather than poll
+        if (cur_buffer_idx == buffer_manager::no_buffer) {
+            return manager.wait_filled_buffer();
+        }
+        if (policy == submit_policy::drop_oldest) {
+            uint64_t n_dropped = 0;
+            int r = manager.get_newest_filled_buffer(n_dropped);
+            stats.frames_dropped += n_dropped;
+            return r;
+        }
+        return manager.get_filled_buffer();
+    }
+
     void blit_thread() {
+        const size_t n_schedules = full_skeleton->streams.size();
         int cur_buffer_idx = buffer_manager::no_buffer;
+        // A timed buffer waiting for its pass through the schedules
+        int staged_buffer_idx = buffer_manager::no_buffer;
         int buffer_idx;
         int seq_idx = -1;
+        bool new_frame = false;
         uint64_t t0, t1;
+        // When the current pass through the schedules started, and how long
+        // the previous one took, on CLOCK_TAI
+        uint64_t pass_start = 0, pass_ns = 0;
         t0 = monotonicns64();
-        while ((buffer_idx = manager.get_filled_buffer()) !=
-               buffer_manager::exit_request) {
+        for (;;) {
+            bool pass_boundary = (seq_idx + 1) % n_schedules == 0;
+            buffer_idx = buffer_manager::no_buffer;
+            if (staged_buffer_idx == buffer_manager::no_buffer &&
+                (pass_boundary || present == present_mode::immediate)) {
+                buffer_idx = next_filled_buffer(cur_buffer_idx);
+                if (buffer_idx == buffer_manager::exit_request) {
+                    break;
+                }
+                // Until something is on display there's nothing to keep up
+                if (buffer_idx >= 0 && present_at[buffer_idx] &&
+                    cur_buffer_idx != buffer_manager::no_buffer) {
+                    staged_buffer_idx = buffer_idx;
+                    buffer_idx = buffer_manager::no_buffer;
+                }
+            } else if (blit_exiting) {
+                break;
+            }
+            if (cur_buffer_idx != buffer_manager::no_buffer && pass_boundary) {
+                uint64_t now = tains64();
+                if (pass_start) {
+                    pass_ns = now - pass_start;
+                }
+                pass_start = now;
+                // Swap at this pass if it starts nearer the target than the
+                // next one will
+                if (staged_buffer_idx != buffer_manager::no_buffer &&
+                    now + pass_ns / 2 >= present_at[staged_buffer_idx]) {
+                    uint64_t target = present_at[staged_buffer_idx];
+                    stats.present_error.record(now > target ? now - target
+                                                            : target - now);
+                    if (now > target + pass_ns / 2) {
+                        stats.presents_late++;
+                    }
+                    buffer_idx = staged_buffer_idx;
+                    staged_buffer_idx = buffer_manager::no_buffer;
+                }
+            }
             if (buffer_idx != buffer_manager::no_buffer) {
                 if (cur_buffer_idx != buffer_manager::no_buffer) {
                     manager.put_free_buffer(cur_buffer_idx);
                 }
                 cur_buffer_idx = buffer_idx;
+                new_frame = true;
+                stats.frames_shown++;
             }
             if (cur_buffer_idx != buffer_manager::no_buffer) {
-                const auto &cur_buf = buffers[cur_buffer_idx];
-                seq_idx = (seq_idx + 1) % cur_buf.size();
-                const auto &data = cur_buf[seq_idx];
-                auto datasize = sizeof(uint32_t) * data.size();
-                auto dataptr = const_cast<uint32_t *>(&data[0]);
+                seq_idx = (seq_idx + 1) % n_schedules;
                 // returns err = rp1_ioctl.... which seems to be a negative
                 // errno value
-                int r = pio_sm_xfer_data_large(pio, sm, PIO_DIR_TO_SM, datasize,
-                                               dataptr);
+                int r = xfer(cur_buffer_idx, seq_idx);
                 if (r != 0) {
                     pending_error_errno.store(errno);
+                    stats.record_error(errno);
                     printf("xfer_data() returned error %d (errno=%s)\n", r,
                            strerror(errno));
                 }
                 t1 = monotonicns64();
+                stats.xfer.record(t1 - t0);
+                stats.schedules_sent++;
+                // Once the new frame's first transfer returns, everything
+                // before it has been sent, so the frame is reaching the panel
+                if (buffer_idx != buffer_manager::no_buffer) {
+                    stats.present_latency.record(t1 -
+                                                 submitted_at[buffer_idx]);
+                }
+                if (size_t(seq_idx) + 1 == n_schedules) {
+                    stats.refreshes++;
+                    if (!new_frame) {
+                        stats.repeated_refreshes++;
+                    }
+                    new_frame = false;
+                }
                 if (t0 != t1) {
                     fps = 1e9 / (t1 - t0);
                 }
                 t0 = t1;
-            } else {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
         }
     }
 
     PIO pio = NULL;
     int sm = -1;
+    const pio_program *program = nullptr;
+    uint program_offset = 0;
     std::span<typename colorspace::data_type const> framebuffer;
-    bufseq_type buffers[3];
-    buffer_manager manager{};
-    matrix_geometry geometry;
+    std::vector<bufseq_type> buffers;
+    std::vector<std::vector<uint64_t>> row_hashes;
+    // The CLOCK_TAI time each filled buffer is to go on display at, or 0
+    std::vector<uint64_t> present_at;
+    // When each filled buffer's frame was submitted, on monotonicns64()
+    std::vector<uint64_t> submitted_at;
+    buffer_manager manager;
+    submit_policy policy;
+    present_mode present;
+    bool compact;
+    std::vector<bufseq_type> compact_buffers;
+    std::shared_ptr<const matrix_geometry> shared_geometry;
+    const matrix_geometry &geometry;
+    // The skeleton at full brightness, which pre-rendered frames are made
+    // with and which is shared by piomatters of the same geometry, and the
+    // one that frames are rendered with now
+    std::shared_ptr<const stream_skeleton> full_skeleton;
+    std::shared_ptr<const stream_skeleton> skeleton;
+    // The bits to flip to dim full brightness streams, or null at full
+    // brightness, and the settings they were made for. The sequence thread
+    // reads the patch as well as show(), and other threads the settings.
+    mutable std::mutex patch_mutex;
+    double current_brightness = 1;
+    std::vector<double> current_plane_duty;
+    std::shared_ptr<const bufseq_type> brightness_patch;
+    // The buffer that the last frame rendered by show() went to, or
+    // no_buffer if something else has been shown since
+    int last_rendered = buffer_manager::no_buffer;
     colorspace converter;
+    std::unique_ptr<render_pool> pool;
+    std::vector<render_scratch> scratch;
     std::thread blitter_thread;
+    std::atomic<bool> blit_exiting{false};
     std::atomic<int> pending_error_errno;
+
+    std::mutex show_mutex;
+    std::vector<typename colorspace::data_type> snapshot;
+    uint64_t async_present_at = 0, async_submitted_at = 0;
+    std::promise<int> async_promise;
+    std::shared_future<int> async_result;
+    thread_queue<bool> async_requests;
+    std::thread async_thread;
+
+    std::shared_ptr<frame_source> sequence;
+    bool sequence_loop = false;
+    bool sequence_encode = false;
+    std::mutex sequence_mutex;
+    std::condition_variable sequence_stop_requested;
+    bool sequence_stopping = false;
+    std::atomic<bool> playing{false};
+    std::thread sequence_thread;
 };
 
 } // namespace piomatter
@@ -0,0 +1,56 @@
+#pragma once
+
+const int protomatter_compact_wrap = 6;
+const int protomatter_compact_wrap_target = 0;
+const int protomatter_compact_sideset_pin_count = 1;
+const bool protomatter_compact_sideset_enable = 1;
+const uint16_t protomatter_compact[] = {
+    // ; data format (out-shift-right):
+    // ; MSB ... LSB
+    // ; 0 ddd......ddd: 31-bit delay, then one data word
+    // ; 1 1 cc.....ccc: 30-bit data count, then that many data words
+    // ; 1 0 cc.....ccc: 30-bit repeat count, then one data word that is clocked
+    // ;                 out that many times
+    // .side_set 1 opt
+    // .wrap_target
+    // top:
+    0x6021, //     out x, 1
+    0x002b, //     jmp !x do_delay
+    0x6021, //     out x, 1
+    0x605e, //     out y, 30
+    0x0027, //     jmp !x do_repeat
+            // data_loop:
+    0x6000, //     out pins, 32
+    0x1885, //     jmp y--, data_loop  side 1 ; assert clk bit
+            // .wrap
+            // do_repeat:
+    0x6000, //     out pins, 32
+            // repeat_loop:
+    0xb842, //     nop side 1 ; assert clk bit
+    0x1088, //     jmp y--, repeat_loop side 0
+    0x0000, //     jmp top
+            // do_delay:
+    0x605f, //     out y, 31
+    0x6000, //     out pins, 32
+            // delay_loop:
+    0x008d, //     jmp y--, delay_loop
+    0x0000, //     jmp top
+    //     ;; fill program out to 32 instructions so nothing else can load
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+    0xa042, //     nop
+};
@@ -1,8 +1,18 @@
 #pragma once
 
 #include "matrixmap.h"
+#include "scale.h"
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <span>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 namespace piomatter {
@@ -15,47 +25,139 @@ constexpr int CLOCKS_PER_DELAY = 1;
 constexpr uint32_t command_data = 1u << 31;
 constexpr uint32_t command_delay = 0;
 
+// The number of PIO cycles protomatter.pio takes to play a stream
+inline uint64_t stream_cycles(const std::vector<uint32_t> &stream) {
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < stream.size();) {
+        uint32_t header = stream[i++];
+        if (header & command_data) {
+            size_t n = (header & ~command_data) + 1;
+            cycles += DATA_OVERHEAD + n * CLOCKS_PER_DATA;
+            i += n;
+        } else {
+            cycles += DELAY_OVERHEAD + (header + 1) * CLOCKS_PER_DELAY;
+            i++;
+        }
+    }
+    return cycles;
+}
+
+// The 8 to 10 bit conversion of each channel, indexed [channel][value] with
+// the channels in the order red, green, blue
+using channel_tables = std::array<std::array<uint16_t, 256>, 3>;
+
 struct gamma_lut {
-    gamma_lut(double exponent = 2.2) {
-        for (int i = 0; i < 256; i++) {
-            auto v = std::max(i, int(round(1023 * pow(i / 255., exponent))));
-            lut[i] = v;
+    gamma_lut(double exponent = 2.2) : gamma_lut(exponent, {1., 1., 1.}) {}
+
+    // Scale each channel's curve so that its full value gives `white` of the
+    // full output, from 0 to 1, to match the white points of panels
+    gamma_lut(double exponent, const std::array<double, 3> &white) {
+        for (int c = 0; c < 3; c++) {
+            if (!(white[c] >= 0 && white[c] <= 1)) {
+                throw std::invalid_argument(
+                    "white point channels must be from 0 to 1");
+            }
+            for (int i = 0; i < 256; i++) {
+                auto v = std::max(
+                    int(round(i * white[c])),
+                    int(round(1023 * white[c] * pow(i / 255., exponent))));
+                lut[c][i] = v;
+            }
         }
+        split_tables();
     }
 
-    unsigned convert(unsigned v) {
-        if (v >= std::size(lut))
+    explicit gamma_lut(const channel_tables &tables) {
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < 256; i++) {
+                if (tables[c][i] > 1023) {
+                    throw std::invalid_argument(
+                        "LUT entries must be at most 1023");
+                }
+                lut[c][i] = tables[c][i];
+            }
+        }
+        split_tables();
+    }
+
+    unsigned convert(unsigned channel, unsigned v) const {
+        if (v >= std::size(lut[channel]))
             return 1023;
-        return lut[v];
+        return lut[channel][v];
     }
 
     void convert_rgb888_packed_to_rgb10(std::vector<uint32_t> &result,
-                                        std::span<const uint8_t> source) {
+                                        std::span<const uint8_t> source) const {
         result.resize(source.size() / 3);
-        for (size_t i = 0, j = 0; i < source.size(); i += 3) {
-            uint32_t r = source[i + 0] & 0xff;
-            uint32_t g = source[i + 1] & 0xff;
-            uint32_t b = source[i + 2] & 0xff;
-            result[j++] = (convert(r) << 20) | (convert(g) << 10) | convert(b);
-        }
+        convert_rgb888_packed_to_rgb10(result.data(), source.data(),
+                                       result.size());
     }
 
     void convert_rgb888_to_rgb10(std::vector<uint32_t> &result,
-                                 std::span<const uint32_t> source) {
+                                 std::span<const uint32_t> source) const {
         result.resize(source.size());
-        for (size_t i = 0; i < source.size(); i++) {
+        convert_rgb888_to_rgb10(result.data(), source.data(), source.size());
+    }
+
+    void convert_rgb565_to_rgb10(std::vector<uint32_t> &result,
+                                 std::span<const uint16_t> source) const {
+        result.resize(source.size());
+        convert_rgb565_to_rgb10(result.data(), source.data(), source.size());
+    }
+
+    // Convert `n` pixels (3 bytes each) from `source` into `result`
+    void convert_rgb888_packed_to_rgb10(uint32_t *result, const uint8_t *source,
+                                        size_t n) const {
+        size_t i = 0;
+#if PIOMATTER_NEON
+        for (; i + 16 <= n; i += 16) {
+            uint8x16x3_t px = vld3q_u8(source + 3 * i);
+            store_rgb10_neon(result + i, px.val[0], px.val[1], px.val[2]);
+        }
+#endif
+        for (; i < n; i++) {
+            uint32_t r = source[3 * i + 0] & 0xff;
+            uint32_t g = source[3 * i + 1] & 0xff;
+            uint32_t b = source[3 * i + 2] & 0xff;
+            result[i] = (convert(0, r) << 20) | (convert(1, g) << 10) |
+                        convert(2, b);
+        }
+    }
+
+    void convert_rgb888_to_rgb10(uint32_t *result, const uint32_t *source,
+                                 size_t n) const {
+        size_t i = 0;
+#if PIOMATTER_NEON
+        for (; i + 16 <= n; i += 16) {
+            // little endian 0x00RRGGBB is stored as the bytes B, G, R, 0
+            uint8x16x4_t px =
+                vld4q_u8(reinterpret_cast<const uint8_t *>(source + i));
+            store_rgb10_neon(result + i, px.val[2], px.val[1], px.val[0]);
+        }
+#endif
+        for (; i < n; i++) {
             uint32_t data = source[i];
             uint32_t r = (data >> 16) & 0xff;
             uint32_t g = (data >> 8) & 0xff;
             uint32_t b = data & 0xff;
-            result[i] = (convert(r) << 20) | (convert(g) << 10) | convert(b);
+            result[i] = (convert(0, r) << 20) | (convert(1, g) << 10) |
+                        convert(2, b);
         }
     }
 
-    void convert_rgb565_to_rgb10(std::vector<uint32_t> &result,
-                                 std::span<const uint16_t> source) {
-        result.resize(source.size());
-        for (size_t i = 0; i < source.size(); i++) {
+    void convert_rgb565_to_rgb10(uint32_t *result, const uint16_t *source,
+                                 size_t n) const {
+        size_t i = 0;
+#if PIOMATTER_NEON
+        for (; i + 16 <= n; i += 16) {
+            uint16x8_t d0 = vld1q_u16(source + i);
+            uint16x8_t d1 = vld1q_u16(source + i + 8);
+            store_rgb10_neon(result + i, expand565_neon<11, 5>(d0, d1),
+                             expand565_neon<5, 6>(d0, d1),
+                             expand565_neon<0, 5>(d0, d1));
+        }
+#endif
+        for (; i < n; i++) {
             uint32_t data = source[i];
             unsigned r5 = (data >> 11) & 0x1f;
             unsigned r = (r5 << 3) | (r5 >> 2);
@@ -64,13 +166,172 @@ struct gamma_lut {
             unsigned b5 = (data)&0x1f;
             unsigned b = (b5 << 3) | (b5 >> 2);
 
-            result[i] = (convert(r) << 20) | (convert(g) << 10) | convert(b);
+            result[i] = (convert(0, r) << 20) | (convert(1, g) << 10) |
+                        convert(2, b);
+        }
+    }
+
+    uint16_t lut[3][256];
+
+  private:
+    void split_tables() {
+#if PIOMATTER_NEON
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < 256; i++) {
+                lut_lo[c][i] = lut[c][i] & 0xff;
+                lut_hi[c][i] = lut[c][i] >> 8;
+            }
+        }
+#endif
+    }
+
+#if PIOMATTER_NEON
+    // The 10-bit LUTs split into their low 8 bits and their high 2 bits, so
+    // that each half can be searched with byte table lookups
+    uint8_t lut_lo[3][256], lut_hi[3][256];
+
+    // Look up 16 bytes in a 256-entry table. Each TBL/TBX covers 64 entries;
+    // indices outside a quarter leave the previous result in place.
+    static uint8x16_t lookup_neon(const uint8_t *table, uint8x16_t idx) {
+        const uint8x16_t quarter = vdupq_n_u8(64);
+        uint8x16_t r = vqtbl4q_u8(vld1q_u8_x4(table), idx);
+        idx = vsubq_u8(idx, quarter);
+        r = vqtbx4q_u8(r, vld1q_u8_x4(table + 64), idx);
+        idx = vsubq_u8(idx, quarter);
+        r = vqtbx4q_u8(r, vld1q_u8_x4(table + 128), idx);
+        idx = vsubq_u8(idx, quarter);
+        return vqtbx4q_u8(r, vld1q_u8_x4(table + 192), idx);
+    }
+
+    // Widen one 5- or 6-bit RGB565 field of 16 pixels to 8 bits, replicating
+    // the high bits into the low bits like the scalar code
+    template <int shift, int bits>
+    static uint8x16_t expand565_neon(uint16x8_t d0, uint16x8_t d1) {
+        const uint16x8_t mask = vdupq_n_u16((1 << bits) - 1);
+        if constexpr (shift != 0) {
+            d0 = vshrq_n_u16(d0, shift);
+            d1 = vshrq_n_u16(d1, shift);
         }
+        uint16x8_t f0 = vandq_u16(d0, mask);
+        uint16x8_t f1 = vandq_u16(d1, mask);
+        f0 = vorrq_u16(vshlq_n_u16(f0, 8 - bits),
+                       vshrq_n_u16(f0, 2 * bits - 8));
+        f1 = vorrq_u16(vshlq_n_u16(f1, 8 - bits),
+                       vshrq_n_u16(f1, 2 * bits - 8));
+        return vcombine_u8(vmovn_u16(f0), vmovn_u16(f1));
     }
 
-    uint16_t lut[256];
+    // Gamma convert 16 pixels' worth of 8-bit channels and store them as rgb10
+    void store_rgb10_neon(uint32_t *result, uint8x16_t r8, uint8x16_t g8,
+                          uint8x16_t b8) const {
+        uint8x16_t r_lo = lookup_neon(lut_lo[0], r8);
+        uint8x16_t g_lo = lookup_neon(lut_lo[1], g8);
+        uint8x16_t b_lo = lookup_neon(lut_lo[2], b8);
+        uint8x16_t r_hi = lookup_neon(lut_hi[0], r8);
+        uint8x16_t g_hi = lookup_neon(lut_hi[1], g8);
+        uint8x16_t b_hi = lookup_neon(lut_hi[2], b8);
+
+        // interleaving low and high bytes gives little endian uint16 values
+        uint16x8_t r[2] = {vreinterpretq_u16_u8(vzip1q_u8(r_lo, r_hi)),
+                           vreinterpretq_u16_u8(vzip2q_u8(r_lo, r_hi))};
+        uint16x8_t g[2] = {vreinterpretq_u16_u8(vzip1q_u8(g_lo, g_hi)),
+                           vreinterpretq_u16_u8(vzip2q_u8(g_lo, g_hi))};
+        uint16x8_t b[2] = {vreinterpretq_u16_u8(vzip1q_u8(b_lo, b_hi)),
+                           vreinterpretq_u16_u8(vzip2q_u8(b_lo, b_hi))};
+
+        for (int j = 0; j < 2; j++) {
+            uint32x4_t lo = vorrq_u32(
+                vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(r[j])), 20),
+                          vshll_n_u16(vget_low_u16(g[j]), 10)),
+                vmovl_u16(vget_low_u16(b[j])));
+            uint32x4_t hi = vorrq_u32(
+                vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(r[j])), 20),
+                          vshll_n_u16(vget_high_u16(g[j]), 10)),
+                vmovl_u16(vget_high_u16(b[j])));
+            vst1q_u32(result + 8 * j, lo);
+            vst1q_u32(result + 8 * j + 4, hi);
+        }
+    }
+#endif
+};
+
+// LUTs for regions of an installation, such as panels from different batches,
+// chosen for each entry of a matrix map by `regions[entry]`
+struct lut_regions {
+    std::vector<gamma_lut> luts;
+    std::vector<uint8_t> regions;
 };
 
+// Scratch storage for the row-at-a-time renderers. Keeping one of these
+// alive between frames means the render loop does not allocate.
+struct render_scratch {
+    // The rgb10 pixels of one address row, in matrix map order
+    std::vector<uint32_t> row;
+    // The pin words of one address row, indexed [shift * pixels_across + x]
+    std::vector<uint32_t> planes;
+    // The source pixels of one address row, before colorspace conversion
+    std::vector<uint8_t> gathered;
+};
+
+namespace detail {
+// Copy the source pixels of a row of the map into contiguous scratch storage
+template <typename T>
+const T *gather(std::vector<uint8_t> &scratch, const T *source,
+                const row_map &map) {
+    scratch.resize(map.n * sizeof(T));
+    T *result = reinterpret_cast<T *>(scratch.data());
+    map.for_each([=](size_t i, int index) { result[i] = source[index]; });
+    return result;
+}
+
+// Call convert(lut, begin, n) for each run of `n` entries of a row of the map
+// from `begin` that takes the same LUT, which is the colorspace's own unless
+// it has regions
+template <typename colorspace, typename F>
+void convert_regions(const colorspace &converter, const row_map &map,
+                     F convert) {
+    if (!converter.regions) {
+        return convert(converter.lut, 0, map.n);
+    }
+    const uint8_t *region = &converter.regions->regions[map.addr * map.n];
+    for (size_t begin = 0, end; begin < map.n; begin = end) {
+        end = begin + 1;
+        while (end < map.n && region[end] == region[begin]) {
+            end++;
+        }
+        convert(converter.regions->luts[region[begin]], begin, end - begin);
+    }
+}
+
+// Scale the source pixels of a row of the map as rgb888, using the
+// colorspace's `rgb888_at` to read them, and gamma convert the result
+template <typename colorspace>
+void gather_scaled(uint32_t *result, const colorspace &converter,
+                   const typename colorspace::data_type *source,
+                   const row_map &map, render_scratch &scratch) {
+    scratch.gathered.resize(map.n * sizeof(uint32_t));
+    uint32_t *gathered = reinterpret_cast<uint32_t *>(scratch.gathered.data());
+    converter.scale->template gather<8>(gathered, source, map,
+                                        colorspace::rgb888_at);
+    convert_regions(converter, map,
+                    [=](const gamma_lut &lut, size_t begin, size_t n) {
+                        lut.convert_rgb888_to_rgb10(result + begin,
+                                                    gathered + begin, n);
+                    });
+}
+} // namespace detail
+
+// Each colorspace can convert a whole framebuffer with `convert`, or with
+// `gather_rgb10` convert just the pixels selected by part of a matrix map.
+// The latter is what lets rendering work without a full rgb10 copy of the
+// framebuffer.
+//
+// If `scale` is set, `gather_rgb10` instead samples a rectangle of a larger
+// source image, scaling it to the geometry as it converts, and `rgb888_at`
+// reads the source pixels it needs. `convert` ignores `scale`.
+//
+// If `regions` is set, `gather_rgb10` converts each entry of the map with the
+// LUT of its region in place of `lut`. `convert` always uses `lut`.
 struct colorspace_rgb565 {
     using data_type = uint16_t;
     static constexpr size_t data_size_in_bytes(size_t n_pixels) {
@@ -84,7 +345,30 @@ struct colorspace_rgb565 {
         lut.convert_rgb565_to_rgb10(rgb10, data_in);
         return rgb10;
     }
+    void gather_rgb10(uint32_t *result, std::span<const data_type> data_in,
+                      const row_map &map, render_scratch &scratch) const {
+        if (scale) {
+            return detail::gather_scaled(result, *this, data_in.data(), map,
+                                         scratch);
+        }
+        auto gathered = detail::gather(scratch.gathered, data_in.data(), map);
+        detail::convert_regions(
+            *this, map, [=](const gamma_lut &lut, size_t begin, size_t n) {
+                lut.convert_rgb565_to_rgb10(result + begin, gathered + begin,
+                                            n);
+            });
+    }
+    static uint32_t rgb888_at(const data_type *source, size_t i) {
+        uint32_t data = source[i];
+        uint32_t r5 = (data >> 11) & 0x1f;
+        uint32_t g6 = (data >> 5) & 0x3f;
+        uint32_t b5 = data & 0x1f;
+        return (((r5 << 3) | (r5 >> 2)) << 16) |
+               (((g6 << 2) | (g6 >> 4)) << 8) | ((b5 << 3) | (b5 >> 2));
+    }
     std::vector<uint32_t> rgb10;
+    std::shared_ptr<const source_scaler> scale;
+    std::shared_ptr<const lut_regions> regions;
 };
 
 struct colorspace_rgb888 {
@@ -100,7 +384,25 @@ struct colorspace_rgb888 {
         lut.convert_rgb888_to_rgb10(rgb10, data_in);
         return rgb10;
     }
+    void gather_rgb10(uint32_t *result, std::span<const data_type> data_in,
+                      const row_map &map, render_scratch &scratch) const {
+        if (scale) {
+            return detail::gather_scaled(result, *this, data_in.data(), map,
+                                         scratch);
+        }
+        auto gathered = detail::gather(scratch.gathered, data_in.data(), map);
+        detail::convert_regions(
+            *this, map, [=](const gamma_lut &lut, size_t begin, size_t n) {
+                lut.convert_rgb888_to_rgb10(result + begin, gathered + begin,
+                                            n);
+            });
+    }
+    static uint32_t rgb888_at(const data_type *source, size_t i) {
+        return source[i];
+    }
     std::vector<uint32_t> rgb10;
+    std::shared_ptr<const source_scaler> scale;
+    std::shared_ptr<const lut_regions> regions;
 };
 
 struct colorspace_rgb888_packed {
@@ -116,16 +418,93 @@ struct colorspace_rgb888_packed {
         lut.convert_rgb888_packed_to_rgb10(rgb10, data_in);
         return rgb10;
     }
+    void gather_rgb10(uint32_t *result, std::span<const data_type> data_in,
+                      const row_map &map, render_scratch &scratch) const {
+        if (scale) {
+            return detail::gather_scaled(result, *this, data_in.data(), map,
+                                         scratch);
+        }
+        scratch.gathered.resize(map.n * 3);
+        uint8_t *gathered = scratch.gathered.data();
+        const uint8_t *source = data_in.data();
+        map.for_each([=](size_t i, int index) {
+            const uint8_t *px = &source[3 * index];
+            gathered[3 * i + 0] = px[0];
+            gathered[3 * i + 1] = px[1];
+            gathered[3 * i + 2] = px[2];
+        });
+        detail::convert_regions(
+            *this, map, [=](const gamma_lut &lut, size_t begin, size_t n) {
+                lut.convert_rgb888_packed_to_rgb10(result + begin,
+                                                   gathered + 3 * begin, n);
+            });
+    }
+    static uint32_t rgb888_at(const data_type *source, size_t i) {
+        const uint8_t *px = &source[3 * i];
+        return (uint32_t{px[0]} << 16) | (uint32_t{px[1]} << 8) | px[2];
+    }
     std::vector<uint32_t> rgb10;
+    std::shared_ptr<const source_scaler> scale;
+    std::shared_ptr<const lut_regions> regions;
 };
 
 struct colorspace_rgb10 {
     using data_type = uint32_t;
+    static constexpr size_t data_size_in_bytes(size_t n_pixels) {
+        return sizeof(data_type) * n_pixels;
+    }
 
     const std::span<const uint32_t>
     convert(std::span<const data_type> data_in) {
         return data_in;
     }
+    void gather_rgb10(uint32_t *result, std::span<const data_type> data_in,
+                      const row_map &map, render_scratch &) const {
+        const uint32_t *source = data_in.data();
+        if (scale) {
+            // Scaled in 10 bits per channel, so no precision is lost
+            return scale->gather<10>(result, source, map, rgb10_at);
+        }
+        map.for_each([=](size_t i, int index) { result[i] = source[index]; });
+    }
+    static uint32_t rgb10_at(const data_type *source, size_t i) {
+        return source[i];
+    }
+    std::shared_ptr<const source_scaler> scale;
+};
+
+// Linear 16 bits per channel, 3 channels per pixel in RGB order, of which the
+// top 10 bits are shown. Like rgb10, it takes no gamma conversion.
+struct colorspace_rgb16 {
+    using data_type = uint16_t;
+    static constexpr size_t data_size_in_bytes(size_t n_pixels) {
+        return sizeof(data_type) * n_pixels * 3;
+    }
+
+    const std::span<const uint32_t>
+    convert(std::span<const data_type> data_in) {
+        rgb10.resize(data_in.size() / 3);
+        for (size_t i = 0; i < rgb10.size(); i++) {
+            rgb10[i] = rgb10_at(data_in.data(), i);
+        }
+        return rgb10;
+    }
+    void gather_rgb10(uint32_t *result, std::span<const data_type> data_in,
+                      const row_map &map, render_scratch &) const {
+        const uint16_t *source = data_in.data();
+        if (scale) {
+            return scale->gather<10>(result, source, map, rgb10_at);
+        }
+        map.for_each(
+            [=](size_t i, int index) { result[i] = rgb10_at(source, index); });
+    }
+    static uint32_t rgb10_at(const data_type *source, size_t i) {
+        const uint16_t *px = &source[3 * i];
+        return (uint32_t{px[0]} >> 6 << 20) | (uint32_t{px[1]} >> 6 << 10) |
+               (px[2] >> 6);
+    }
+    std::vector<uint32_t> rgb10;
+    std::shared_ptr<const source_scaler> scale;
 };
 
 // Render a buffer in linear RGB10 format into a piomatter stream
@@ -195,9 +574,7 @@ void protomatter_render_rgb10(std::vector<uint32_t> &result,
 
     for (size_t addr = 0; addr < n_addr; addr++) {
         for (auto &schedule_ent : sched) {
-            uint32_t r_mask = 1 << (20 + schedule_ent.shift);
-            uint32_t g_mask = 1 << (10 + schedule_ent.shift);
-            uint32_t b_mask = 1 << (0 + schedule_ent.shift);
+            const uint32_t shift = schedule_ent.shift;
 
             prep_data(pixels_across);
             auto mapiter = matrixmap.map.begin() +
@@ -207,24 +584,25 @@ void protomatter_render_rgb10(std::vector<uint32_t> &result,
                 for (size_t px = 0; px < matrixmap.n_lanes; px++) {
                     assert(mapiter != matrixmap.map.end());
                     auto pixel0 = pixels[*mapiter++];
-                    auto r_bit = pixel0 & r_mask;
-                    auto g_bit = pixel0 & g_mask;
-                    auto b_bit = pixel0 & b_mask;
-
-                    if (r_bit)
-                        data |= (1 << pinout::PIN_RGB[px * 3 + 0]);
-                    if (g_bit)
-                        data |= (1 << pinout::PIN_RGB[px * 3 + 1]);
-                    if (b_bit)
-                        data |= (1 << pinout::PIN_RGB[px * 3 + 2]);
+                    data |= ((pixel0 >> (20 + shift)) & 1)
+                            << pinout::PIN_RGB[px * 3 + 0];
+                    data |= ((pixel0 >> (10 + shift)) & 1)
+                            << pinout::PIN_RGB[px * 3 + 1];
+                    data |= ((pixel0 >> (0 + shift)) & 1)
+                            << pinout::PIN_RGB[px * 3 + 2];
                 }
 
                 do_data_clk_active(data);
             }
 
-            do_data_delay(addr_bits | pinout::oe_active,
-                          active_time * CLOCKS_PER_DATA / CLOCKS_PER_DELAY -
-                              DELAY_OVERHEAD);
+            // Dark if the OE time was all spent while the data shifted out,
+            // as the shortest delay would otherwise light it for too long
+            int32_t lit_delay = active_time * CLOCKS_PER_DATA /
+                                    CLOCKS_PER_DELAY -
+                                DELAY_OVERHEAD;
+            do_data_delay(addr_bits | (lit_delay > 0 ? pinout::oe_active
+                                                     : pinout::oe_inactive),
+                          lit_delay);
 
             do_data_delay(addr_bits | pinout::oe_inactive,
                           pinout::post_oe_delay);
@@ -244,4 +622,566 @@ void protomatter_render_rgb10(std::vector<uint32_t> &result,
     }
 }
 
+namespace detail {
+template <typename pinout> constexpr uint32_t calc_addr_bits(size_t addr) {
+    uint32_t data = 0;
+    for (size_t i = 0; i < std::size(pinout::PIN_ADDR); i++) {
+        if (addr & (1u << i))
+            data |= (1u << pinout::PIN_ADDR[i]);
+    }
+    return data;
+}
+
+// Mask of the bit planes (shifts) used by any of the schedules
+inline uint32_t used_planes(std::span<const schedule> schedules) {
+    uint32_t result = 0;
+    for (auto &sched : schedules) {
+        for (auto &ent : sched) {
+            result |= 1u << ent.shift;
+        }
+    }
+    return result;
+}
+
+// The pin word for bit plane `k` of one pixel position, from the rgb10
+// pixels of its lanes. Index I of the sequence is PIN_RGB[I], channel I % 3
+// of lane I / 3.
+template <typename pinout, size_t... I>
+uint32_t plane_word(const uint32_t *pixels, int k, std::index_sequence<I...>) {
+    return ((((pixels[I / 3] >> (20 - 10 * (I % 3) + k)) & 1)
+             << pinout::PIN_RGB[I]) |
+            ...);
+}
+
+// Transpose one address row of rgb10 pixels into per-plane pin words.
+//
+// Each pixel is loaded once, and each of its 10-bit channels is sliced into
+// all used planes in a single pass, rather than re-reading the pixel for
+// every plane.
+//
+// If `lanes` is given, it must equal `n_lanes`. The loop over lanes and
+// channels is then unrolled with every pin a constant, and each plane word
+// is built in a register and stored once.
+template <typename pinout, size_t lanes = 0>
+void transpose_row(uint32_t *planes, const uint32_t *row, size_t n_lanes,
+                   size_t pixels_across, uint32_t plane_mask) {
+    if (!plane_mask)
+        return;
+    int lo = std::countr_zero(plane_mask);
+    int hi = 32 - std::countl_zero(plane_mask);
+    if constexpr (lanes != 0) {
+        static_assert(lanes * 3 <= std::size(pinout::PIN_RGB));
+        assert(n_lanes == lanes);
+        for (size_t x = 0; x < pixels_across; x++) {
+            const uint32_t *pixels = row + x * lanes;
+            for (int k = lo; k < hi; k++) {
+                planes[k * pixels_across + x] = plane_word<pinout>(
+                    pixels, k, std::make_index_sequence<lanes * 3>{});
+            }
+        }
+        return;
+    }
+    std::fill(planes + lo * pixels_across, planes + hi * pixels_across, 0);
+    for (size_t x = 0; x < pixels_across; x++) {
+        for (size_t px = 0; px < n_lanes; px++) {
+            uint32_t pixel = *row++;
+            for (int ch = 0; ch < 3; ch++) {
+                uint32_t v = pixel >> (20 - 10 * ch);
+                uint32_t pin = pinout::PIN_RGB[px * 3 + ch];
+                for (int k = lo; k < hi; k++) {
+                    planes[k * pixels_across + x] |= ((v >> k) & 1) << pin;
+                }
+            }
+        }
+    }
+}
+
+// The number of words in the stream for one address row of `sched`. This
+// doesn't depend on the row or its pixels, so row `addr` always starts at
+// `addr * row_stream_size(...)`.
+inline size_t row_stream_size(const schedule &sched, size_t pixels_across,
+                              size_t n_addr) {
+    // per entry: data command, data, and 3 delay commands with their data;
+    // plus one address change on the row's first entry
+    return sched.size() * (pixels_across + 7) + (n_addr > 1 ? 2 : 0);
+}
+
+// The offset within a row's span of the data words of schedule entry `j`
+inline size_t row_data_offset(size_t j, size_t pixels_across, size_t n_addr) {
+    return j * (pixels_across + 7) + 1 + (j && n_addr > 1 ? 2 : 0);
+}
+
+// Write the stream for one address row of `sched`, given the row's
+// transposed pin words. `active_time` is the OE time still owed to the
+// previously latched row. Returns the end of the row's stream.
+//
+// If `sched` is a dimmed copy of `full`, whose OE time owed is
+// `full_active_time`, each entry is padded with dark time to take as long as
+// it does in `full`, so the refresh rate stays the same and brightness is in
+// proportion to OE time.
+template <typename pinout>
+uint32_t *emit_row(uint32_t *out, size_t addr, size_t n_addr,
+                   const schedule &sched, int32_t active_time,
+                   const uint32_t *planes, size_t pixels_across,
+                   const schedule *full = nullptr,
+                   int32_t full_active_time = 0) {
+    // The delay count that a delay of `delay` cycles is sent as
+    auto delay_count = [](int32_t delay) {
+        return std::max((delay / CLOCKS_PER_DELAY) - DELAY_OVERHEAD, 1);
+    };
+    auto do_data_delay = [&out, delay_count](uint32_t data, int32_t delay) {
+        delay = delay_count(delay);
+        assert(delay < 1000000);
+        *out++ = command_delay | (delay ? delay - 1 : 0);
+        *out++ = data;
+    };
+    auto lit_delay = [pixels_across](int32_t active_time) {
+        return (active_time - int32_t(pixels_across)) * CLOCKS_PER_DATA /
+                   CLOCKS_PER_DELAY -
+               DELAY_OVERHEAD;
+    };
+
+    // the row starts out illuminating the previous address
+    size_t prev_addr = (addr + n_addr - 1) % n_addr;
+    uint32_t addr_bits = calc_addr_bits<pinout>(prev_addr);
+
+    assert(pixels_across);
+    assert(pixels_across < 60000);
+    for (size_t j = 0; j < sched.size(); j++) {
+        const auto &schedule_ent = sched[j];
+        const uint32_t *plane = planes + schedule_ent.shift * pixels_across;
+        const int32_t delay = lit_delay(active_time);
+
+        *out++ = command_data | (pixels_across - 1);
+        for (size_t x = 0; x < pixels_across; x++) {
+            bool active = active_time > 0;
+            active_time--;
+            *out++ = addr_bits | plane[x] |
+                     (active ? pinout::oe_active : pinout::oe_inactive);
+        }
+
+        // Dark if the OE time was all spent while the data shifted out, as
+        // the shortest delay would otherwise light it for too long
+        do_data_delay(addr_bits | (delay > 0 ? pinout::oe_active
+                                             : pinout::oe_inactive),
+                      delay);
+
+        int32_t post_oe_delay = pinout::post_oe_delay;
+        if (full) {
+            int32_t dark = delay_count(lit_delay(full_active_time)) -
+                           delay_count(delay);
+            if (dark > 0) {
+                post_oe_delay = (delay_count(post_oe_delay) + dark +
+                                 DELAY_OVERHEAD) *
+                                CLOCKS_PER_DELAY;
+            }
+            full_active_time = (*full)[j].active_time;
+        }
+        do_data_delay(addr_bits | pinout::oe_inactive, post_oe_delay);
+        do_data_delay(addr_bits | pinout::oe_inactive | pinout::lat_bit,
+                      pinout::post_latch_delay);
+
+        active_time = schedule_ent.active_time;
+
+        // with oe inactive, set address bits to illuminate THIS line
+        if (addr != prev_addr) {
+            addr_bits = calc_addr_bits<pinout>(addr);
+            do_data_delay(addr_bits | pinout::oe_inactive,
+                          pinout::post_addr_delay);
+            prev_addr = addr;
+        }
+    }
+    return out;
+}
+
+// Hash the source pixels of one address row, for spotting rows that are
+// unchanged since a buffer was last rendered (64-bit FNV-1a over the pixel
+// elements, in the order the map visits them)
+template <typename colorspace>
+uint64_t hash_row(std::span<const typename colorspace::data_type> pixels,
+                  const row_map &map) {
+    constexpr size_t elements_per_pixel =
+        colorspace::data_size_in_bytes(1) /
+        sizeof(typename colorspace::data_type);
+    const auto *source = pixels.data();
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    map.for_each([&](size_t, int index) {
+        const auto *px = &source[elements_per_pixel * index];
+        for (size_t j = 0; j < elements_per_pixel; j++) {
+            h = (h ^ px[j]) * UINT64_C(0x100000001b3);
+        }
+    });
+    return h;
+}
+
+// Hash one address row of converted rgb10 pixels, like hash_row
+inline uint64_t hash_rgb10(const uint32_t *row, size_t n) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ row[i]) * UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+} // namespace detail
+
+// The parts of the streams for a geometry that don't depend on the pixels:
+// the data and delay commands, and the address, OE and latch bits. Frames
+// are rendered by OR-ing the RGB bits into a copy of the skeleton, so none of
+// this is recomputed per frame.
+struct stream_skeleton {
+    // The stream for each schedule, with all RGB bits clear
+    std::vector<std::vector<uint32_t>> streams;
+    // For each schedule, the size of one address row's span of its stream
+    std::vector<size_t> row_sizes;
+    // For each schedule, the offsets within a row's span of the data words of
+    // each of its entries
+    std::vector<std::vector<size_t>> data_offsets;
+};
+
+// The skeleton of the streams for a geometry, played with `schedules`
+// instead of its own. They must have the same entries, with the same
+// shifts, but may have shorter OE times, as from dim_schedule; the streams
+// then take as long as the geometry's own.
+template <typename pinout>
+stream_skeleton make_stream_skeleton(const matrix_geometry &matrixmap,
+                                     const schedule_sequence &schedules) {
+    const size_t n_addr = 1u << matrixmap.n_addr_lines;
+    const size_t pixels_across = matrixmap.pixels_across;
+    const std::vector<uint32_t> no_pixels(10 * pixels_across);
+
+    stream_skeleton result;
+    for (size_t i = 0; i < schedules.size(); i++) {
+        const auto &sched = schedules[i];
+        size_t row_size =
+            detail::row_stream_size(sched, pixels_across, n_addr);
+        std::vector<uint32_t> stream(n_addr * row_size);
+        for (size_t addr = 0; addr < n_addr; addr++) {
+            // the first row continues the last entry of the previous schedule
+            size_t prev =
+                addr ? i : (i + schedules.size() - 1) % schedules.size();
+            [[maybe_unused]] auto end = detail::emit_row<pinout>(
+                &stream[addr * row_size], addr, n_addr, sched,
+                schedules[prev].back().active_time, no_pixels.data(),
+                pixels_across, &matrixmap.schedules[i],
+                matrixmap.schedules[prev].back().active_time);
+            assert(end == &stream[addr * row_size] + row_size);
+        }
+        std::vector<size_t> offsets;
+        for (size_t j = 0; j < sched.size(); j++) {
+            offsets.push_back(
+                detail::row_data_offset(j, pixels_across, n_addr));
+        }
+        result.streams.push_back(std::move(stream));
+        result.row_sizes.push_back(row_size);
+        result.data_offsets.push_back(std::move(offsets));
+    }
+    return result;
+}
+
+template <typename pinout>
+stream_skeleton make_stream_skeleton(const matrix_geometry &matrixmap) {
+    return make_stream_skeleton<pinout>(matrixmap, matrixmap.schedules);
+}
+
+// The skeleton for a geometry, shared with everyone else holding one for a
+// geometry of the same shape and schedules, so that it is built once however
+// many piomatters use it. Skeletons are kept only while they are held.
+template <typename pinout>
+std::shared_ptr<const stream_skeleton>
+shared_stream_skeleton(const matrix_geometry &matrixmap) {
+    using key = std::tuple<size_t, size_t, schedule_sequence>;
+    static std::mutex mutex;
+    static std::map<key, std::weak_ptr<const stream_skeleton>> cache;
+
+    key k{matrixmap.pixels_across, matrixmap.n_addr_lines,
+          matrixmap.schedules};
+    std::lock_guard<std::mutex> lock(mutex);
+    if (auto it = cache.find(k); it != cache.end()) {
+        if (auto result = it->second.lock()) {
+            return result;
+        }
+    }
+    std::erase_if(cache,
+                  [](const auto &item) { return item.second.expired(); });
+    auto result = std::make_shared<const stream_skeleton>(
+        make_stream_skeleton<pinout>(matrixmap));
+    cache[std::move(k)] = result;
+    return result;
+}
+
+// Whether a standard stream could have been rendered from a skeleton's
+// stream: its command words are the skeleton's, and its data words differ
+// from the skeleton's only in RGB bits. Such a stream has the skeleton's
+// timing, address and /OE bits, whatever its pixels, so this is what makes
+// streams from an untrusted source safe to play.
+template <typename pinout>
+bool matches_skeleton(std::span<const uint32_t> stream,
+                      std::span<const uint32_t> skeleton) {
+    uint32_t rgb_bits = 0;
+    for (auto pin : pinout::PIN_RGB) {
+        rgb_bits |= 1u << pin;
+    }
+    if (stream.size() != skeleton.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < skeleton.size();) {
+        uint32_t header = skeleton[i];
+        if (stream[i++] != header) {
+            return false;
+        }
+        size_t n = header & command_data ? (header & ~command_data) + 1 : 1;
+        for (size_t end = i + n; i < end; i++) {
+            if ((stream[i] ^ skeleton[i]) & ~rgb_bits) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The number of PIO cycles protomatter.pio spends with the panel lit while
+// playing a stream. Each command's first 3 cycles hold the previous data word
+// on the pins, then each data word is held for 2 cycles, or a delay's word
+// for y + 3 cycles. Streams start after a dark word.
+template <typename pinout>
+uint64_t stream_lit_cycles(const std::vector<uint32_t> &stream) {
+    constexpr uint32_t lead_cycles = 3;
+    auto lit = [](uint32_t word) {
+        return (word & pinout::oe_bit) == pinout::oe_active;
+    };
+    uint64_t cycles = 0;
+    uint32_t prev_word = pinout::oe_inactive;
+    for (size_t i = 0; i < stream.size();) {
+        uint32_t header = stream[i++];
+        if (lit(prev_word)) {
+            cycles += lead_cycles;
+        }
+        if (header & command_data) {
+            size_t n = (header & ~command_data) + 1;
+            for (size_t j = 0; j < n; j++) {
+                if (lit(stream[i + j])) {
+                    cycles += CLOCKS_PER_DATA;
+                }
+            }
+            i += n;
+        } else {
+            if (lit(stream[i])) {
+                cycles += DELAY_OVERHEAD + (header + 1) * CLOCKS_PER_DELAY -
+                          lead_cycles;
+            }
+            i++;
+        }
+        prev_word = stream[i - 1];
+    }
+    return cycles;
+}
+
+// What the streams for a geometry will cost to play, which doesn't depend on
+// the pixels shown
+struct stream_estimate {
+    // The size of the stream for each schedule
+    std::vector<size_t> bytes_per_schedule;
+    // PIO cycles to play every schedule once
+    uint64_t cycles_per_refresh;
+    // Passes through every schedule per second
+    double refresh_hz;
+    // The fraction of the time that the panel is lit. Each address row is
+    // lit for 1/2^n_addr_lines of this.
+    double duty_cycle;
+};
+
+// Estimate the cost of a geometry's streams in the standard format at a pixel
+// clock, from its skeleton
+template <typename pinout>
+stream_estimate estimate_streams(const matrix_geometry &matrixmap,
+                                 double pixel_clock) {
+    stream_estimate result{};
+    uint64_t lit_cycles = 0;
+    for (const auto &stream : make_stream_skeleton<pinout>(matrixmap).streams) {
+        result.bytes_per_schedule.push_back(stream.size() * sizeof(uint32_t));
+        result.cycles_per_refresh += stream_cycles(stream);
+        lit_cycles += stream_lit_cycles<pinout>(stream);
+    }
+    if (result.cycles_per_refresh) {
+        result.refresh_hz =
+            pixel_clock * CLOCKS_PER_DATA / result.cycles_per_refresh;
+        result.duty_cycle = double(lit_cycles) / result.cycles_per_refresh;
+    }
+    return result;
+}
+
+namespace detail {
+// Write one row's span of a stream: a copy of the skeleton's span, with each
+// entry's plane of RGB bits merged into its data words
+inline void fill_row(uint32_t *out, const uint32_t *skel, size_t row_size,
+                     const schedule &sched, const std::vector<size_t> &offsets,
+                     const uint32_t *planes, size_t pixels_across) {
+    size_t pos = 0;
+    for (size_t j = 0; j < sched.size(); j++) {
+        size_t offset = offsets[j];
+        std::copy(skel + pos, skel + offset, out + pos);
+        const uint32_t *plane = planes + sched[j].shift * pixels_across;
+        for (size_t x = 0; x < pixels_across; x++) {
+            out[offset + x] = skel[offset + x] | plane[x];
+        }
+        pos = offset + pixels_across;
+    }
+    std::copy(skel + pos, skel + row_size, out + pos);
+}
+} // namespace detail
+
+// Render a buffer in linear RGB10 format into a piomatter stream.
+//
+// This produces exactly the same stream as protomatter_render_rgb10, but
+// gathers each address row through the matrix map just once and builds all
+// of its bit planes from that contiguous copy.
+template <typename pinout>
+void protomatter_render_rgb10_transposed(std::vector<uint32_t> &result,
+                                         const matrix_geometry &matrixmap,
+                                         const schedule &sched,
+                                         uint32_t old_active_time,
+                                         const uint32_t *pixels,
+                                         render_scratch &scratch) {
+    const size_t n_addr = 1u << matrixmap.n_addr_lines;
+    const size_t n_lanes = matrixmap.n_lanes;
+    const size_t pixels_across = matrixmap.pixels_across;
+    const size_t row_size = n_lanes * pixels_across;
+    const uint32_t plane_mask = detail::used_planes({&sched, 1});
+
+    result.resize(n_addr *
+                  detail::row_stream_size(sched, pixels_across, n_addr));
+    scratch.row.resize(row_size);
+    scratch.planes.resize(10 * pixels_across);
+
+    uint32_t *out = result.data();
+    for (size_t addr = 0; addr < n_addr; addr++) {
+        auto mapiter = matrixmap.map.begin() + row_size * addr;
+        for (size_t i = 0; i < row_size; i++) {
+            scratch.row[i] = pixels[*mapiter++];
+        }
+        detail::transpose_row<pinout>(scratch.planes.data(), scratch.row.data(),
+                                      n_lanes, pixels_across, plane_mask);
+        out = detail::emit_row<pinout>(out, addr, n_addr, sched,
+                                       addr ? sched.back().active_time
+                                            : old_active_time,
+                                       scratch.planes.data(), pixels_across);
+    }
+    assert(out == result.data() + result.size());
+}
+
+// Size the streams in `result` to match the skeleton, before rendering rows
+// into them. Returns whether the rows recorded in `row_hashes` (if given)
+// still describe the contents of `result`.
+inline bool
+protomatter_render_prepare(std::vector<std::vector<uint32_t>> &result,
+                           const stream_skeleton &skeleton, size_t n_addr,
+                           std::vector<uint64_t> *row_hashes) {
+    bool reuse = row_hashes && row_hashes->size() == n_addr &&
+                 result.size() == skeleton.streams.size();
+    result.resize(skeleton.streams.size());
+    for (size_t i = 0; i < skeleton.streams.size(); i++) {
+        size_t size = skeleton.streams[i].size();
+        reuse = reuse && result[i].size() == size;
+        result[i].resize(size);
+    }
+    if (row_hashes) {
+        row_hashes->resize(n_addr);
+    }
+    return reuse;
+}
+
+// Render address rows [addr_begin, addr_end) of a framebuffer into streams
+// sized by protomatter_render_prepare. Distinct row ranges touch distinct
+// parts of `result` and `row_hashes`, so they can be rendered concurrently,
+// each with its own scratch.
+//
+// Returns the number of address rows that were rendered.
+template <typename pinout, typename colorspace, size_t lanes = 0>
+size_t protomatter_render_rows(
+    std::vector<std::vector<uint32_t>> &result,
+    const matrix_geometry &matrixmap, const stream_skeleton &skeleton,
+    const colorspace &converter,
+    std::span<const typename colorspace::data_type> pixels,
+    render_scratch &scratch, std::vector<uint64_t> *row_hashes, bool reuse,
+    size_t addr_begin, size_t addr_end) {
+    const auto &schedules = matrixmap.schedules;
+    const size_t n_lanes = matrixmap.n_lanes;
+    const size_t pixels_across = matrixmap.pixels_across;
+    const size_t row_size = n_lanes * pixels_across;
+    const uint32_t plane_mask = detail::used_planes(schedules);
+
+    assert(skeleton.streams.size() == schedules.size());
+    scratch.row.resize(row_size);
+    scratch.planes.resize(10 * pixels_across);
+
+    size_t rendered = 0;
+    for (size_t addr = addr_begin; addr < addr_end; addr++) {
+        const row_map map = matrixmap.row(addr);
+        // A scaled row reads a whole band of the source image, so it is
+        // hashed after conversion rather than before
+        const bool scaled = converter.scale != nullptr;
+        if (scaled) {
+            converter.gather_rgb10(scratch.row.data(), pixels, map, scratch);
+        }
+        if (row_hashes) {
+            uint64_t h =
+                scaled ? detail::hash_rgb10(scratch.row.data(), map.n)
+                       : detail::hash_row<colorspace>(pixels, map);
+            if (reuse && (*row_hashes)[addr] == h) {
+                continue;
+            }
+            (*row_hashes)[addr] = h;
+        }
+        rendered++;
+
+        if (!scaled) {
+            converter.gather_rgb10(scratch.row.data(), pixels, map, scratch);
+        }
+        detail::transpose_row<pinout, lanes>(scratch.planes.data(),
+                                             scratch.row.data(), n_lanes,
+                                             pixels_across, plane_mask);
+        for (size_t i = 0; i < schedules.size(); i++) {
+            size_t span = skeleton.row_sizes[i];
+            detail::fill_row(&result[i][addr * span],
+                             &skeleton.streams[i][addr * span], span,
+                             schedules[i], skeleton.data_offsets[i],
+                             scratch.planes.data(), pixels_across);
+        }
+    }
+    return rendered;
+}
+
+// Render a framebuffer in any colorspace into the streams for every schedule
+// of the geometry, using its precomputed skeleton.
+//
+// Source pixels are converted to rgb10 one address row at a time as they are
+// gathered through the matrix map, and each row is transposed once and then
+// merged into the skeleton for all the schedules. No rgb10 copy of the whole
+// framebuffer is made, and each source pixel is read once per frame.
+//
+// If `row_hashes` is given, it records a hash of the source pixels of each
+// row as it was last rendered into `result`. Rows whose hash is unchanged
+// are left as they are, and only the other rows' spans of the streams are
+// rewritten. Pass an empty vector to force a full render.
+//
+// A nonzero `lanes`, which must equal the geometry's lane count, selects a
+// transpose specialized for that many lanes.
+//
+// Returns the number of address rows that were rendered.
+template <typename pinout, typename colorspace, size_t lanes = 0>
+size_t
+protomatter_render(std::vector<std::vector<uint32_t>> &result,
+                   const matrix_geometry &matrixmap,
+                   const stream_skeleton &skeleton, const colorspace &converter,
+                   std::span<const typename colorspace::data_type> pixels,
+                   render_scratch &scratch,
+                   std::vector<uint64_t> *row_hashes = nullptr) {
+    const size_t n_addr = 1u << matrixmap.n_addr_lines;
+    bool reuse =
+        protomatter_render_prepare(result, skeleton, n_addr, row_hashes);
+    return protomatter_render_rows<pinout, colorspace, lanes>(
+        result, matrixmap, skeleton, converter, pixels, scratch, row_hashes,
+        reuse, 0, n_addr);
+}
+
 } // namespace piomatter
@@ -0,0 +1,86 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace piomatter {
+
+// A set of persistent worker threads that, together with the calling thread,
+// run one job at a time with each thread working on its own band of it.
+struct render_pool {
+    explicit render_pool(size_t n_workers) {
+        for (size_t i = 0; i < n_workers; i++) {
+            workers.emplace_back(&render_pool::worker, this, i + 1);
+        }
+    }
+    render_pool(const render_pool &) = delete;
+    render_pool &operator=(const render_pool &) = delete;
+
+    ~render_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exiting = true;
+        }
+        start_cv.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    // The number of bands each job is split into: one per worker, plus one
+    // for the calling thread
+    size_t n_bands() const { return workers.size() + 1; }
+
+    // Call `job(band)` for each band in [0, n_bands()) and wait for all of
+    // them to finish. Band 0 runs on the calling thread.
+    void run(const std::function<void(size_t)> &job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current_job = &job;
+            pending = workers.size();
+            generation++;
+        }
+        start_cv.notify_all();
+        job(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending) {
+            done_cv.wait(lock);
+        }
+        current_job = nullptr;
+    }
+
+  private:
+    void worker(size_t band) {
+        uint64_t seen_generation = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            while (!exiting && generation == seen_generation) {
+                start_cv.wait(lock);
+            }
+            if (exiting) {
+                return;
+            }
+            seen_generation = generation;
+            auto job = current_job;
+            lock.unlock();
+            (*job)(band);
+            lock.lock();
+            if (--pending == 0) {
+                done_cv.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+    const std::function<void(size_t)> *current_job = nullptr;
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool exiting = false;
+};
+
+} // namespace piomatter
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "matrixmap.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// The NEON paths, here and in render.h, use AArch64-only instructions such
+// as the 4-register table lookups. Define PIOMATTER_NO_NEON to force the
+// scalar code.
+#if defined(__ARM_NEON) && defined(__aarch64__) && !defined(PIOMATTER_NO_NEON)
+#define PIOMATTER_NEON 1
+#endif
+
+namespace piomatter {
+
+enum class scale_filter {
+    // Average every source pixel that falls in each matrix pixel. The right
+    // choice for large reductions, such as a screen onto a panel.
+    box,
+    // Interpolate between the 4 source pixels nearest each matrix pixel's
+    // centre. Smoother for scales near 1, but it skips source pixels when
+    // shrinking by more than 2 times.
+    bilinear,
+};
+
+// A rectangle of a larger source image to scale to the whole of a geometry,
+// in place of a source image of exactly the geometry's size. The rows of the
+// source image are `stride` pixels apart.
+struct source_scale {
+    size_t x = 0, y = 0, width = 0, height = 0;
+    size_t stride = 0;
+    scale_filter filter = scale_filter::box;
+};
+
+// The source pixels that each pixel of an out_width x out_height image is
+// made from, for sampling a source_scale as it is gathered through a matrix
+// map. Nothing is stored per frame: each matrix pixel reads its source
+// pixels straight from the source image.
+struct source_scaler {
+    source_scaler(const source_scale &scale, size_t out_width,
+                  size_t out_height)
+        : scale(scale), out_width(out_width) {
+        if (!scale.width || !scale.height || !out_width || !out_height) {
+            throw std::invalid_argument("a scaled image can't be empty");
+        }
+        if (scale.x + scale.width > scale.stride) {
+            throw std::range_error(
+                "the scaled rectangle is wider than the image stride");
+        }
+        // The box sums of one source row must fit in 16 bits per channel
+        if (scale.width > 256 * out_width || scale.height > 256 * out_height) {
+            throw std::invalid_argument(
+                "an image can be scaled down by at most 256 times");
+        }
+        cols = make_taps(scale.x, scale.width, out_width, 1);
+        rows = make_taps(scale.y, scale.height, out_height, scale.stride);
+    }
+
+    // The number of pixels of the source image that must exist
+    size_t extent() const {
+        return (scale.y + scale.height - 1) * scale.stride + scale.x +
+               scale.width;
+    }
+
+    // Store the scaled pixels of one row of the map at `result`, packed
+    // like rgb888 for bits=8 or like rgb10 for bits=10. `load(source, i)`
+    // reads source pixel i in that packing.
+    //
+    // Channels are summed two to a 64-bit word, so a box filter takes two
+    // adds per source pixel. With NEON, the 8-bit box filter sums four
+    // pixels' bytes at a time.
+    template <unsigned bits, typename T, typename F>
+    void gather(uint32_t *result, const T *source, const row_map &map,
+                F load) const {
+        if (scale.filter == scale_filter::box) {
+            map.for_each([&](size_t i, int index) {
+                result[i] =
+                    box<bits>(source, rows[index / out_width],
+                              cols[index % out_width], load);
+            });
+        } else {
+            map.for_each([&](size_t i, int index) {
+                result[i] =
+                    bilinear<bits>(source, rows[index / out_width],
+                                   cols[index % out_width], load);
+            });
+        }
+    }
+
+  private:
+    // The source pixels of one output row or column: for the box filter,
+    // the `n` pixels from `start`, `step` apart; for the bilinear filter,
+    // the pixel at `start` and, if n is 2, the one after it with weight
+    // frac / 256
+    struct tap {
+        size_t start, step;
+        uint32_t n, frac;
+    };
+
+    std::vector<tap> make_taps(size_t origin, size_t size, size_t out_size,
+                               size_t step) const {
+        std::vector<tap> result(out_size);
+        for (size_t i = 0; i < out_size; i++) {
+            auto &t = result[i];
+            size_t s;
+            t.step = step;
+            if (scale.filter == scale_filter::box) {
+                s = i * size / out_size;
+                size_t e = std::max((i + 1) * size / out_size, s + 1);
+                t.n = e - s;
+                t.frac = 0;
+            } else {
+                // The pixel centre in 1/256ths of a source pixel
+                size_t pos = (2 * i + 1) * size * 128 / out_size;
+                pos = pos > 128 ? pos - 128 : 0;
+                s = pos >> 8;
+                t.frac = pos & 255;
+                if (s + 1 >= size) {
+                    s = size - 1;
+                    t.frac = 0;
+                }
+                t.n = t.frac ? 2 : 1;
+            }
+            t.start = (origin + s) * step;
+        }
+        return result;
+    }
+
+    template <unsigned bits>
+    static uint32_t pack(uint32_t r, uint32_t g, uint32_t b) {
+        return (r << (2 * bits)) | (g << bits) | b;
+    }
+
+    template <unsigned bits, typename T, typename F>
+    static uint32_t box(const T *source, const tap &row, const tap &col,
+                        F load) {
+        constexpr uint64_t mask = (1u << bits) - 1;
+        constexpr uint64_t field = (uint64_t{1} << (2 * bits)) - 1;
+        constexpr uint64_t outer = mask | (mask << (2 * bits));
+        uint32_t r = 0, g = 0, b = 0;
+        size_t offset = row.start + col.start;
+#if PIOMATTER_NEON
+        uint32x4_t sums = vdupq_n_u32(0);
+#endif
+        for (uint32_t y = 0; y < row.n; y++, offset += row.step) {
+            uint32_t x = 0;
+#if PIOMATTER_NEON
+            if constexpr (bits == 8) {
+                // The bytes B, G, R, X of pixels 0 and 1 of each 4 go to lo,
+                // and of 2 and 3 to hi. A row of at most 257 pixels can't
+                // overflow their 16-bit lanes.
+                uint16x8_t lo = vdupq_n_u16(0), hi = lo;
+                for (; x + 4 <= col.n; x += 4) {
+                    const uint32_t px[4] = {
+                        uint32_t(load(source, offset + x)),
+                        uint32_t(load(source, offset + x + 1)),
+                        uint32_t(load(source, offset + x + 2)),
+                        uint32_t(load(source, offset + x + 3))};
+                    uint8x16_t v = vreinterpretq_u8_u32(vld1q_u32(px));
+                    lo = vaddw_u8(lo, vget_low_u8(v));
+                    hi = vaddw_high_u8(hi, v);
+                }
+                uint16x8_t both = vaddq_u16(lo, hi);
+                sums = vaddw_high_u16(vaddw_u16(sums, vget_low_u16(both)),
+                                      both);
+            }
+#endif
+            uint64_t rb = 0, gg = 0;
+            for (; x < col.n; x++) {
+                uint64_t v = load(source, offset + x);
+                rb += v & outer;
+                gg += (v >> bits) & mask;
+            }
+            r += rb >> (2 * bits);
+            g += gg;
+            b += rb & field;
+        }
+#if PIOMATTER_NEON
+        r += vgetq_lane_u32(sums, 2);
+        g += vgetq_lane_u32(sums, 1);
+        b += vgetq_lane_u32(sums, 0);
+#endif
+        uint32_t n = row.n * col.n;
+        return pack<bits>((r + n / 2) / n, (g + n / 2) / n, (b + n / 2) / n);
+    }
+
+    template <unsigned bits, typename T, typename F>
+    static uint32_t bilinear(const T *source, const tap &row, const tap &col,
+                             F load) {
+        constexpr uint64_t mask = (1u << bits) - 1;
+        constexpr uint64_t field = (uint64_t{1} << (2 * bits)) - 1;
+        constexpr uint64_t outer = mask | (mask << (2 * bits));
+        size_t offset = row.start + col.start;
+        size_t dx = col.n > 1 ? 1 : 0;
+        uint64_t r[2], g[2], b[2];
+        for (int j = 0; j < 2; j++) {
+            // Each channel times a weight of at most 256 still fits its field
+            uint64_t v0 = load(source, offset), v1 = load(source, offset + dx);
+            uint64_t rb = (v0 & outer) * (256 - col.frac) +
+                          (v1 & outer) * col.frac;
+            uint64_t gg = ((v0 >> bits) & mask) * (256 - col.frac) +
+                          ((v1 >> bits) & mask) * col.frac;
+            r[j] = rb >> (2 * bits);
+            g[j] = gg;
+            b[j] = rb & field;
+            if (row.n > 1) {
+                offset += row.step;
+            }
+        }
+        auto lerp = [&](const uint64_t *c) {
+            return uint32_t((c[0] * (256 - row.frac) + c[1] * row.frac +
+                             32768) >>
+                            16);
+        };
+        return pack<bits>(lerp(r), lerp(g), lerp(b));
+    }
+
+    source_scale scale;
+    size_t out_width;
+    std::vector<tap> cols, rows;
+};
+
+} // namespace piomatter
@@ -0,0 +1,52 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+
+namespace piomatter {
+
+// A fixed-capacity queue with one producer thread and one consumer thread.
+// Neither side takes a lock; the consumer sleeps in atomic::wait when it
+// needs to block.
+template <class T, size_t N> struct spsc_queue {
+    static_assert(N && (N & (N - 1)) == 0, "capacity must be a power of 2");
+
+    void push(T t) {
+        auto t_idx = tail.load(std::memory_order_relaxed);
+        assert(t_idx - head.load(std::memory_order_acquire) < N);
+        slots[t_idx % N] = t;
+        tail.store(t_idx + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+
+    std::optional<T> pop_nonblocking() {
+        auto h_idx = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h_idx) {
+            return {};
+        }
+        return take(h_idx);
+    }
+
+    T pop_blocking() {
+        auto h_idx = head.load(std::memory_order_relaxed);
+        uint32_t t_idx;
+        while ((t_idx = tail.load(std::memory_order_acquire)) == h_idx) {
+            tail.wait(t_idx, std::memory_order_acquire);
+        }
+        return take(h_idx);
+    }
+
+  private:
+    T take(uint32_t h_idx) {
+        T val = slots[h_idx % N];
+        head.store(h_idx + 1, std::memory_order_release);
+        return val;
+    }
+
+    std::array<T, N> slots{};
+    std::atomic<uint32_t> head{0}, tail{0};
+};
+
+} // namespace piomatter
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+namespace piomatter {
+
+// A histogram of durations in power-of-2 nanosecond buckets: bucket 0 counts
+// durations of 0ns, and bucket i > 0 those from 2^(i-1) to 2^i - 1 ns. The
+// last bucket also counts anything longer. Safe to record from one thread
+// while others read.
+struct log2_histogram {
+    static constexpr size_t n_buckets = 36; // up to ~34s
+
+    void record(uint64_t ns) {
+        size_t i = std::min(size_t(std::bit_width(ns)), n_buckets - 1);
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &b : buckets) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        count.store(0, std::memory_order_relaxed);
+        total_ns.store(0, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, n_buckets> buckets{};
+    std::atomic<uint64_t> count{0}, total_ns{0};
+};
+
+// Counters and timings kept by a piomatter. Each field is updated by one
+// thread, either the one calling show() or the refresh thread, and may be
+// read at any time.
+struct piomatter_stats {
+    // show(): time waiting for a free buffer
+    log2_histogram wait_free;
+    // show(): time converting and rendering the frame, which are done
+    // together in a single pass
+    log2_histogram render;
+    // show(): time re-encoding the frame as compact streams
+    log2_histogram encode;
+    // refresh thread: time to send one schedule's stream
+    log2_histogram xfer;
+    // refresh thread: for frames shown with a target time, how far from the
+    // target the pass through the schedules that first showed them started
+    log2_histogram present_error;
+    // refresh thread: time from a frame being submitted to it starting to
+    // be sent to the panel, once the frames before it have been
+    log2_histogram present_latency;
+
+    // refresh thread: frames put on display, which leaves out those
+    // dropped or still queued
+    std::atomic<uint64_t> frames_shown{0};
+    // frames not rendered because no buffer was free, under
+    // submit_policy::never_block
+    std::atomic<uint64_t> frames_skipped{0};
+    // rendered frames that were replaced before being displayed, under
+    // submit_policy::drop_oldest
+    std::atomic<uint64_t> frames_dropped{0};
+    // frames with a target time that reached the refresh thread too late to
+    // be shown at the pass nearest it
+    std::atomic<uint64_t> presents_late{0};
+
+    std::atomic<uint64_t> schedules_sent{0};
+    // passes through the whole schedule sequence, and those that displayed
+    // the same frame as the previous pass
+    std::atomic<uint64_t> refreshes{0}, repeated_refreshes{0};
+    // ioctl calls made to send the schedules
+    std::atomic<uint64_t> xfer_ioctls{0};
+
+    // The most recent transfer errors, oldest first once n_errors exceeds
+    // the ring's size
+    static constexpr size_t error_ring_size = 16;
+    std::array<std::atomic<int>, error_ring_size> error_errnos{};
+    std::atomic<uint64_t> n_errors{0};
+
+    void record_error(int errno_value) {
+        uint64_t i = n_errors.load(std::memory_order_relaxed);
+        error_errnos[i % error_ring_size].store(errno_value,
+                                                std::memory_order_relaxed);
+        n_errors.store(i + 1, std::memory_order_release);
+    }
+
+    void reset() {
+        for (auto *h : {&wait_free, &render, &encode, &xfer, &present_error,
+                        &present_latency}) {
+            h->reset();
+        }
+        for (auto *c : {&frames_shown, &frames_skipped, &frames_dropped,
+                        &presents_late, &schedules_sent, &refreshes,
+                        &repeated_refreshes, &xfer_ioctls, &n_errors}) {
+            c->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+} // namespace piomatter
@@ -0,0 +1,472 @@
+#pragma once
+
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "piomatter/compact.h"
+#include "piomatter/frame_source.h"
+#include "piomatter/matrixmap.h"
+#include "piomatter/render.h"
+
+namespace piomatter {
+
+// A file of frames rendered ahead of time for one pinout and geometry, which
+// a piomatter plays from a read-only mapping, so that it can hold more video
+// than fits in memory. The layout, in native (little endian) byte order:
+//
+// - stream_file_header
+// - for each schedule, its number of entries and then its schedule_entry
+//   values, as recorded in the header for reference
+// - the blocks: the stream for each schedule of each frame, as 32-bit words
+// - at header.index_offset, a multiple of 8, the duration of each frame in
+//   ns (uint64_t), then a stream_file_block for each schedule of each frame,
+//   frame by frame
+//
+// A block is either the stream's words, or a delta against the same
+// schedule's stream in the previous frame: pairs of a count of words to keep
+// and a count of words that follow to replace the next ones with.
+static_assert(std::endian::native == std::endian::little);
+
+constexpr char stream_file_magic[8] = {'P', 'I', 'O', 'M', 'S', 'T', 'R', 'M'};
+// Version 1 files didn't align the index, and aren't read
+constexpr uint32_t stream_file_version = 2;
+// The streams are in the compact format, for protomatter_compact.pio
+constexpr uint32_t stream_file_compact = 1;
+
+enum stream_file_encoding : uint32_t { stream_file_raw, stream_file_delta };
+
+struct stream_file_header {
+    char magic[8];
+    uint32_t version, flags;
+    // stream_format_id() of the pinout, geometry and stream format
+    uint64_t format_id;
+    uint32_t pixels_across, n_addr_lines, n_lanes, n_schedules;
+    uint32_t width, height;
+    uint64_t n_frames, index_offset;
+};
+
+struct stream_file_block {
+    // In bytes from the start of the file, and in words
+    uint64_t offset;
+    uint32_t size;
+    // The number of words in the decoded stream
+    uint32_t n_words;
+    uint32_t encoding, reserved;
+};
+
+// A fingerprint of everything a rendered stream depends on apart from the
+// pixels: the skeleton, which holds the address, latch and /OE bits and all
+// timing, and the pinout's RGB pins
+template <typename pinout>
+uint64_t stream_format_id(const stream_skeleton &skeleton, bool compact) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    auto add = [&h](uint64_t value) {
+        h = (h ^ value) * UINT64_C(0x100000001b3);
+    };
+    for (const auto &stream : skeleton.streams) {
+        add(stream.size());
+        for (auto word : stream) {
+            add(word);
+        }
+    }
+    for (auto pin : pinout::PIN_RGB) {
+        add(pin);
+    }
+    add(compact);
+    return h;
+}
+
+namespace detail {
+// Encode `stream` as changes to `previous`, which has the same size. Runs of
+// fewer than 3 unchanged words are replaced along with their neighbours, as
+// keeping them would take as many words.
+inline void encode_delta(std::vector<uint32_t> &result,
+                         const std::vector<uint32_t> &previous,
+                         const std::vector<uint32_t> &stream) {
+    constexpr size_t min_keep = 3;
+    result.clear();
+    const size_t n = stream.size();
+    size_t i = 0;
+    while (i < n) {
+        size_t keep_end = i;
+        while (keep_end < n && stream[keep_end] == previous[keep_end]) {
+            keep_end++;
+        }
+        if (keep_end == n) {
+            break;
+        }
+        size_t replace_end = keep_end;
+        for (;;) {
+            while (replace_end < n &&
+                   stream[replace_end] != previous[replace_end]) {
+                replace_end++;
+            }
+            size_t same_end = replace_end;
+            while (same_end < n && same_end - replace_end < min_keep &&
+                   stream[same_end] == previous[same_end]) {
+                same_end++;
+            }
+            if (same_end == n || same_end - replace_end >= min_keep) {
+                break;
+            }
+            replace_end = same_end;
+        }
+        result.push_back(keep_end - i);
+        result.push_back(replace_end - keep_end);
+        result.insert(result.end(), &stream[keep_end], &stream[replace_end]);
+        i = replace_end;
+    }
+}
+
+// Whether a delta from encode_delta fits a stream of n_words words, with no
+// words left over
+inline bool delta_fits(size_t n_words, std::span<const uint32_t> delta) {
+    size_t pos = 0, i = 0;
+    while (delta.size() - i >= 2) {
+        size_t keep = delta[i], replace = delta[i + 1];
+        i += 2;
+        if (replace > delta.size() - i || keep > n_words - pos ||
+            replace > n_words - pos - keep) {
+            return false;
+        }
+        pos += keep + replace;
+        i += replace;
+    }
+    return i == delta.size();
+}
+
+// Apply a delta from encode_delta to `stream`. Returns false, leaving the
+// stream partly updated, if the delta doesn't fit it.
+inline bool apply_delta(std::vector<uint32_t> &stream,
+                        std::span<const uint32_t> delta) {
+    size_t pos = 0;
+    for (size_t i = 0; i + 2 <= delta.size();) {
+        size_t keep = delta[i], replace = delta[i + 1];
+        i += 2;
+        if (replace > delta.size() - i || keep > stream.size() - pos ||
+            replace > stream.size() - pos - keep) {
+            return false;
+        }
+        pos += keep;
+        memcpy(&stream[pos], &delta[i], replace * sizeof(uint32_t));
+        pos += replace;
+        i += replace;
+    }
+    return true;
+}
+} // namespace detail
+
+// Writes frames to a stream file. The file is complete once close() returns.
+template <typename pinout> struct stream_file_writer {
+    using bufseq_type = std::vector<std::vector<uint32_t>>;
+
+    // With `delta`, each schedule's stream is stored as a delta against the
+    // previous frame's whenever that is smaller
+    stream_file_writer(const std::string &path,
+                       const matrix_geometry &geometry, bool compact = false,
+                       bool delta = true)
+        : geometry(geometry), skeleton(make_stream_skeleton<pinout>(geometry)),
+          compact(compact), delta(delta), path(path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        memcpy(header.magic, stream_file_magic, sizeof(header.magic));
+        header.version = stream_file_version;
+        header.flags = compact ? stream_file_compact : 0;
+        header.format_id = stream_format_id<pinout>(skeleton, compact);
+        header.pixels_across = geometry.pixels_across;
+        header.n_addr_lines = geometry.n_addr_lines;
+        header.n_lanes = geometry.n_lanes;
+        header.n_schedules = geometry.schedules.size();
+        header.width = geometry.width;
+        header.height = geometry.height;
+        // Rewritten by close()
+        write(&header, sizeof(header));
+        for (const auto &sched : geometry.schedules) {
+            uint32_t n_entries = sched.size();
+            write(&n_entries, sizeof(n_entries));
+            write(sched.data(), sched.size() * sizeof(schedule_entry));
+        }
+    }
+
+    stream_file_writer(const stream_file_writer &) = delete;
+    stream_file_writer &operator=(const stream_file_writer &) = delete;
+
+    ~stream_file_writer() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    // Render a frame of the writer's geometry and add it
+    template <typename colorspace>
+    void add_frame(const colorspace &converter,
+                   std::span<const typename colorspace::data_type> pixels,
+                   uint64_t duration_ns) {
+        protomatter_render<pinout>(rendered, geometry, skeleton, converter,
+                                   pixels, scratch);
+        add_streams(rendered, duration_ns);
+    }
+
+    // Add a frame given as the standard streams for the writer's geometry
+    void add_streams(const bufseq_type &streams, uint64_t duration_ns) {
+        if (!file) {
+            throw std::logic_error("stream file is closed");
+        }
+        if (streams.size() != skeleton.streams.size()) {
+            throw std::invalid_argument("frame has the wrong schedule count");
+        }
+        previous.resize(streams.size());
+        for (size_t i = 0; i < streams.size(); i++) {
+            const std::vector<uint32_t> *words = &streams[i];
+            if (compact) {
+                compact_stream<pinout>(encoded, streams[i]);
+                words = &encoded;
+            }
+            stream_file_block block{offset, uint32_t(words->size()),
+                                    uint32_t(words->size()), stream_file_raw,
+                                    0};
+            const std::vector<uint32_t> *stored = words;
+            if (delta && previous[i].size() == words->size()) {
+                detail::encode_delta(delta_words, previous[i], *words);
+                if (delta_words.size() < words->size()) {
+                    block.size = delta_words.size();
+                    block.encoding = stream_file_delta;
+                    stored = &delta_words;
+                }
+            }
+            write(stored->data(), stored->size() * sizeof(uint32_t));
+            blocks.push_back(block);
+            previous[i] = *words;
+        }
+        durations_ns.push_back(duration_ns);
+    }
+
+    // Write the index and header and close the file
+    void close() {
+        if (!file) {
+            return;
+        }
+        header.n_frames = durations_ns.size();
+        // The blocks are whole words, but the index holds 64-bit fields
+        if (offset % sizeof(uint64_t)) {
+            uint32_t pad = 0;
+            write(&pad, sizeof(pad));
+        }
+        header.index_offset = offset;
+        write(durations_ns.data(), durations_ns.size() * sizeof(uint64_t));
+        write(blocks.data(), blocks.size() * sizeof(stream_file_block));
+        bool ok = fseek(file, 0, SEEK_SET) == 0 &&
+                  fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+
+    size_t n_frames() const { return durations_ns.size(); }
+
+  private:
+    void write(const void *data, size_t size) {
+        if (size && fwrite(data, size, 1, file) != 1) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        offset += size;
+    }
+
+    matrix_geometry geometry;
+    stream_skeleton skeleton;
+    bool compact, delta;
+    std::string path;
+    FILE *file = nullptr;
+    uint64_t offset = 0;
+    stream_file_header header{};
+    std::vector<uint64_t> durations_ns;
+    std::vector<stream_file_block> blocks;
+    bufseq_type rendered, previous;
+    std::vector<uint32_t> encoded, delta_words;
+    render_scratch scratch;
+};
+
+// A read-only mapping of a stream file. Only the index is read when it is
+// opened; the streams are paged in as they are played.
+struct stream_file {
+    explicit stream_file(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        size = st.st_size;
+        void *addr = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                          : MAP_FAILED;
+        int err = errno;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::system_error(size ? err : EINVAL,
+                                    std::generic_category(), path);
+        }
+        base = static_cast<const uint8_t *>(addr);
+        madvise(addr, size, MADV_SEQUENTIAL);
+        try {
+            parse();
+        } catch (...) {
+            munmap(addr, size);
+            throw;
+        }
+    }
+
+    stream_file(const stream_file &) = delete;
+    stream_file &operator=(const stream_file &) = delete;
+
+    ~stream_file() { munmap(const_cast<uint8_t *>(base), size); }
+
+    const stream_file_header &header() const {
+        return *reinterpret_cast<const stream_file_header *>(base);
+    }
+    size_t n_frames() const { return header().n_frames; }
+    size_t n_schedules() const { return header().n_schedules; }
+    uint64_t duration_ns(size_t frame) const { return durations[frame]; }
+    const stream_file_block &block(size_t frame, size_t i) const {
+        return blocks[frame * n_schedules() + i];
+    }
+    std::span<const uint32_t> words(const stream_file_block &block) const {
+        return {reinterpret_cast<const uint32_t *>(base + block.offset),
+                block.size};
+    }
+
+    // The schedules recorded in the file
+    schedule_sequence schedules;
+
+  private:
+    void parse() {
+        auto corrupt = [] {
+            throw std::runtime_error("not a valid piomatter stream file");
+        };
+        const auto &h = header();
+        if (size < sizeof(h) ||
+            memcmp(h.magic, stream_file_magic, sizeof(h.magic)) != 0) {
+            corrupt();
+        }
+        if (h.version != stream_file_version) {
+            throw std::runtime_error("unsupported stream file version");
+        }
+        size_t pos = sizeof(h);
+        for (size_t i = 0; i < h.n_schedules; i++) {
+            uint32_t n_entries;
+            if (size - pos < sizeof(n_entries)) {
+                corrupt();
+            }
+            memcpy(&n_entries, base + pos, sizeof(n_entries));
+            pos += sizeof(n_entries);
+            if ((size - pos) / sizeof(schedule_entry) < n_entries) {
+                corrupt();
+            }
+            const auto *entries =
+                reinterpret_cast<const schedule_entry *>(base + pos);
+            schedules.emplace_back(entries, entries + n_entries);
+            pos += n_entries * sizeof(schedule_entry);
+        }
+        uint64_t n_blocks = h.n_frames * h.n_schedules;
+        if (h.index_offset > size || h.n_schedules == 0 ||
+            h.n_frames > (size - h.index_offset) / sizeof(uint64_t) ||
+            n_blocks / h.n_schedules != h.n_frames ||
+            (size - h.index_offset - h.n_frames * sizeof(uint64_t)) /
+                    sizeof(stream_file_block) <
+                n_blocks ||
+            h.index_offset % sizeof(uint64_t) != 0) {
+            corrupt();
+        }
+        durations = reinterpret_cast<const uint64_t *>(base + h.index_offset);
+        blocks = reinterpret_cast<const stream_file_block *>(
+            durations + h.n_frames);
+        for (uint64_t i = 0; i < n_blocks; i++) {
+            const auto &b = blocks[i];
+            if (b.offset > size || b.offset % sizeof(uint32_t) != 0 ||
+                (size - b.offset) / sizeof(uint32_t) < b.size ||
+                b.encoding > stream_file_delta ||
+                (b.encoding == stream_file_raw && b.size != b.n_words)) {
+                corrupt();
+            }
+            // A delta must apply to the same schedule's stream in the
+            // previous frame, so that playing never has to check
+            if (b.encoding == stream_file_delta &&
+                (i < h.n_schedules ||
+                 blocks[i - h.n_schedules].n_words != b.n_words ||
+                 !detail::delta_fits(b.n_words, words(b)))) {
+                corrupt();
+            }
+        }
+    }
+
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    const uint64_t *durations = nullptr;
+    const stream_file_block *blocks = nullptr;
+};
+
+// Plays the frames of a stream file, decoding deltas against the previous
+// frame as it goes
+struct stream_file_player : frame_source {
+    explicit stream_file_player(std::shared_ptr<const stream_file> file)
+        : file(file), decoded(file->n_schedules()) {}
+
+    size_t size() const override { return file->n_frames(); }
+    uint64_t duration_ns(size_t i) const override {
+        return file->duration_ns(i);
+    }
+
+    void get(size_t i, bufseq_type &streams) override {
+        // A delta needs the frame before it, so going back starts over
+        if (i < next) {
+            next = 0;
+        }
+        while (next <= i) {
+            decode(next++);
+        }
+        streams = decoded;
+    }
+
+  private:
+    void decode(size_t frame) {
+        for (size_t i = 0; i < decoded.size(); i++) {
+            const auto &block = file->block(frame, i);
+            auto words = file->words(block);
+            auto &stream = decoded[i];
+            if (block.encoding == stream_file_raw) {
+                stream.assign(words.begin(), words.end());
+            } else {
+                // parse() checked that the delta fits
+                stream.resize(block.n_words);
+                detail::apply_delta(stream, words);
+            }
+        }
+    }
+
+    std::shared_ptr<const stream_file> file;
+    bufseq_type decoded;
+    size_t next = 0;
+};
+
+} // namespace piomatter
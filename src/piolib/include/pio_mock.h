@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef _PIO_MOCK_H
+#define _PIO_MOCK_H
+
+#include "piolib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The data sent to one state machine of the mock PIO
+struct pio_mock_xfer_counts {
+    uint64_t calls;
+    uint64_t bytes;
+};
+
+struct pio_mock_xfer_counts pio_mock_get_xfer_counts(PIO pio, uint sm);
+void pio_mock_reset_xfer_counts(PIO pio, uint sm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
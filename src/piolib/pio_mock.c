@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * A PIO that doesn't need /dev/pio0, for benchmarking on any host.
+ *
+ * Transfers are counted once they complete, but the data goes nowhere. Each
+ * transfer takes as long as the state machine would need to shift out its
+ * words at two cycles per word, the rate of protomatter's data loop, at the
+ * configured clock divider, so a refresh thread feeding the mock is paced
+ * much like one feeding the real thing. Only the calls that piomatter makes
+ * are provided.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "piolib.h"
+#include "piolib_priv.h"
+#include "pio_mock.h"
+
+#define MOCK_PIO_SM_COUNT 4
+#define MOCK_PIO_INSTRUCTION_COUNT 32
+#define MOCK_PIO_CLK_SYS 200000000u
+#define MOCK_PIO_CYCLES_PER_WORD 2
+
+typedef struct mock_pio_handle {
+    struct pio_instance base;
+    uint32_t used_instrs;
+    atomic_uint claimed_sms;
+    uint buf_size[MOCK_PIO_SM_COUNT];
+    _Atomic float clkdiv[MOCK_PIO_SM_COUNT];
+    atomic_uint_fast64_t xfer_calls[MOCK_PIO_SM_COUNT];
+    atomic_uint_fast64_t xfer_bytes[MOCK_PIO_SM_COUNT];
+} *MOCK_PIO;
+
+static struct mock_pio_handle mock_pio;
+
+static bool mock_sm_valid(uint sm)
+{
+    return sm < MOCK_PIO_SM_COUNT;
+}
+
+static PIO mock_create_instance(PIO_CHIP_T *chip, uint index)
+{
+    if (index > 0)
+        return NULL;
+    mock_pio.base.chip = chip;
+    return &mock_pio.base;
+}
+
+static int mock_open_instance(PIO pio)
+{
+    return 0;
+}
+
+static void mock_close_instance(PIO pio)
+{
+}
+
+static int mock_pio_sm_config_xfer(PIO pio, uint sm, uint dir, uint buf_size, uint buf_count)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    if (!mock_sm_valid(sm) || dir != PIO_DIR_TO_SM) {
+        errno = EINVAL;
+        return -1;
+    }
+    mp->buf_size[sm] = buf_size;
+    return 0;
+}
+
+static int mock_pio_sm_xfer_data(PIO pio, uint sm, uint dir, uint data_bytes, void *data)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    struct timespec ts;
+    double seconds;
+
+    if (!mock_sm_valid(sm) || dir != PIO_DIR_TO_SM || data_bytes > mp->buf_size[sm]) {
+        errno = EINVAL;
+        return -1;
+    }
+    seconds = (double)(data_bytes / 4) * MOCK_PIO_CYCLES_PER_WORD *
+              atomic_load(&mp->clkdiv[sm]) / MOCK_PIO_CLK_SYS;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+
+    atomic_fetch_add(&mp->xfer_calls[sm], 1);
+    atomic_fetch_add(&mp->xfer_bytes[sm], data_bytes);
+    return 0;
+}
+
+static bool mock_pio_can_add_program_at_offset(PIO pio, const pio_program_t *program, uint offset)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    uint32_t mask;
+    if (program->length > MOCK_PIO_INSTRUCTION_COUNT ||
+        offset > MOCK_PIO_INSTRUCTION_COUNT - program->length)
+        return false;
+    mask = (uint32_t)((1ull << program->length) - 1) << offset;
+    return !(mp->used_instrs & mask);
+}
+
+static uint mock_pio_add_program_at_offset(PIO pio, const pio_program_t *program, uint offset)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    if (offset == PIO_ORIGIN_ANY) {
+        for (offset = 0; offset < MOCK_PIO_INSTRUCTION_COUNT; offset++) {
+            if (mock_pio_can_add_program_at_offset(pio, program, offset))
+                break;
+        }
+    }
+    if (!mock_pio_can_add_program_at_offset(pio, program, offset))
+        return PIO_ORIGIN_INVALID;
+    mp->used_instrs |= (uint32_t)((1ull << program->length) - 1) << offset;
+    return offset;
+}
+
+static bool mock_pio_remove_program(PIO pio, const pio_program_t *program, uint loaded_offset)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    mp->used_instrs &= ~((uint32_t)((1ull << program->length) - 1) << loaded_offset);
+    return true;
+}
+
+static bool mock_pio_clear_instruction_memory(PIO pio)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    mp->used_instrs = 0;
+    return true;
+}
+
+static bool mock_pio_sm_claim_mask(PIO pio, uint mask)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    uint claimed = atomic_load(&mp->claimed_sms);
+    do {
+        if (claimed & mask)
+            return false;
+    } while (!atomic_compare_exchange_weak(&mp->claimed_sms, &claimed, claimed | mask));
+    return true;
+}
+
+static bool mock_pio_sm_claim(PIO pio, uint sm)
+{
+    return mock_sm_valid(sm) && mock_pio_sm_claim_mask(pio, 1u << sm);
+}
+
+static int mock_pio_sm_claim_unused(PIO pio, bool required)
+{
+    uint sm;
+    for (sm = 0; sm < MOCK_PIO_SM_COUNT; sm++) {
+        if (mock_pio_sm_claim(pio, sm))
+            return sm;
+    }
+    if (required)
+        pio_panic("No PIO state machines are available");
+    return -1;
+}
+
+static bool mock_pio_sm_unclaim(PIO pio, uint sm)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    if (!mock_sm_valid(sm))
+        return false;
+    atomic_fetch_and(&mp->claimed_sms, ~(1u << sm));
+    return true;
+}
+
+static bool mock_pio_sm_is_claimed(PIO pio, uint sm)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    return mock_sm_valid(sm) && (atomic_load(&mp->claimed_sms) & (1u << sm));
+}
+
+static void mock_pio_sm_set_clkdiv(PIO pio, uint sm, float div)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    if (mock_sm_valid(sm))
+        atomic_store(&mp->clkdiv[sm], div);
+}
+
+// The only setting the mock uses is the clock divider, kept in content[0]
+static void mock_pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config)
+{
+    float div;
+    memcpy(&div, &config->content[0], sizeof(div));
+    mock_pio_sm_set_clkdiv(pio, sm, div);
+}
+
+static void mock_pio_sm_clear_fifos(PIO pio, uint sm)
+{
+}
+
+static void mock_pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base,
+                                                uint pin_count, bool is_out)
+{
+}
+
+static void mock_pio_sm_set_enabled(PIO pio, uint sm, bool enabled)
+{
+}
+
+static pio_sm_config mock_pio_get_default_sm_config(PIO pio)
+{
+    pio_sm_config c = { { 0 } };
+    float div = 1.0f;
+    memcpy(&c.content[0], &div, sizeof(div));
+    return c;
+}
+
+static void mock_smc_set_out_pins(PIO pio, pio_sm_config *config, uint out_base, uint out_count)
+{
+}
+
+static void mock_smc_set_sideset_pins(PIO pio, pio_sm_config *config, uint sideset_base)
+{
+}
+
+static void mock_smc_set_sideset(PIO pio, pio_sm_config *config, uint bit_count,
+                                 bool optional, bool pindirs)
+{
+}
+
+static void mock_smc_set_clkdiv(PIO pio, pio_sm_config *c, float div)
+{
+    memcpy(&c->content[0], &div, sizeof(div));
+}
+
+static void mock_smc_set_wrap(PIO pio, pio_sm_config *config, uint wrap_target, uint wrap)
+{
+}
+
+static void mock_smc_set_out_shift(PIO pio, pio_sm_config *config, bool shift_right,
+                                   bool autopull, uint pull_threshold)
+{
+}
+
+static void mock_smc_set_fifo_join(PIO pio, pio_sm_config *config, enum pio_fifo_join join)
+{
+}
+
+static uint32_t mock_clock_get_hz(PIO pio, enum clock_index clk_index)
+{
+    return clk_index == clk_sys ? MOCK_PIO_CLK_SYS : 0;
+}
+
+static void mock_pio_gpio_init(PIO pio, uint pin)
+{
+}
+
+struct pio_mock_xfer_counts pio_mock_get_xfer_counts(PIO pio, uint sm)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    struct pio_mock_xfer_counts counts = { 0, 0 };
+    if (mock_sm_valid(sm)) {
+        counts.calls = atomic_load(&mp->xfer_calls[sm]);
+        counts.bytes = atomic_load(&mp->xfer_bytes[sm]);
+    }
+    return counts;
+}
+
+void pio_mock_reset_xfer_counts(PIO pio, uint sm)
+{
+    MOCK_PIO mp = (MOCK_PIO)pio;
+    if (mock_sm_valid(sm)) {
+        atomic_store(&mp->xfer_calls[sm], 0);
+        atomic_store(&mp->xfer_bytes[sm], 0);
+    }
+}
+
+static const PIO_CHIP_T mock_pio_chip = {
+    .name = "mock",
+    .compatible = "piomatter,mock-pio",
+    .instr_count = MOCK_PIO_INSTRUCTION_COUNT,
+    .sm_count = MOCK_PIO_SM_COUNT,
+    .fifo_depth = 8,
+
+    .create_instance = mock_create_instance,
+    .open_instance = mock_open_instance,
+    .close_instance = mock_close_instance,
+
+    .pio_sm_config_xfer = mock_pio_sm_config_xfer,
+    .pio_sm_xfer_data = mock_pio_sm_xfer_data,
+
+    .pio_can_add_program_at_offset = mock_pio_can_add_program_at_offset,
+    .pio_add_program_at_offset = mock_pio_add_program_at_offset,
+    .pio_remove_program = mock_pio_remove_program,
+    .pio_clear_instruction_memory = mock_pio_clear_instruction_memory,
+
+    .pio_sm_claim = mock_pio_sm_claim,
+    .pio_sm_claim_mask = mock_pio_sm_claim_mask,
+    .pio_sm_claim_unused = mock_pio_sm_claim_unused,
+    .pio_sm_unclaim = mock_pio_sm_unclaim,
+    .pio_sm_is_claimed = mock_pio_sm_is_claimed,
+
+    .pio_sm_init = mock_pio_sm_init,
+    .pio_sm_clear_fifos = mock_pio_sm_clear_fifos,
+    .pio_sm_set_clkdiv = mock_pio_sm_set_clkdiv,
+    .pio_sm_set_consecutive_pindirs = mock_pio_sm_set_consecutive_pindirs,
+    .pio_sm_set_enabled = mock_pio_sm_set_enabled,
+
+    .pio_get_default_sm_config = mock_pio_get_default_sm_config,
+    .smc_set_out_pins = mock_smc_set_out_pins,
+    .smc_set_sideset_pins = mock_smc_set_sideset_pins,
+    .smc_set_sideset = mock_smc_set_sideset,
+    .smc_set_clkdiv = mock_smc_set_clkdiv,
+    .smc_set_wrap = mock_smc_set_wrap,
+    .smc_set_out_shift = mock_smc_set_out_shift,
+    .smc_set_fifo_join = mock_smc_set_fifo_join,
+
+    .clock_get_hz = mock_clock_get_hz,
+
+    .pio_gpio_init = mock_pio_gpio_init,
+};
+
+DECLARE_PIO_CHIP(mock_pio_chip);
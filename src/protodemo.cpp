@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -5,8 +8,13 @@
 #include <cstring>
 #include <ctime>
 #include <map>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "piomatter/ingest.h"
 #include "piomatter/piomatter.h"
 
 #define _ (0)
@@ -96,6 +104,15 @@ static uint64_t monotonicns64() {
     return tp.tv_sec * UINT64_C(1000000000) + tp.tv_nsec;
 }
 
+// Set by any check that fails, so that the exit status shows it
+static bool failed = false;
+
+// The word to report a check's result with
+static const char *check(bool ok) {
+    failed = failed || !ok;
+    return ok ? "ok" : "MISMATCH";
+}
+
 static void print_dither_schedule(const piomatter::schedule_sequence &ss) {
     for (auto s : ss) {
         for (auto i : s) {
@@ -129,6 +146,905 @@ static void test_temporal_dither_schedule(int n_planes, int pixels_across,
     printf("\n");
 }
 
+// With `lanes` nonzero, also check the render specialized for that many lanes
+template <typename pinout, size_t lanes = 0>
+static void test_render_transposed(size_t width, size_t height,
+                                   size_t n_addr_lines, size_t n_lanes,
+                                   int n_planes, int n_temporal_planes) {
+    size_t n_addr = 1u << n_addr_lines;
+    piomatter::matrix_map map;
+    for (size_t addr = 0; addr < n_addr; addr++) {
+        for (size_t x = 0; x < width; x++) {
+            for (size_t lane = 0; lane < n_lanes; lane++) {
+                map.push_back(x + width * (addr + lane * n_addr));
+            }
+        }
+    }
+    size_t pixels_across = width * height / (n_lanes << n_addr_lines);
+    piomatter::matrix_geometry geometry(pixels_across, n_addr_lines, n_planes,
+                                        n_temporal_planes, width, height, map,
+                                        n_lanes);
+
+    std::vector<uint32_t> rgb888(width * height);
+    uint32_t seed = 1;
+    for (auto &px : rgb888) {
+        seed = seed * 1103515245 + 12345;
+        px = seed >> 8;
+    }
+    std::vector<uint16_t> rgb565(rgb888.begin(), rgb888.end());
+    std::vector<uint8_t> packed;
+    for (auto px : rgb888) {
+        packed.insert(packed.end(), {uint8_t(px >> 16), uint8_t(px >> 8),
+                                     uint8_t(px)});
+    }
+
+    piomatter::colorspace_rgb888 cs888;
+    piomatter::colorspace_rgb565 cs565;
+    piomatter::colorspace_rgb888_packed cs_packed;
+    piomatter::colorspace_rgb10 cs10;
+    auto rgb10 = cs888.convert(rgb888);
+
+    piomatter::schedule_sequence &schedules = geometry.schedules;
+    std::vector<std::vector<uint32_t>> expected(schedules.size());
+    std::vector<std::vector<uint32_t>> actual(schedules.size());
+    piomatter::render_scratch scratch;
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    auto old_active_time = schedules.back().back().active_time;
+    bool ok = true;
+    for (size_t i = 0; i < schedules.size(); i++) {
+        piomatter::protomatter_render_rgb10<pinout>(
+            expected[i], geometry, schedules[i], old_active_time, rgb10.data());
+        piomatter::protomatter_render_rgb10_transposed<pinout>(
+            actual[i], geometry, schedules[i], old_active_time, rgb10.data(),
+            scratch);
+        ok = ok && expected[i] == actual[i];
+        old_active_time = schedules[i].back().active_time;
+    }
+
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton, cs888,
+                                          rgb888, scratch);
+    ok = ok && expected == actual;
+    if constexpr (lanes != 0) {
+        actual.clear();
+        piomatter::protomatter_render<pinout, piomatter::colorspace_rgb888,
+                                      lanes>(actual, geometry, skeleton, cs888,
+                                             rgb888, scratch);
+        ok = ok && expected == actual;
+    }
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton,
+                                          cs_packed, packed, scratch);
+    ok = ok && expected == actual;
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton, cs10,
+                                          rgb10, scratch);
+    ok = ok && expected == actual;
+
+    rgb10 = cs565.convert(rgb565);
+    for (size_t i = 0; i < schedules.size(); i++) {
+        piomatter::protomatter_render_rgb10<pinout>(
+            expected[i], geometry, schedules[i],
+            schedules[(i + schedules.size() - 1) % schedules.size()]
+                .back()
+                .active_time,
+            rgb10.data());
+    }
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton, cs565,
+                                          rgb565, scratch);
+    ok = ok && expected == actual;
+
+    // changing one pixel re-renders exactly one row, matching a full render
+    std::vector<uint64_t> row_hashes;
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton, cs888,
+                                          rgb888, scratch, &row_hashes);
+    rgb888[width * height / 2] ^= 0x10101;
+    size_t n_rendered = piomatter::protomatter_render<pinout>(
+        actual, geometry, skeleton, cs888, rgb888, scratch, &row_hashes);
+    piomatter::protomatter_render<pinout>(expected, geometry, skeleton, cs888,
+                                          rgb888, scratch);
+    ok = ok && n_rendered == 1 && expected == actual;
+
+    printf("render %zux%zu addr=%zu lanes=%zu planes=%d temporal=%d: %s\n",
+           width, height, n_addr_lines, n_lanes, n_planes, n_temporal_planes,
+           check(ok));
+}
+
+// Check that walking each row of a geometry's map visits the same entries as
+// its explicit indices, and whether it was described by runs
+static void test_map_runs(const char *name,
+                          const piomatter::matrix_geometry &geometry,
+                          bool expect_runs) {
+    bool ok = geometry.runs.empty() != expect_runs;
+    size_t n = geometry.n_lanes * geometry.pixels_across;
+    for (size_t addr = 0; addr < (1u << geometry.n_addr_lines); addr++) {
+        std::vector<int> visited(n, -1);
+        geometry.row(addr).for_each(
+            [&](size_t i, int index) { visited[i] = index; });
+        ok = ok && std::equal(visited.begin(), visited.end(),
+                              &geometry.map[n * addr]);
+    }
+    printf("map runs %s: %zu runs for %zu pixels: %s\n", name,
+           geometry.runs.size(), geometry.map.size(), check(ok));
+}
+
+// Check that rendering through a window of a larger image gives the same
+// streams as rendering a copy of the window
+template <typename pinout>
+static void test_window(const piomatter::matrix_geometry &geometry, size_t x,
+                        size_t y, size_t stride, size_t image_height) {
+    std::vector<uint32_t> image(stride * image_height);
+    uint32_t seed = 1;
+    for (auto &px : image) {
+        seed = seed * 1103515245 + 12345;
+        px = seed >> 8;
+    }
+    std::vector<uint32_t> crop;
+    for (size_t row = 0; row < geometry.height; row++) {
+        auto start = image.begin() + (y + row) * stride + x;
+        crop.insert(crop.end(), start, start + geometry.width);
+    }
+    auto window = piomatter::window_geometry(geometry, x, y, stride);
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    piomatter::colorspace_rgb888 converter;
+    piomatter::render_scratch scratch;
+    std::vector<std::vector<uint32_t>> expected, actual;
+    piomatter::protomatter_render<pinout>(expected, geometry, skeleton,
+                                          converter, crop, scratch);
+    piomatter::protomatter_render<pinout>(actual, window, skeleton, converter,
+                                          image, scratch);
+    bool ok = expected == actual &&
+              piomatter::window_extent(geometry, x, y, stride) <= image.size();
+    printf("window %zux%zu at (%zu, %zu) of %zux%zu: %s\n", geometry.width,
+           geometry.height, x, y, stride, image_height, check(ok));
+}
+
+// The channels of a pixel with `bits` bits per channel
+template <unsigned bits>
+static std::array<uint32_t, 3> channels(uint32_t px) {
+    constexpr uint32_t mask = (1u << bits) - 1;
+    return {(px >> (2 * bits)) & mask, (px >> bits) & mask, px & mask};
+}
+
+// Scale a rectangle of an image channel by channel, for comparison with
+// source_scaler
+template <unsigned bits>
+static std::vector<uint32_t>
+reference_scale(const std::vector<uint32_t> &image,
+                const piomatter::source_scale &scale, size_t out_width,
+                size_t out_height) {
+    std::vector<uint32_t> result;
+    for (size_t oy = 0; oy < out_height; oy++) {
+        for (size_t ox = 0; ox < out_width; ox++) {
+            std::array<uint32_t, 3> c{};
+            if (scale.filter == piomatter::scale_filter::box) {
+                size_t x0 = ox * scale.width / out_width;
+                size_t x1 = std::max((ox + 1) * scale.width / out_width,
+                                     x0 + 1);
+                size_t y0 = oy * scale.height / out_height;
+                size_t y1 = std::max((oy + 1) * scale.height / out_height,
+                                     y0 + 1);
+                std::array<uint64_t, 3> sum{};
+                for (size_t y = y0; y < y1; y++) {
+                    for (size_t x = x0; x < x1; x++) {
+                        auto px = channels<bits>(
+                            image[(scale.y + y) * scale.stride + scale.x + x]);
+                        for (int j = 0; j < 3; j++) {
+                            sum[j] += px[j];
+                        }
+                    }
+                }
+                size_t n = (x1 - x0) * (y1 - y0);
+                for (int j = 0; j < 3; j++) {
+                    c[j] = (sum[j] + n / 2) / n;
+                }
+            } else {
+                auto at = [&](double pos, size_t size) {
+                    return std::clamp(pos, 0., double(size - 1));
+                };
+                double sx = at((ox + 0.5) * scale.width / out_width - 0.5,
+                               scale.width);
+                double sy = at((oy + 0.5) * scale.height / out_height - 0.5,
+                               scale.height);
+                size_t x0 = sx, y0 = sy;
+                size_t x1 = std::min(x0 + 1, scale.width - 1);
+                size_t y1 = std::min(y0 + 1, scale.height - 1);
+                auto px = [&](size_t x, size_t y) {
+                    return channels<bits>(
+                        image[(scale.y + y) * scale.stride + scale.x + x]);
+                };
+                auto p00 = px(x0, y0), p10 = px(x1, y0), p01 = px(x0, y1),
+                     p11 = px(x1, y1);
+                double fx = sx - x0, fy = sy - y0;
+                for (int j = 0; j < 3; j++) {
+                    double top = p00[j] * (1 - fx) + p10[j] * fx;
+                    double bottom = p01[j] * (1 - fx) + p11[j] * fx;
+                    c[j] = lround(top * (1 - fy) + bottom * fy);
+                }
+            }
+            result.push_back((c[0] << (2 * bits)) | (c[1] << bits) | c[2]);
+        }
+    }
+    return result;
+}
+
+// Check scaling a rectangle of a larger image onto a geometry against a
+// channel-by-channel reference. Box filtering must match exactly, both as
+// gathered and as rendered; bilinear filtering samples at 1/256ths of a
+// pixel, so may be off by one
+template <typename pinout, unsigned bits>
+static void test_scale(const piomatter::matrix_geometry &geometry,
+                       const piomatter::source_scale &scale,
+                       size_t image_height) {
+    std::vector<uint32_t> image(scale.stride * image_height);
+    uint32_t seed = 1;
+    for (auto &px : image) {
+        seed = seed * 1103515245 + 12345;
+        px = (seed >> 8) & ((1u << (3 * bits)) - 1);
+    }
+    auto expected =
+        reference_scale<bits>(image, scale, geometry.width, geometry.height);
+    piomatter::source_scaler scaler(scale, geometry.width, geometry.height);
+    const uint32_t tolerance =
+        scale.filter == piomatter::scale_filter::box ? 0 : 1;
+
+    bool ok = scaler.extent() <= image.size();
+    std::vector<uint32_t> row(geometry.n_lanes * geometry.pixels_across);
+    for (size_t addr = 0; addr < (1u << geometry.n_addr_lines); addr++) {
+        auto map = geometry.row(addr);
+        scaler.gather<bits>(row.data(), image.data(), map,
+                            [](const uint32_t *source, size_t i) {
+                                return source[i];
+                            });
+        map.for_each([&](size_t i, int index) {
+            auto a = channels<bits>(row[i]);
+            auto e = channels<bits>(expected[index]);
+            for (int j = 0; j < 3; j++) {
+                ok = ok && uint32_t(std::abs(int(a[j]) - int(e[j]))) <=
+                               tolerance;
+            }
+        });
+    }
+
+    if constexpr (bits == 8) {
+        if (!tolerance) {
+            auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+            piomatter::colorspace_rgb888 converter;
+            piomatter::render_scratch scratch;
+            std::vector<std::vector<uint32_t>> want, actual;
+            piomatter::protomatter_render<pinout>(want, geometry, skeleton,
+                                                  converter, expected, scratch);
+            converter.scale = std::make_shared<piomatter::source_scaler>(
+                scale, geometry.width, geometry.height);
+            piomatter::protomatter_render<pinout>(actual, geometry, skeleton,
+                                                  converter, image, scratch);
+            ok = ok && want == actual;
+        }
+    }
+    printf("scale %zux%zu at (%zu, %zu) to %zux%zu, %s, %u bits: %s\n",
+           scale.width, scale.height, scale.x, scale.y, geometry.width,
+           geometry.height,
+           scale.filter == piomatter::scale_filter::box ? "box" : "bilinear",
+           bits, check(ok));
+}
+
+// The words a stream puts on the pins, in order: each pixel clocked out, and
+// each word held by a delay
+static std::vector<uint32_t> stream_words(const std::vector<uint32_t> &stream,
+                                          bool compact) {
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < stream.size();) {
+        uint32_t header = stream[i++];
+        if (!(header & piomatter::command_data)) {
+            result.push_back(stream[i++]);
+        } else if (compact && (header & piomatter::compact_command_data) ==
+                                  piomatter::compact_command_repeat) {
+            size_t n = (header & ~piomatter::compact_command_data) + 1;
+            result.insert(result.end(), n, stream[i++]);
+        } else {
+            size_t n = (header & ~(compact ? piomatter::compact_command_data
+                                           : piomatter::command_data)) +
+                       1;
+            result.insert(result.end(), &stream[i], &stream[i + n]);
+            i += n;
+        }
+    }
+    return result;
+}
+
+// What the panel sees while a state machine plays a stream: the cycles it
+// takes, each word clocked in, and each run of cycles that a word is lit for
+struct pio_trace {
+    uint64_t cycles = 0;
+    std::vector<uint32_t> clocked;
+    std::vector<std::pair<uint32_t, uint64_t>> lit_runs;
+};
+
+// Run the assembled program, one instruction per cycle, as piomatter
+// configures it: shifting left with autopull at 32 bits, out pins 0-27 and
+// an optional side-set on the clock pin. Only the instructions in
+// protomatter.pio and protomatter_compact.pio are decoded.
+template <typename pinout>
+static pio_trace simulate_pio(const uint16_t *program, int wrap_target,
+                              int wrap, const std::vector<uint32_t> &stream) {
+    pio_trace trace;
+    uint32_t pins = pinout::oe_inactive, osr = 0, x = 0, y = 0;
+    int osr_bits = 0;
+    size_t next = 0;
+    int pc = wrap_target;
+    for (;;) {
+        uint16_t insn = program[pc];
+        int opcode = insn >> 13;
+        assert(((insn >> 8) & 7) == 0); // no delays
+        if (opcode == 3 && osr_bits == 0) {
+            if (next == stream.size()) {
+                // Stalled waiting for the next stream
+                assert(pc == wrap_target);
+                break;
+            }
+            osr = stream[next++];
+            osr_bits = 32;
+        }
+        uint32_t before = pins;
+        int next_pc = pc == wrap ? wrap_target : pc + 1;
+        if (opcode == 0) {
+            bool taken;
+            switch ((insn >> 5) & 7) {
+            case 0:
+                taken = true;
+                break;
+            case 1:
+                taken = x == 0;
+                break;
+            case 4:
+                taken = y-- != 0;
+                break;
+            default:
+                abort();
+            }
+            if (taken) {
+                next_pc = insn & 0x1f;
+            }
+        } else if (opcode == 3) {
+            int count = insn & 0x1f ? insn & 0x1f : 32;
+            uint32_t value = count == 32 ? osr : osr >> (32 - count);
+            osr = count == 32 ? 0 : osr << count;
+            osr_bits -= count;
+            switch ((insn >> 5) & 7) {
+            case 0:
+                pins = value & ((1u << 28) - 1);
+                break;
+            case 1:
+                x = value;
+                break;
+            case 2:
+                y = value;
+                break;
+            default:
+                abort();
+            }
+        } else if ((insn & ~0x1f00) != 0xa042) { // nop, mov y, y
+            abort();
+        }
+        if (insn & 0x1000) {
+            pins = (pins & ~pinout::clk_bit) |
+                   ((insn >> 11) & 1 ? pinout::clk_bit : 0);
+        }
+        if (!(before & pinout::clk_bit) && (pins & pinout::clk_bit)) {
+            trace.clocked.push_back(pins & ~pinout::clk_bit);
+        }
+        uint32_t word = pins & ~pinout::clk_bit;
+        bool held = (before & ~pinout::clk_bit) == word;
+        if ((word & pinout::oe_bit) == pinout::oe_active) {
+            if (!trace.lit_runs.empty() && held) {
+                trace.lit_runs.back().second++;
+            } else {
+                trace.lit_runs.emplace_back(word, 1);
+            }
+        }
+        trace.cycles++;
+        pc = next_pc;
+    }
+    return trace;
+}
+
+template <typename pinout>
+static void test_compact_stream(size_t n_addr_lines, int n_planes,
+                                int n_temporal_planes) {
+    piomatter::matrix_geometry geometry(width * height >> (n_addr_lines + 1),
+                                        n_addr_lines, n_planes,
+                                        n_temporal_planes, width, height, true,
+                                        piomatter::orientation_normal);
+    std::vector<std::vector<uint32_t>> streams;
+    piomatter::render_scratch scratch;
+    piomatter::protomatter_render<pinout>(
+        streams, geometry, piomatter::make_stream_skeleton<pinout>(geometry),
+        piomatter::colorspace_rgb888{},
+        std::span<const uint32_t>(&pixels[0][0], width * height), scratch);
+    bool ok = true;
+    size_t n_words = 0, n_compact_words = 0;
+    uint64_t cycles = 0, compact_cycles = 0, lit_cycles = 0;
+    std::vector<uint32_t> refresh, compact_refresh;
+    for (const auto &stream : streams) {
+        std::vector<uint32_t> compact;
+        piomatter::compact_stream<pinout>(compact, stream);
+        ok = ok && stream_words(stream, false) == stream_words(compact, true);
+        n_words += stream.size();
+        n_compact_words += compact.size();
+        cycles += piomatter::stream_cycles(stream);
+        compact_cycles += piomatter::compact_stream_cycles(compact);
+        lit_cycles += piomatter::stream_lit_cycles<pinout>(stream);
+        refresh.insert(refresh.end(), stream.begin(), stream.end());
+        compact_refresh.insert(compact_refresh.end(), compact.begin(),
+                               compact.end());
+    }
+    printf("compact addr=%zu planes=%d temporal=%d: %s, %zu -> %zu words "
+           "(%.2fx)\n",
+           n_addr_lines, n_planes, n_temporal_planes, check(ok),
+           n_words, n_compact_words, double(n_words) / n_compact_words);
+    // Play a whole refresh through both programs: the cycle counts must be
+    // the ones that pacing and calibration use, and the panel must see the
+    // same pixels lit for the same cycles
+    auto trace = simulate_pio<pinout>(protomatter, protomatter_wrap_target,
+                                      protomatter_wrap, refresh);
+    auto compact_trace = simulate_pio<pinout>(
+        protomatter_compact, protomatter_compact_wrap_target,
+        protomatter_compact_wrap, compact_refresh);
+    uint64_t traced_lit_cycles = 0;
+    for (const auto &run : trace.lit_runs) {
+        traced_lit_cycles += run.second;
+    }
+    ok = trace.cycles == cycles && compact_trace.cycles == compact_cycles &&
+         traced_lit_cycles == lit_cycles &&
+         trace.clocked == compact_trace.clocked &&
+         trace.lit_runs == compact_trace.lit_runs;
+    printf("    simulated: %s, %llu -> %llu cycles, %llu lit\n", check(ok),
+           (unsigned long long)trace.cycles,
+           (unsigned long long)compact_trace.cycles,
+           (unsigned long long)traced_lit_cycles);
+    // The refresh rate that the state machine plays at, and the transfer
+    // rate that it takes to keep it fed. Playing time, and with it the
+    // refresh rate, is set by the pixels clocked out, so the compact format
+    // only helps where transfers can't keep up.
+    double sm_clock =
+        piomatter::default_pixel_clock * piomatter::CLOCKS_PER_DATA;
+    double hz = sm_clock / cycles, compact_hz = sm_clock / compact_cycles;
+    printf("    at %.1fMHz: %.1fHz needing %.1fMB/s, compact %.1fHz needing "
+           "%.1fMB/s\n",
+           piomatter::default_pixel_clock / 1e6, hz,
+           hz * n_words * sizeof(uint32_t) / 1e6, compact_hz,
+           compact_hz * n_compact_words * sizeof(uint32_t) / 1e6);
+}
+
+// Check that a rendered stream matches its skeleton whatever its pixels, and
+// that changing a timing, address or /OE bit stops it matching
+template <typename pinout> static void test_matches_skeleton() {
+    piomatter::matrix_geometry geometry(128, 4, 10, 0, 64, 64, true,
+                                        piomatter::orientation_normal);
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    std::vector<std::vector<uint32_t>> streams;
+    piomatter::render_scratch scratch;
+    test_pattern(5);
+    piomatter::protomatter_render<pinout>(
+        streams, geometry, skeleton, piomatter::colorspace_rgb888{},
+        std::span<const uint32_t>(&pixels[0][0], width * height), scratch);
+    const auto &expected = skeleton.streams[0];
+    auto matches = [&](const std::vector<uint32_t> &stream) {
+        return piomatter::matches_skeleton<pinout>(stream, expected);
+    };
+    bool ok = true;
+    for (size_t i = 0; i < streams.size(); i++) {
+        ok = ok && piomatter::matches_skeleton<pinout>(streams[i],
+                                                       skeleton.streams[i]);
+    }
+    // The first word is a command; find a delay, and a data word after it
+    size_t delay = 0;
+    while (expected[delay] & piomatter::command_data) {
+        delay += (expected[delay] & ~piomatter::command_data) + 2;
+    }
+    auto changed = [&](size_t i, uint32_t bits) {
+        auto stream = streams[0];
+        stream[i] ^= bits;
+        return stream;
+    };
+    uint32_t rgb_bits = 0;
+    for (auto pin : pinout::PIN_RGB) {
+        rgb_bits |= 1u << pin;
+    }
+    ok = ok && matches(changed(1, rgb_bits)) &&
+         !matches(changed(0, 1)) && !matches(changed(delay, 1u << 30)) &&
+         !matches(changed(delay, 1u << pinout::PIN_RGB[0])) &&
+         !matches(changed(1, pinout::oe_bit)) &&
+         !matches(changed(delay + 1, 1u << pinout::PIN_ADDR[0])) &&
+         !matches(std::vector<uint32_t>(streams[0].begin(),
+                                        streams[0].end() - 1));
+    printf("matches skeleton: %s\n", check(ok));
+}
+
+// Check that frames written to a stream file play back as the streams they
+// were rendered to, with the test pattern scrolling so that most frames are
+// stored as deltas
+template <typename pinout>
+static void test_stream_file(bool compact, bool delta) {
+    piomatter::matrix_geometry geometry(128, 4, 10, 0, 64, 64, true,
+                                        piomatter::orientation_normal);
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    piomatter::colorspace_rgb888 converter;
+    piomatter::render_scratch scratch;
+    char path[] = "/tmp/protodemo-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        failed = true;
+        return;
+    }
+    close(fd);
+
+    constexpr size_t n_frames = 8;
+    std::vector<std::vector<std::vector<uint32_t>>> expected(n_frames);
+    std::span<const uint32_t> frame(&pixels[0][0], width * height);
+    {
+        piomatter::stream_file_writer<pinout> writer(path, geometry, compact,
+                                                     delta);
+        for (size_t i = 0; i < n_frames; i++) {
+            test_pattern(i / 2);
+            writer.add_frame(converter, frame, 1000 * i);
+            auto &streams = expected[i];
+            piomatter::protomatter_render<pinout>(streams, geometry, skeleton,
+                                                  converter, frame, scratch);
+            if (compact) {
+                for (auto &stream : streams) {
+                    std::vector<uint32_t> out;
+                    piomatter::compact_stream<pinout>(out, stream);
+                    stream = std::move(out);
+                }
+            }
+        }
+        writer.close();
+    }
+
+    auto file = std::make_shared<const piomatter::stream_file>(path);
+    piomatter::stream_file_player player(file);
+    bool ok = player.size() == n_frames &&
+              file->header().format_id ==
+                  piomatter::stream_format_id<pinout>(skeleton, compact);
+    size_t n_delta = 0;
+    std::vector<std::vector<uint32_t>> actual;
+    // Play it through twice, as a looping sequence would
+    for (size_t i = 0; ok && i < 2 * n_frames; i++) {
+        size_t j = i % n_frames;
+        player.get(j, actual);
+        ok = actual == expected[j] && player.duration_ns(j) == 1000 * j;
+        for (size_t k = 0; i < n_frames && k < file->n_schedules(); k++) {
+            n_delta +=
+                file->block(j, k).encoding == piomatter::stream_file_delta;
+        }
+    }
+    // A delta that runs past its stream must be refused when opening, as
+    // playing can't report it
+    for (size_t i = 0; ok && i < n_frames * file->n_schedules(); i++) {
+        const auto &block =
+            file->block(i / file->n_schedules(), i % file->n_schedules());
+        if (block.encoding != piomatter::stream_file_delta || !block.size) {
+            continue;
+        }
+        uint32_t keep = block.n_words + 1;
+        int fd = open(path, O_WRONLY);
+        ok = fd >= 0 && pwrite(fd, &keep, sizeof(keep), block.offset) ==
+                            ssize_t(sizeof(keep));
+        close(fd);
+        try {
+            piomatter::stream_file corrupt(path);
+            ok = false;
+        } catch (const std::runtime_error &) {
+        }
+        break;
+    }
+    unlink(path);
+    printf("stream file compact=%d delta=%d: %s, %zu of %zu blocks delta\n",
+           compact, delta, check(ok), n_delta,
+           n_frames * file->n_schedules());
+}
+
+// Check that dimming a rendered frame by swapping its skeleton's bits for a
+// dimmed skeleton's gives the frame rendered dimmed, at the same refresh
+// rate, and that its lit time follows the brightness to within 10%
+template <typename pinout>
+static void test_brightness(int n_planes, int n_temporal_planes,
+                            double brightness) {
+    piomatter::matrix_geometry geometry(128, 4, n_planes, n_temporal_planes, 64,
+                                        64, true,
+                                        piomatter::orientation_normal);
+    auto full = piomatter::make_stream_skeleton<pinout>(geometry);
+    auto dimmed = piomatter::make_stream_skeleton<pinout>(
+        geometry, piomatter::dim_schedule(geometry.schedules, brightness));
+    piomatter::colorspace_rgb888 converter;
+    piomatter::render_scratch scratch;
+    std::span<const uint32_t> frame(&pixels[0][0], width * height);
+    test_pattern(3);
+    std::vector<std::vector<uint32_t>> expected, actual;
+    piomatter::protomatter_render<pinout>(expected, geometry, dimmed,
+                                          converter, frame, scratch);
+    piomatter::protomatter_render<pinout>(actual, geometry, full, converter,
+                                          frame, scratch);
+    // The fraction of the time that the panel is lit
+    auto duty = [](const piomatter::stream_skeleton &skeleton) {
+        uint64_t lit = 0, cycles = 0;
+        for (const auto &stream : skeleton.streams) {
+            lit += piomatter::stream_lit_cycles<pinout>(stream);
+            cycles += piomatter::stream_cycles(stream);
+        }
+        return double(lit) / cycles;
+    };
+    // Dimming must not change the refresh rate
+    bool ok = true;
+    for (size_t i = 0; i < actual.size(); i++) {
+        for (size_t j = 0; j < actual[i].size(); j++) {
+            actual[i][j] ^= full.streams[i][j] ^ dimmed.streams[i][j];
+        }
+        ok = ok && piomatter::stream_cycles(full.streams[i]) ==
+                       piomatter::stream_cycles(dimmed.streams[i]);
+    }
+    double ratio = duty(dimmed) / duty(full);
+    ok = ok && actual == expected &&
+         std::abs(ratio - brightness) <= brightness / 10;
+    printf("brightness %.2f planes=%d temporal=%d: %s, duty %.3f of full\n",
+           brightness, n_planes, n_temporal_planes, check(ok),
+           ratio);
+}
+
+// Check converting through LUTs chosen by region of the matrix map, here
+// columns of the framebuffer that cut across runs of the map, against
+// converting each pixel with its region's LUT
+template <typename colorspace>
+static void test_luts(const char *name) {
+    piomatter::matrix_geometry geometry(128, 4, 10, 0, 64, 64, true,
+                                        piomatter::orientation_normal);
+    std::vector<typename colorspace::data_type> image(
+        colorspace::data_size_in_bytes(geometry.width * geometry.height) /
+        sizeof(typename colorspace::data_type));
+    uint32_t seed = 1;
+    for (auto &px : image) {
+        seed = seed * 1103515245 + 12345;
+        px = seed >> 8;
+    }
+    auto regions = std::make_shared<piomatter::lut_regions>();
+    regions->luts = {piomatter::gamma_lut(2.2, {1., .8, .6}),
+                     piomatter::gamma_lut(1.8),
+                     piomatter::gamma_lut(2.6, {.5, 1., .9})};
+    for (int index : geometry.map) {
+        regions->regions.push_back((index % geometry.width) / 24);
+    }
+    colorspace converter;
+    converter.regions = regions;
+    piomatter::render_scratch scratch;
+    std::vector<uint32_t> row(geometry.n_lanes * geometry.pixels_across);
+    bool ok = true;
+    for (size_t addr = 0; addr < (1u << geometry.n_addr_lines); addr++) {
+        auto map = geometry.row(addr);
+        converter.gather_rgb10(row.data(), image, map, scratch);
+        map.for_each([&](size_t i, int index) {
+            const auto &lut =
+                regions->luts[regions->regions[addr * map.n + i]];
+            auto px = channels<8>(colorspace::rgb888_at(image.data(), index));
+            uint32_t expected = (lut.convert(0, px[0]) << 20) |
+                                (lut.convert(1, px[1]) << 10) |
+                                lut.convert(2, px[2]);
+            ok = ok && row[i] == expected;
+        });
+    }
+    printf("luts by region, %s: %s\n", name, check(ok));
+}
+
+// Check that 16-bit channels render as their top 10 bits would as rgb10
+template <typename pinout>
+static void test_rgb16(const piomatter::matrix_geometry &geometry) {
+    size_t n_pixels = geometry.width * geometry.height;
+    std::vector<uint16_t> image(3 * n_pixels);
+    std::vector<uint32_t> image10;
+    uint32_t seed = 1;
+    for (auto &channel : image) {
+        seed = seed * 1103515245 + 12345;
+        channel = seed >> 12;
+    }
+    for (size_t i = 0; i < n_pixels; i++) {
+        image10.push_back(uint32_t(image[3 * i] >> 6) << 20 |
+                          uint32_t(image[3 * i + 1] >> 6) << 10 |
+                          image[3 * i + 2] >> 6);
+    }
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    piomatter::colorspace_rgb16 converter16;
+    piomatter::colorspace_rgb10 converter10;
+    piomatter::render_scratch scratch;
+    std::vector<std::vector<uint32_t>> expected, actual;
+    piomatter::protomatter_render<pinout>(expected, geometry, skeleton,
+                                          converter10, image10, scratch);
+    piomatter::protomatter_render<pinout>(actual, geometry, skeleton,
+                                          converter16, image, scratch);
+    auto converted = converter16.convert(image);
+    bool ok = expected == actual &&
+              std::equal(converted.begin(), converted.end(), image10.begin(),
+                         image10.end());
+    printf("rgb16 as rgb10: %s\n", check(ok));
+}
+
+// Check that geometries of the same shape share one skeleton, which matches
+// a skeleton made for either, and that a different shape gets its own
+template <typename pinout> static void test_shared_skeleton() {
+    piomatter::matrix_geometry a(128, 4, 10, 2, 64, 64, true,
+                                 piomatter::orientation_normal);
+    piomatter::matrix_geometry b(128, 4, 10, 2, 64, 64, true,
+                                 piomatter::orientation_r180);
+    piomatter::matrix_geometry c(128, 4, 10, 0, 64, 64, true,
+                                 piomatter::orientation_normal);
+    auto sa = piomatter::shared_stream_skeleton<pinout>(a);
+    auto sb = piomatter::shared_stream_skeleton<pinout>(b);
+    auto sc = piomatter::shared_stream_skeleton<pinout>(c);
+    auto expected = piomatter::make_stream_skeleton<pinout>(b);
+    bool ok = sa == sb && sa != sc && sb->streams == expected.streams &&
+              sc->streams == piomatter::make_stream_skeleton<pinout>(c).streams;
+    printf("shared skeleton: %s\n", check(ok));
+}
+
+// A packet holding fragment `index` of `frame`, split into fragments of
+// fragment_size bytes, with `payload_size` bytes of it if given
+static std::vector<uint8_t>
+ingest_packet(uint32_t sequence, const std::vector<uint8_t> &frame,
+              uint16_t index, uint32_t fragment_size,
+              size_t payload_size = SIZE_MAX) {
+    piomatter::ingest_packet_header h{};
+    h.magic = piomatter::ingest_magic;
+    h.version = piomatter::ingest_version;
+    h.kind = piomatter::ingest_pixels;
+    h.fragment_count = (frame.size() + fragment_size - 1) / fragment_size;
+    h.sequence = sequence;
+    h.fragment_index = index;
+    h.frame_size = frame.size();
+    h.fragment_size = fragment_size;
+    size_t offset = std::min<size_t>(size_t(index) * fragment_size,
+                                     frame.size());
+    payload_size = std::min(
+        payload_size, std::min<size_t>(fragment_size, frame.size() - offset));
+    std::vector<uint8_t> result(sizeof(h) + payload_size);
+    memcpy(result.data(), &h, sizeof(h));
+    memcpy(result.data() + sizeof(h), frame.data() + offset, payload_size);
+    return result;
+}
+
+// Check reassembling frames from fragments that arrive out of order, twice,
+// late or malformed, and across sequence number wraps and sender restarts
+static void test_frame_assembler() {
+    using assembler = piomatter::frame_assembler;
+    std::vector<uint8_t> framebuffer(1000), frame(1000);
+    for (size_t i = 0; i < frame.size(); i++) {
+        frame[i] = i * 7 + 3;
+    }
+    assembler a(framebuffer, 4096);
+    auto add = [&](const std::vector<uint8_t> &packet) {
+        return a.add(packet);
+    };
+
+    // Four fragments of 300, 300, 300 and 100 bytes, in any order, with a
+    // duplicate
+    bool ok = add(ingest_packet(5, frame, 3, 300)) == assembler::pending &&
+              add(ingest_packet(5, frame, 1, 300)) == assembler::pending &&
+              add(ingest_packet(5, frame, 1, 300)) == assembler::pending &&
+              add(ingest_packet(5, frame, 0, 300)) == assembler::pending &&
+              add(ingest_packet(5, frame, 2, 300)) ==
+                  assembler::pixels_ready &&
+              framebuffer == frame && a.stats.packets_duplicate == 1 &&
+              a.stats.frames_received == 1;
+    printf("ingest out of order and duplicate fragments: %s\n", check(ok));
+
+    // Fragments of a shown frame, or of one before it, are too late
+    ok = add(ingest_packet(5, frame, 0, 300)) == assembler::rejected &&
+         add(ingest_packet(4, frame, 0, 300)) == assembler::rejected &&
+         a.stats.packets_late == 2 && a.stats.packets_invalid == 0;
+    printf("ingest late fragments: %s\n", check(ok));
+
+    // A short last fragment, an index past the count, a frame that isn't
+    // the framebuffer's size, and a truncated header
+    std::vector<uint8_t> wrong_size(frame.begin(), frame.end() - 4);
+    auto past_end = ingest_packet(6, frame, 0, 300);
+    uint16_t index = 4;
+    memcpy(past_end.data() + offsetof(piomatter::ingest_packet_header,
+                                      fragment_index),
+           &index, sizeof(index));
+    ok = add(ingest_packet(6, frame, 3, 300, 99)) == assembler::rejected &&
+         add(past_end) == assembler::rejected &&
+         add(ingest_packet(6, wrong_size, 0, 300)) == assembler::rejected &&
+         add(std::vector<uint8_t>(10)) == assembler::rejected &&
+         a.stats.packets_invalid == 4;
+    // None of which stops the frame that they claimed to be part of
+    for (uint16_t i = 0; ok && i < 4; i++) {
+        ok = add(ingest_packet(6, frame, i, 300)) ==
+             (i == 3 ? assembler::pixels_ready : assembler::pending);
+    }
+    printf("ingest malformed fragments: %s\n", check(ok));
+
+    // An unfinished frame is dropped by the next, as are frames skipped
+    uint64_t dropped = a.stats.frames_dropped;
+    ok = add(ingest_packet(7, frame, 0, 300)) == assembler::pending &&
+         add(ingest_packet(9, frame, 0, 300)) == assembler::pending &&
+         a.stats.frames_dropped == dropped + 2;
+    // Sequence numbers wrap without dropping anything
+    assembler wrap(framebuffer, 4096);
+    for (uint32_t sequence : {0xfffffffeu, 0xffffffffu, 0u, 1u}) {
+        for (uint16_t i = 0; ok && i < 4; i++) {
+            ok = wrap.add(ingest_packet(sequence, frame, i, 300)) ==
+                 (i == 3 ? assembler::pixels_ready : assembler::pending);
+        }
+    }
+    ok = ok && wrap.stats.frames_dropped == 0 &&
+         wrap.stats.frames_received == 4;
+    // A jump back past the resync distance is a restarted sender, whose
+    // frames are shown, while a smaller one is late
+    ok = ok &&
+         wrap.add(ingest_packet(2 - piomatter::ingest_resync_frames, frame, 0,
+                                300)) == assembler::rejected &&
+         wrap.stats.packets_late == 1 &&
+         wrap.add(ingest_packet(1 - piomatter::ingest_resync_frames, frame, 0,
+                                300)) == assembler::pending &&
+         wrap.stats.frames_dropped == 0;
+    printf("ingest sequence wrap and resync: %s\n", check(ok));
+}
+
+// Check splitting a streams frame, and parsing the WebSocket framing and
+// handshake that frames can arrive over
+static void test_websocket() {
+    auto split = [](std::vector<uint32_t> words, size_t n_schedules) {
+        std::vector<std::span<const uint32_t>> streams;
+        bool ok = piomatter::split_streams(
+            {reinterpret_cast<const uint8_t *>(words.data()),
+             words.size() * sizeof(uint32_t)},
+            n_schedules, streams);
+        return ok ? streams.size() : SIZE_MAX;
+    };
+    bool ok = split({2, 1, 10, 11, 12}, 2) == 2 &&
+              // sizes that overrun the words, leave some over, or overflow
+              split({2, 2, 10, 11, 12}, 2) == SIZE_MAX &&
+              split({1, 1, 10, 11, 12}, 2) == SIZE_MAX &&
+              split({0xffffffff, 1, 10}, 2) == SIZE_MAX &&
+              split({1}, 2) == SIZE_MAX;
+    printf("split streams: %s\n", check(ok));
+
+    piomatter::websocket_frame frame;
+    auto parse = [&](std::vector<uint8_t> data) {
+        return piomatter::parse_websocket_frame(data, frame);
+    };
+    ok = parse({0x82, 0x05}) && frame.fin && !frame.masked &&
+         frame.opcode == piomatter::websocket_binary &&
+         frame.payload_size == 5 && frame.header_size == 2;
+    ok = ok && parse({0x02, 0xfe, 0x01, 0x02, 1, 2, 3, 4}) && !frame.fin &&
+         frame.masked && frame.payload_size == 0x102 &&
+         frame.mask == std::array<uint8_t, 4>{1, 2, 3, 4} &&
+         frame.header_size == 8;
+    ok = ok && parse({0x82, 0x7f, 0, 0, 0, 1, 0, 0, 0, 2}) &&
+         frame.payload_size == 0x100000002 && frame.header_size == 10;
+    // Headers that haven't all arrived
+    ok = ok && !parse({0x82}) && !parse({0x82, 0x7e, 0x01}) &&
+         !parse({0x82, 0xff, 0, 0, 0, 0, 0, 0, 1, 0, 1, 2, 3});
+    // Headers written by the server parse back to their sizes
+    for (size_t size : {125, 126, 65535, 65536, 70000}) {
+        ok = ok && parse(piomatter::websocket_frame_header(
+                       piomatter::websocket_binary, size)) &&
+             frame.payload_size == size;
+    }
+    printf("websocket frames: %s\n", check(ok));
+
+    // The example from RFC 6455 section 1.3
+    auto response = piomatter::websocket_handshake(
+        "GET /chat HTTP/1.1\r\n"
+        "Host: server.example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n");
+    ok = response &&
+         response->find("\r\nSec-WebSocket-Accept: "
+                        "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") !=
+             std::string::npos &&
+         !piomatter::websocket_handshake("GET / HTTP/1.1\r\n\r\n");
+    printf("websocket handshake: %s\n", check(ok));
+}
+
 int main(int argc, char **argv) {
     int n = argc > 1 ? atoi(argv[1]) : 0;
 
@@ -138,6 +1054,84 @@ int main(int argc, char **argv) {
     test_temporal_dither_schedule(7, 1, 4);
     test_temporal_dither_schedule(7, 1, 5);
 
+    test_render_transposed<piomatter::adafruit_matrix_bonnet_pinout, 2>(
+        64, 32, 4, 2, 10, 0);
+    test_render_transposed<piomatter::adafruit_matrix_bonnet_pinout_bgr>(
+        128, 64, 5, 2, 7, 3);
+    test_render_transposed<piomatter::active3_pinout, 4>(64, 128, 5, 4, 10, 2);
+    test_render_transposed<piomatter::active3_pinout_bgr, 6>(64, 96, 4, 6, 5,
+                                                             4);
+
+    test_map_runs("normal", {128, 4, 10, 0, 64, 64, false,
+                             piomatter::orientation_normal},
+                  true);
+    test_map_runs("serpentine r180", {256, 4, 10, 0, 64, 128, true,
+                                      piomatter::orientation_r180},
+                  true);
+    test_map_runs("serpentine cw", {128, 4, 10, 0, 64, 64, true,
+                                    piomatter::orientation_cw},
+                  true);
+    {
+        piomatter::matrix_map shuffled(64 * 32);
+        for (size_t i = 0; i < shuffled.size(); i++) {
+            shuffled[i] = (i * 1237) % shuffled.size();
+        }
+        test_map_runs("shuffled", {64, 4, 10, 0, 64, 32, shuffled, 2}, false);
+    }
+
+    test_window<piomatter::adafruit_matrix_bonnet_pinout>(
+        {128, 4, 10, 2, 64, 64, true, piomatter::orientation_normal}, 100, 30,
+        200, 120);
+    test_window<piomatter::adafruit_matrix_bonnet_pinout>(
+        {128, 4, 10, 0, 64, 64, true, piomatter::orientation_r180}, 136, 56,
+        200, 120);
+
+    {
+        using bonnet = piomatter::adafruit_matrix_bonnet_pinout;
+        piomatter::matrix_geometry geometry(128, 4, 10, 0, 64, 64, true,
+                                            piomatter::orientation_normal);
+        using filter = piomatter::scale_filter;
+        test_scale<bonnet, 8>(geometry, {10, 20, 1920, 1080, 1940, filter::box},
+                              1100);
+        test_scale<bonnet, 8>(geometry, {3, 5, 100, 70, 120, filter::box}, 80);
+        test_scale<bonnet, 10>(geometry, {3, 5, 200, 150, 210, filter::box},
+                               160);
+        test_scale<bonnet, 8>(geometry, {0, 0, 40, 48, 40, filter::box}, 48);
+        test_scale<bonnet, 8>(geometry, {7, 9, 150, 100, 160, filter::bilinear},
+                              110);
+        test_scale<bonnet, 10>(geometry, {0, 0, 50, 40, 50, filter::bilinear},
+                               40);
+    }
+
+    test_compact_stream<piomatter::adafruit_matrix_bonnet_pinout>(4, 10, 0);
+    test_compact_stream<piomatter::active3_pinout>(5, 10, 4);
+
+    test_matches_skeleton<piomatter::adafruit_matrix_bonnet_pinout>();
+    test_matches_skeleton<piomatter::active3_pinout>();
+
+    test_stream_file<piomatter::adafruit_matrix_bonnet_pinout>(false, true);
+    test_stream_file<piomatter::adafruit_matrix_bonnet_pinout>(true, true);
+    test_stream_file<piomatter::adafruit_matrix_bonnet_pinout>(false, false);
+
+    test_brightness<piomatter::adafruit_matrix_bonnet_pinout>(10, 0, 0.5);
+    test_brightness<piomatter::adafruit_matrix_bonnet_pinout>(10, 4, 0.1);
+    test_brightness<piomatter::active3_pinout>(8, 0, 0.25);
+
+    test_luts<piomatter::colorspace_rgb888>("rgb888");
+    test_luts<piomatter::colorspace_rgb888_packed>("rgb888 packed");
+    test_luts<piomatter::colorspace_rgb565>("rgb565");
+
+    test_rgb16<piomatter::adafruit_matrix_bonnet_pinout>(
+        {128, 4, 10, 0, 64, 64, true, piomatter::orientation_normal});
+
+    test_shared_skeleton<piomatter::adafruit_matrix_bonnet_pinout>();
+
+    test_frame_assembler();
+    test_websocket();
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
     return 0;
     test_simple_dither_schedule(6, 1);
     test_temporal_dither_schedule(6, 1, 0);
@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <iostream>
+#include <optional>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <string>
+#include <tuple>
 
+#include "piomatter/mapped_framebuffer.h"
 #include "piomatter/piomatter.h"
 
 #define STRINGIFY(x) #x
@@ -11,36 +17,362 @@
 namespace py = pybind11;
 
 namespace {
+// Raise OSError for an errno value; otherwise, return whether the frame was
+// shown rather than skipped
+bool check_show_result(int err) {
+    if (err == piomatter::piomatter_base::frame_skipped) {
+        return false;
+    }
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        throw py::error_already_set();
+    }
+    return true;
+}
+
+// Raise OSError for a failed system call on the file `name`
+[[noreturn]] void raise_os_error(const std::system_error &e,
+                                 const std::string &name) {
+    errno = e.code().value();
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, name.c_str());
+    throw py::error_already_set();
+}
+
+// Whether dimensions [first, ndim) of a buffer are laid out contiguously in C
+// order
+bool is_c_contiguous(const py::buffer_info &info, size_t first = 0) {
+    py::ssize_t expected = info.itemsize;
+    for (size_t d = info.ndim; d-- > first;) {
+        if (info.shape[d] != 1 && info.strides[d] != expected) {
+            return false;
+        }
+        expected *= info.shape[d];
+    }
+    return true;
+}
+
+// Elements that aren't valid ints become -1, for the caller to reject
+template <typename T>
+void copy_map(piomatter::matrix_map &map, const void *data) {
+    const T *source = static_cast<const T *>(data);
+    std::transform(source, source + map.size(), map.begin(), [](T v) {
+        return std::in_range<int>(v) ? int(v) : -1;
+    });
+}
+
+// Copy a buffer of integers, such as a numpy array, into a matrix map in one
+// pass, without making a Python int of each element
+piomatter::matrix_map map_from_buffer(py::buffer buffer) {
+    const py::buffer_info info = buffer.request();
+    if (!is_c_contiguous(info)) {
+        throw std::runtime_error("A map buffer must be contiguous");
+    }
+    // Native or little-endian integers only
+    std::string format = info.format;
+    format.erase(0, format.find_first_not_of("@=<"));
+    piomatter::matrix_map map(info.size);
+    bool is_signed = format.size() == 1 &&
+                     std::string("bhilq").find(format[0]) != std::string::npos;
+    bool is_unsigned =
+        format.size() == 1 &&
+        std::string("BHILQ").find(format[0]) != std::string::npos;
+    switch (is_signed || is_unsigned ? info.itemsize : 0) {
+    case 1:
+        is_signed ? copy_map<int8_t>(map, info.ptr)
+                  : copy_map<uint8_t>(map, info.ptr);
+        return map;
+    case 2:
+        is_signed ? copy_map<int16_t>(map, info.ptr)
+                  : copy_map<uint16_t>(map, info.ptr);
+        return map;
+    case 4:
+        is_signed ? copy_map<int32_t>(map, info.ptr)
+                  : copy_map<uint32_t>(map, info.ptr);
+        return map;
+    case 8:
+        is_signed ? copy_map<int64_t>(map, info.ptr)
+                  : copy_map<uint64_t>(map, info.ptr);
+        return map;
+    }
+    throw std::runtime_error(py::str("A map buffer must hold integers, not "
+                                     "elements of format {!r}")
+                                 .attr("format")(info.format)
+                                 .cast<std::string>());
+}
+
+piomatter::matrix_geometry
+make_mapped_geometry(size_t width, size_t height, size_t n_addr_lines,
+                     piomatter::matrix_map map, size_t n_planes,
+                     size_t n_temporal_planes, size_t n_lanes) {
+    size_t n_lines = n_lanes << n_addr_lines;
+    size_t pixels_across = width * height / n_lines;
+    for (auto el : map) {
+        if ((size_t)el >= width * height) {
+            throw std::out_of_range("Map element out of range");
+        }
+    }
+    return piomatter::matrix_geometry(pixels_across, n_addr_lines, n_planes,
+                                      n_temporal_planes, width, height,
+                                      std::move(map), n_lanes);
+}
+
+py::dict histogram_dict(const piomatter::log2_histogram &h) {
+    py::list buckets;
+    for (const auto &b : h.buckets) {
+        buckets.append(b.load());
+    }
+    py::dict result;
+    result["count"] = h.count.load();
+    result["total_ns"] = h.total_ns.load();
+    result["buckets"] = buckets;
+    return result;
+}
+
+struct PyShowFuture {
+    std::shared_future<int> future;
+
+    bool done() const {
+        return future.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+    }
+
+    bool result(std::optional<double> timeout) const {
+        bool ready = true;
+        {
+            py::gil_scoped_release release;
+            if (timeout) {
+                ready = future.wait_for(std::chrono::duration<double>(
+                            *timeout)) == std::future_status::ready;
+            } else {
+                future.wait();
+            }
+        }
+        if (!ready) {
+            PyErr_SetString(PyExc_TimeoutError,
+                            "show_async() did not complete in time");
+            throw py::error_already_set();
+        }
+        return check_show_result(future.get());
+    }
+};
+
+// A geometry shared by the Python object and each piomatter made from it
+using shared_geometry = std::shared_ptr<const piomatter::matrix_geometry>;
+
 struct PyPiomatter {
     PyPiomatter(py::buffer buffer,
                 std::unique_ptr<piomatter::piomatter_base> &&matter)
         : buffer{buffer}, matter{std::move(matter)} {}
+    PyPiomatter(std::shared_ptr<piomatter::mapped_framebuffer> source,
+                std::unique_ptr<piomatter::piomatter_base> &&matter)
+        : source{source}, matter{std::move(matter)} {}
     py::buffer buffer;
+    std::shared_ptr<piomatter::mapped_framebuffer> source;
     std::unique_ptr<piomatter::piomatter_base> matter;
+    std::shared_future<int> last_async;
+    // Declared after matter, so that it stops before matter is destroyed
+    std::unique_ptr<piomatter::framebuffer_mirror> mirror;
 
-    void show() {
-        int err = matter->show();
-        if (err != 0) {
-            errno = err;
-            PyErr_SetFromErrno(PyExc_OSError);
-            throw py::error_already_set();
+    bool show(uint64_t present_at_ns) {
+        int err;
+        {
+            py::gil_scoped_release release;
+            err = source ? source->begin_read() : 0;
+            if (err == 0) {
+                err = matter->show_at(present_at_ns);
+                if (source) {
+                    source->end_read();
+                }
+            }
+        }
+        return check_show_result(err);
+    }
+    void start_mirroring(bool vsync, double max_fps) {
+        if (!source) {
+            throw std::runtime_error(
+                "Mirroring needs a PioMatter made from a MappedFramebuffer");
+        }
+        {
+            py::gil_scoped_release release;
+            mirror.reset();
+        }
+        mirror = std::make_unique<piomatter::framebuffer_mirror>(
+            *matter, *source, vsync, max_fps);
+    }
+    void stop_mirroring() {
+        int err = 0;
+        {
+            py::gil_scoped_release release;
+            if (mirror) {
+                err = mirror->error;
+                mirror.reset();
+            }
+        }
+        check_show_result(err);
+    }
+    bool mirroring() const { return mirror && !mirror->error; }
+    void load_sequence(py::sequence frames, py::object durations, bool loop) {
+        // The buffer views keep the frames' memory alive while they render
+        std::vector<py::buffer_info> views;
+        std::vector<std::span<const uint8_t>> spans;
+        std::vector<uint64_t> durations_ns;
+        for (auto frame : frames) {
+            views.push_back(frame.cast<py::buffer>().request());
+            const auto &info = views.back();
+            if (!is_c_contiguous(info)) {
+                throw std::invalid_argument(
+                    "sequence frames must be contiguous");
+            }
+            spans.emplace_back(static_cast<const uint8_t *>(info.ptr),
+                               info.size * info.itemsize);
+        }
+        auto add_duration = [&](double seconds) {
+            if (!(seconds >= 0)) {
+                throw std::invalid_argument(
+                    "frame durations must not be negative");
+            }
+            durations_ns.push_back(uint64_t(seconds * 1e9));
+        };
+        if (py::isinstance<py::float_>(durations) ||
+            py::isinstance<py::int_>(durations)) {
+            double seconds = durations.cast<double>();
+            for (size_t i = 0; i < spans.size(); i++) {
+                add_duration(seconds);
+            }
+        } else {
+            for (auto d : durations) {
+                add_duration(d.cast<double>());
+            }
+        }
+        py::gil_scoped_release release;
+        matter->load_sequence(spans, durations_ns, loop);
+    }
+    void stop_sequence() {
+        py::gil_scoped_release release;
+        matter->stop_sequence();
+    }
+    void play_file(const std::string &path, bool loop) {
+        std::shared_ptr<const piomatter::stream_file> file;
+        try {
+            file = std::make_shared<piomatter::stream_file>(path);
+        } catch (const std::system_error &e) {
+            raise_os_error(e, path);
+        }
+        py::gil_scoped_release release;
+        matter->play_file(file, loop);
+    }
+    bool playing() const { return matter->sequence_playing(); }
+    PyShowFuture show_async(uint64_t present_at_ns) {
+        // show_async_at first waits for the previous frame to be rendered;
+        // do that without the GIL
+        if (last_async.valid()) {
+            py::gil_scoped_release release;
+            last_async.wait();
+        }
+        // Then keep the GIL while the framebuffer is copied, so that Python
+        // threads writing to it can't tear the snapshot. The snapshot is
+        // taken before show_async_at returns, so the read only has to cover
+        // the call.
+        int err = source ? source->begin_read() : 0;
+        if (err) {
+            std::promise<int> failed;
+            failed.set_value(err);
+            return PyShowFuture{failed.get_future().share()};
         }
+        last_async = matter->show_async_at(present_at_ns);
+        if (source) {
+            source->end_read();
+        }
+        return PyShowFuture{last_async};
     }
     double fps() const { return matter->fps; }
-};
+    double pixel_clock() const { return matter->pixel_clock; }
+    py::dict stats() const {
+        const auto &s = matter->stats;
+        py::dict result;
+        result["wait_free"] = histogram_dict(s.wait_free);
+        result["render"] = histogram_dict(s.render);
+        result["encode"] = histogram_dict(s.encode);
+        result["xfer"] = histogram_dict(s.xfer);
+        result["frames_shown"] = s.frames_shown.load();
+        result["frames_skipped"] = s.frames_skipped.load();
+        result["frames_dropped"] = s.frames_dropped.load();
+        result["present_error"] = histogram_dict(s.present_error);
+        result["present_latency"] = histogram_dict(s.present_latency);
+        result["presents_late"] = s.presents_late.load();
+        result["schedules_sent"] = s.schedules_sent.load();
+        result["refreshes"] = s.refreshes.load();
+        result["repeated_refreshes"] = s.repeated_refreshes.load();
+        result["xfer_ioctls"] = s.xfer_ioctls.load();
+        uint64_t n_errors = s.n_errors.load(std::memory_order_acquire);
+        const uint64_t ring_size = piomatter::piomatter_stats::error_ring_size;
+        py::list errors;
+        for (uint64_t i = n_errors > ring_size ? n_errors - ring_size : 0;
+             i < n_errors; i++) {
+            errors.append(s.error_errnos[i % ring_size].load());
+        }
+        result["n_errors"] = n_errors;
+        result["recent_errors"] = errors;
+        return result;
+    }
+    void reset_stats() { matter->stats.reset(); }
+    bool incremental() const { return matter->incremental; }
+    void set_incremental(bool value) { matter->incremental = value; }
+    double brightness() const { return matter->brightness(); }
+    void set_brightness(double value) {
+        auto duty = matter->plane_duty();
+        py::gil_scoped_release release;
+        matter->set_brightness(value, duty);
+    }
+    std::vector<double> plane_duty() const { return matter->plane_duty(); }
+    void set_plane_duty(const std::vector<double> &duty) {
+        py::gil_scoped_release release;
+        matter->set_brightness(matter->brightness(), duty);
+    }
+    void set_luts(const std::vector<piomatter::channel_tables> &tables,
+                  std::optional<py::buffer> regions) {
+        std::vector<piomatter::gamma_lut> luts(tables.begin(), tables.end());
+        std::vector<uint8_t> entry_regions;
+        if (regions) {
+            const py::buffer_info info = regions->request();
+            if (info.itemsize != 1 || !is_c_contiguous(info) ||
+                size_t(info.size) != geometry->width * geometry->height) {
+                throw std::runtime_error(
+                    py::str("regions must be a contiguous array of {} bytes, "
+                            "one per framebuffer pixel")
+                        .attr("format")(geometry->width * geometry->height)
+                        .cast<std::string>());
+            }
+            auto *data = static_cast<const uint8_t *>(info.ptr);
+            entry_regions.reserve(geometry->map.size());
+            for (int index : geometry->map) {
+                entry_regions.push_back(data[index]);
+            }
+        }
+        py::gil_scoped_release release;
+        matter->set_luts(luts, entry_regions);
+    }
 
-template <typename pinout, typename colorspace>
-std::unique_ptr<PyPiomatter>
-make_piomatter_pc(py::buffer buffer,
-                  const piomatter::matrix_geometry &geometry) {
-    using cls = piomatter::piomatter<pinout, colorspace>;
-    using data_type = colorspace::data_type;
+    // The geometry as it was given, before it was moved to a window, for
+    // taking regions in framebuffer coordinates
+    shared_geometry geometry;
+};
 
-    const auto n_pixels = geometry.width * geometry.height;
-    const auto data_size_in_bytes = colorspace::data_size_in_bytes(n_pixels);
-    const py::buffer_info info = buffer.request();
-    const size_t buffer_size_in_bytes = info.size * info.itemsize;
+// The 10-bit values of a gamma_lut, for Python to inspect or adjust
+piomatter::channel_tables gamma_tables(double gamma,
+                                       const std::array<double, 3> &white) {
+    const piomatter::gamma_lut lut(gamma, white);
+    piomatter::channel_tables result;
+    for (size_t c = 0; c < result.size(); c++) {
+        std::copy(std::begin(lut.lut[c]), std::end(lut.lut[c]),
+                  result[c].begin());
+    }
+    return result;
+}
 
+template <typename pinout>
+void check_lane_count(const piomatter::matrix_geometry &geometry) {
     if (geometry.n_lanes * 3 > std::size(pinout::PIN_RGB)) {
         throw std::runtime_error(
             py::str("Geometry lane count {} exceeds the pinout with {} rgb "
@@ -49,23 +381,238 @@ make_piomatter_pc(py::buffer buffer,
                                 std::size(pinout::PIN_RGB) / 3)
                 .template cast<std::string>());
     }
-    if (buffer_size_in_bytes != data_size_in_bytes) {
+}
+
+// Use the render kernels specialized for the geometry's lane count, for the
+// lane counts of 1, 2 or 3 HUB75 connectors that the pinout can drive
+template <typename pinout, typename colorspace>
+std::unique_ptr<piomatter::piomatter_base>
+make_piomatter_l(std::span<typename colorspace::data_type const> framebuffer,
+                 const shared_geometry &geometry,
+                 const piomatter::piomatter_options &options) {
+    constexpr size_t max_lanes = std::size(pinout::PIN_RGB) / 3;
+    switch (geometry->n_lanes) {
+    case 2:
+        if constexpr (max_lanes >= 2) {
+            return std::make_unique<
+                piomatter::piomatter<pinout, colorspace, 2>>(
+                framebuffer, geometry, options);
+        }
+        break;
+    case 4:
+        if constexpr (max_lanes >= 4) {
+            return std::make_unique<
+                piomatter::piomatter<pinout, colorspace, 4>>(
+                framebuffer, geometry, options);
+        }
+        break;
+    case 6:
+        if constexpr (max_lanes >= 6) {
+            return std::make_unique<
+                piomatter::piomatter<pinout, colorspace, 6>>(
+                framebuffer, geometry, options);
+        }
+        break;
+    }
+    return std::make_unique<piomatter::piomatter<pinout, colorspace>>(
+        framebuffer, geometry, options);
+}
+
+// The options for scaling a rectangle of an image of `n_rows` rows of
+// `row_pixels` pixels, `stride` pixels apart. The rectangle's position is
+// its own, so a window offset is an error.
+piomatter::piomatter_options
+scaled_options(const piomatter::piomatter_options &options, size_t x, size_t y,
+               size_t row_pixels, size_t n_rows, size_t stride) {
+    auto result = options;
+    auto &scale = *result.scale;
+    if (x || y) {
+        throw std::runtime_error("x_offset and y_offset can't be used with "
+                                 "scale_from, which gives its own position");
+    }
+    if (scale.x + scale.width > row_pixels ||
+        scale.y + scale.height > n_rows) {
+        throw std::runtime_error(
+            py::str("A {}x{} scale_from rectangle at ({}, {}) does not fit "
+                    "in the framebuffer of {} rows of {} pixels")
+                .attr("format")(scale.width, scale.height, scale.x, scale.y,
+                                n_rows, row_pixels)
+                .cast<std::string>());
+    }
+    scale.stride = stride;
+    return result;
+}
+
+// A window of a Python buffer, with its top left corner at (x, y). With a
+// nonzero stride, the buffer is a flat image whose rows are that many pixels
+// apart; otherwise its rows are its first dimension, at its own stride.
+struct buffer_window {
+    py::buffer buffer;
+    size_t x, y, stride;
+};
+
+template <typename pinout, typename colorspace>
+std::unique_ptr<PyPiomatter>
+make_piomatter_pc(const buffer_window &source,
+                  const shared_geometry &geometry,
+                  const piomatter::piomatter_options &options) {
+    using data_type = colorspace::data_type;
+
+    const auto n_pixels = geometry->width * geometry->height;
+    const auto data_size_in_bytes = colorspace::data_size_in_bytes(n_pixels);
+    constexpr size_t bytes_per_pixel = colorspace::data_size_in_bytes(1);
+    const py::buffer_info info = source.buffer.request();
+    const size_t buffer_size_in_bytes = info.size * info.itemsize;
+    const bool contiguous = is_c_contiguous(info);
+
+    check_lane_count<pinout>(*geometry);
+    auto *data = reinterpret_cast<data_type *>(info.ptr);
+    if (contiguous && !source.x && !source.y && !source.stride &&
+        !options.scale) {
+        if (buffer_size_in_bytes != data_size_in_bytes) {
+            throw std::runtime_error(
+                py::str("Framebuffer size must be {} bytes ({} elements of {} "
+                        "bytes each), got a buffer of {} bytes")
+                    .attr("format")(data_size_in_bytes, n_pixels,
+                                    bytes_per_pixel, buffer_size_in_bytes)
+                    .template cast<std::string>());
+        }
+        std::span<data_type> framebuffer(
+            data, data_size_in_bytes / sizeof(data_type));
+        return std::make_unique<PyPiomatter>(
+            source.buffer, make_piomatter_l<pinout, colorspace>(
+                               framebuffer, geometry, options));
+    }
+
+    // The image the window is in, as rows of pixels `stride` pixels apart
+    size_t stride, n_rows, row_pixels, image_pixels;
+    if (source.stride) {
+        if (!contiguous) {
+            throw std::runtime_error(
+                "A framebuffer with an explicit stride must be contiguous");
+        }
+        stride = row_pixels = source.stride;
+        image_pixels = buffer_size_in_bytes / bytes_per_pixel;
+        n_rows = (image_pixels + stride - 1) / stride;
+    } else {
+        // Rows may be any distance apart, but each must be contiguous
+        size_t row_bytes = buffer_size_in_bytes;
+        if (info.ndim >= 1 && info.shape[0]) {
+            row_bytes /= info.shape[0];
+        }
+        if (info.ndim < 2 || !is_c_contiguous(info, 1) ||
+            info.strides[0] <= 0 ||
+            size_t(info.strides[0]) % bytes_per_pixel ||
+            row_bytes % bytes_per_pixel) {
+            throw std::runtime_error(
+                py::str("A framebuffer window needs a buffer with 2 or more "
+                        "dimensions whose rows are contiguous and a whole "
+                        "number of {}-byte pixels apart, or an explicit "
+                        "stride")
+                    .attr("format")(bytes_per_pixel)
+                    .template cast<std::string>());
+        }
+        stride = info.strides[0] / bytes_per_pixel;
+        n_rows = info.shape[0];
+        row_pixels = row_bytes / bytes_per_pixel;
+        image_pixels = n_rows ? (n_rows - 1) * stride + row_pixels : 0;
+    }
+    std::span<data_type> image(
+        data, colorspace::data_size_in_bytes(image_pixels) / sizeof(data_type));
+    if (options.scale) {
+        return std::make_unique<PyPiomatter>(
+            source.buffer,
+            make_piomatter_l<pinout, colorspace>(
+                image, geometry,
+                scaled_options(options, source.x, source.y, row_pixels,
+                               n_rows, stride)));
+    }
+    if (source.x + geometry->width > row_pixels ||
+        source.y + geometry->height > n_rows ||
+        piomatter::window_extent(*geometry, source.x, source.y, stride) >
+            image_pixels) {
         throw std::runtime_error(
-            py::str("Framebuffer size must be {} bytes ({} elements of {} "
-                    "bytes each), got a buffer of {} bytes")
-                .attr("format")(data_size_in_bytes, n_pixels,
-                                colorspace::data_size_in_bytes(1),
-                                buffer_size_in_bytes)
+            py::str("A {}x{} window at ({}, {}) does not fit in the "
+                    "framebuffer of {} rows of {} pixels, {} pixels apart")
+                .attr("format")(geometry->width, geometry->height, source.x,
+                                source.y, n_rows, row_pixels, stride)
                 .template cast<std::string>());
     }
 
-    std::span<data_type> framebuffer(reinterpret_cast<data_type *>(info.ptr),
-                                     data_size_in_bytes / sizeof(data_type));
+    auto window = std::make_shared<const piomatter::matrix_geometry>(
+        piomatter::window_geometry(*geometry, source.x, source.y, stride));
     return std::make_unique<PyPiomatter>(
-        buffer, std::move(std::make_unique<cls>(framebuffer, geometry)));
+        source.buffer,
+        make_piomatter_l<pinout, colorspace>(image, window, options));
+}
+
+// A window of a mapped framebuffer, with its top left corner at (x, y)
+struct mapped_window {
+    std::shared_ptr<piomatter::mapped_framebuffer> framebuffer;
+    size_t x, y;
+};
+
+template <typename pinout, typename colorspace>
+std::unique_ptr<PyPiomatter>
+make_piomatter_pc(const mapped_window &source,
+                  const shared_geometry &geometry,
+                  const piomatter::piomatter_options &options) {
+    using data_type = colorspace::data_type;
+
+    const auto &fb = *source.framebuffer;
+    constexpr size_t bytes_per_pixel = colorspace::data_size_in_bytes(1);
+
+    check_lane_count<pinout>(*geometry);
+    if (fb.bits_per_pixel != 8 * bytes_per_pixel ||
+        fb.stride % bytes_per_pixel != 0) {
+        throw std::runtime_error(
+            py::str("Colorspace needs {} bits per pixel, but the mapped "
+                    "framebuffer has {} bits per pixel and a stride of {} "
+                    "bytes")
+                .attr("format")(8 * bytes_per_pixel, fb.bits_per_pixel,
+                                fb.stride)
+                .template cast<std::string>());
+    }
+    if (!options.scale && (source.x + geometry->width > fb.width ||
+                           source.y + geometry->height > fb.height)) {
+        throw std::runtime_error(
+            py::str("A {}x{} window at ({}, {}) does not fit in the {}x{} "
+                    "mapped framebuffer")
+                .attr("format")(geometry->width, geometry->height, source.x,
+                                source.y, fb.width, fb.height)
+                .template cast<std::string>());
+    }
+
+    // A scaled rectangle is sampled through the geometry's own map
+    const size_t stride = fb.stride / bytes_per_pixel;
+    auto window =
+        options.scale
+            ? geometry
+            : std::make_shared<const piomatter::matrix_geometry>(
+                  piomatter::window_geometry(*geometry, source.x, source.y,
+                                             stride));
+    auto window_options =
+        options.scale ? scaled_options(options, source.x, source.y, fb.width,
+                                       fb.height, stride)
+                      : options;
+    // The constructor shows the first frame, unless that is deferred
+    const bool first_show = !options.defer_show;
+    if (first_show) {
+        int err = fb.begin_read();
+        if (err != 0) {
+            check_show_result(err);
+        }
+    }
+    auto matter = make_piomatter_l<pinout, colorspace>(
+        fb.pixels<data_type>(), window, window_options);
+    if (first_show) {
+        fb.end_read();
+    }
+    return std::make_unique<PyPiomatter>(source.framebuffer,
+                                         std::move(matter));
 }
 
-enum Colorspace { RGB565, RGB888, RGB888Packed };
+enum Colorspace { RGB565, RGB888, RGB888Packed, RGB10, RGB16 };
 
 enum Pinout {
     AdafruitMatrixBonnet,
@@ -74,41 +621,291 @@ enum Pinout {
     Active3BGR,
 };
 
-template <class pinout>
+template <class pinout, class source_type>
 std::unique_ptr<PyPiomatter>
-make_piomatter_p(Colorspace c, py::buffer buffer,
-                 const piomatter::matrix_geometry &geometry) {
+make_piomatter_p(Colorspace c, const source_type &source,
+                 const shared_geometry &geometry,
+                 const piomatter::piomatter_options &options) {
     switch (c) {
     case RGB565:
         return make_piomatter_pc<pinout, piomatter::colorspace_rgb565>(
-            buffer, geometry);
+            source, geometry, options);
     case RGB888:
         return make_piomatter_pc<pinout, piomatter::colorspace_rgb888>(
-            buffer, geometry);
+            source, geometry, options);
     case RGB888Packed:
         return make_piomatter_pc<pinout, piomatter::colorspace_rgb888_packed>(
-            buffer, geometry);
+            source, geometry, options);
+    case RGB10:
+        return make_piomatter_pc<pinout, piomatter::colorspace_rgb10>(
+            source, geometry, options);
+    case RGB16:
+        return make_piomatter_pc<pinout, piomatter::colorspace_rgb16>(
+            source, geometry, options);
     }
     throw std::runtime_error(py::str("Invalid colorspace {!r}")
                                  .attr("format")(c)
                                  .template cast<std::string>());
 }
 
+template <class source_type>
 std::unique_ptr<PyPiomatter>
-make_piomatter(Colorspace c, Pinout p, py::buffer buffer,
-               const piomatter::matrix_geometry &geometry) {
+make_piomatter_s(Colorspace c, Pinout p, const source_type &source,
+                 const shared_geometry &geometry,
+                 const piomatter::piomatter_options &options) {
     switch (p) {
     case AdafruitMatrixBonnet:
         return make_piomatter_p<piomatter::adafruit_matrix_bonnet_pinout>(
-            c, buffer, geometry);
+            c, source, geometry, options);
     case AdafruitMatrixBonnetBGR:
         return make_piomatter_p<piomatter::adafruit_matrix_bonnet_pinout_bgr>(
-            c, buffer, geometry);
+            c, source, geometry, options);
     case Active3:
-        return make_piomatter_p<piomatter::active3_pinout>(c, buffer, geometry);
+        return make_piomatter_p<piomatter::active3_pinout>(c, source, geometry,
+                                                           options);
     case Active3BGR:
-        return make_piomatter_p<piomatter::active3_pinout_bgr>(c, buffer,
-                                                               geometry);
+        return make_piomatter_p<piomatter::active3_pinout_bgr>(
+            c, source, geometry, options);
+    }
+    throw std::runtime_error(py::str("Invalid pinout {!r}")
+                                 .attr("format")(p)
+                                 .template cast<std::string>());
+}
+
+// A rectangle of the framebuffer as (x, y, width, height)
+using scale_rect = std::tuple<size_t, size_t, size_t, size_t>;
+
+piomatter::piomatter_options
+make_options(size_t render_threads, size_t n_buffers,
+             piomatter::submit_policy policy, bool compact,
+             double pixel_clock, bool calibrate,
+             piomatter::present_mode present,
+             const std::optional<scale_rect> &scale_from,
+             piomatter::scale_filter filter, bool defer_show,
+             double max_pixel_clock) {
+    piomatter::piomatter_options options;
+    if (scale_from) {
+        piomatter::source_scale scale;
+        std::tie(scale.x, scale.y, scale.width, scale.height) = *scale_from;
+        scale.filter = filter;
+        options.scale = scale;
+    }
+    options.render_threads = render_threads;
+    options.n_buffers = n_buffers;
+    options.policy = policy;
+    options.present = present;
+    options.compact = compact;
+    options.pixel_clock = pixel_clock;
+    options.calibrate = calibrate;
+    options.max_pixel_clock = max_pixel_clock;
+    options.defer_show = defer_show;
+    return options;
+}
+
+std::unique_ptr<PyPiomatter>
+make_piomatter(Colorspace c, Pinout p, py::buffer buffer,
+               std::shared_ptr<piomatter::matrix_geometry> geometry,
+               size_t render_threads, size_t n_buffers,
+               piomatter::submit_policy policy, bool compact,
+               double pixel_clock, bool calibrate, size_t x_offset,
+               size_t y_offset, size_t stride,
+               piomatter::present_mode present,
+               const std::optional<scale_rect> &scale_from,
+               piomatter::scale_filter filter, bool defer_show,
+               double max_pixel_clock) {
+    auto result = make_piomatter_s(
+        c, p, buffer_window{buffer, x_offset, y_offset, stride}, geometry,
+        make_options(render_threads, n_buffers, policy, compact, pixel_clock,
+                     calibrate, present, scale_from, filter, defer_show,
+                     max_pixel_clock));
+    result->geometry = geometry;
+    return result;
+}
+
+std::unique_ptr<PyPiomatter> make_piomatter_mapped(
+    Colorspace c, Pinout p,
+    std::shared_ptr<piomatter::mapped_framebuffer> framebuffer,
+    std::shared_ptr<piomatter::matrix_geometry> geometry,
+    size_t render_threads, size_t n_buffers, piomatter::submit_policy policy,
+    bool compact, double pixel_clock, bool calibrate, size_t x_offset,
+    size_t y_offset, piomatter::present_mode present,
+    const std::optional<scale_rect> &scale_from,
+    piomatter::scale_filter filter, bool defer_show, double max_pixel_clock) {
+    auto result = make_piomatter_s(
+        c, p, mapped_window{framebuffer, x_offset, y_offset}, geometry,
+        make_options(render_threads, n_buffers, policy, compact, pixel_clock,
+                     calibrate, present, scale_from, filter, defer_show,
+                     max_pixel_clock));
+    result->geometry = geometry;
+    return result;
+}
+
+// Map a framebuffer, raising OSError if the system refuses
+template <typename... Args>
+std::shared_ptr<piomatter::mapped_framebuffer>
+map_framebuffer(const std::string &name, Args... args) {
+    try {
+        return std::make_shared<piomatter::mapped_framebuffer>(args...);
+    } catch (const std::system_error &e) {
+        raise_os_error(e, name);
+    }
+}
+
+// A stream_file_writer for any pinout and colorspace, taking frames as
+// Python buffers
+struct stream_writer_base {
+    virtual ~stream_writer_base() {}
+    virtual void add_frame(py::buffer frame, double duration) = 0;
+    virtual void close() = 0;
+};
+
+template <typename pinout, typename colorspace>
+struct stream_writer : stream_writer_base {
+    stream_writer(const std::string &path,
+                  const piomatter::matrix_geometry &geometry, bool compact,
+                  bool delta)
+        : writer(path, geometry, compact, delta),
+          n_pixels(geometry.width * geometry.height), path(path) {}
+
+    void add_frame(py::buffer frame, double duration) override {
+        using data_type = colorspace::data_type;
+        const py::buffer_info info = frame.request();
+        const size_t data_size_in_bytes =
+            colorspace::data_size_in_bytes(n_pixels);
+        if (!is_c_contiguous(info) ||
+            size_t(info.size * info.itemsize) != data_size_in_bytes) {
+            throw std::invalid_argument(
+                py::str("Frames must be contiguous buffers of {} bytes")
+                    .attr("format")(data_size_in_bytes)
+                    .template cast<std::string>());
+        }
+        if (!(duration >= 0)) {
+            throw std::invalid_argument("frame durations must not be negative");
+        }
+        std::span<const data_type> pixels(
+            static_cast<const data_type *>(info.ptr),
+            data_size_in_bytes / sizeof(data_type));
+        try {
+            py::gil_scoped_release release;
+            writer.add_frame(converter, pixels, uint64_t(duration * 1e9));
+        } catch (const std::system_error &e) {
+            raise_os_error(e, path);
+        }
+    }
+
+    void close() override {
+        try {
+            writer.close();
+        } catch (const std::system_error &e) {
+            raise_os_error(e, path);
+        }
+    }
+
+    piomatter::stream_file_writer<pinout> writer;
+    colorspace converter;
+    size_t n_pixels;
+    std::string path;
+};
+
+template <class pinout>
+std::unique_ptr<stream_writer_base>
+make_stream_writer_p(Colorspace c, const std::string &path,
+                     const piomatter::matrix_geometry &geometry, bool compact,
+                     bool delta) {
+    check_lane_count<pinout>(geometry);
+    switch (c) {
+    case RGB565:
+        return std::make_unique<
+            stream_writer<pinout, piomatter::colorspace_rgb565>>(
+            path, geometry, compact, delta);
+    case RGB888:
+        return std::make_unique<
+            stream_writer<pinout, piomatter::colorspace_rgb888>>(
+            path, geometry, compact, delta);
+    case RGB888Packed:
+        return std::make_unique<
+            stream_writer<pinout, piomatter::colorspace_rgb888_packed>>(
+            path, geometry, compact, delta);
+    case RGB10:
+        return std::make_unique<
+            stream_writer<pinout, piomatter::colorspace_rgb10>>(
+            path, geometry, compact, delta);
+    case RGB16:
+        return std::make_unique<
+            stream_writer<pinout, piomatter::colorspace_rgb16>>(
+            path, geometry, compact, delta);
+    }
+    throw std::runtime_error(py::str("Invalid colorspace {!r}")
+                                 .attr("format")(c)
+                                 .template cast<std::string>());
+}
+
+std::unique_ptr<stream_writer_base>
+make_stream_writer_s(Colorspace c, Pinout p, const std::string &path,
+                     const piomatter::matrix_geometry &geometry, bool compact,
+                     bool delta) {
+    switch (p) {
+    case AdafruitMatrixBonnet:
+        return make_stream_writer_p<piomatter::adafruit_matrix_bonnet_pinout>(
+            c, path, geometry, compact, delta);
+    case AdafruitMatrixBonnetBGR:
+        return make_stream_writer_p<
+            piomatter::adafruit_matrix_bonnet_pinout_bgr>(c, path, geometry,
+                                                          compact, delta);
+    case Active3:
+        return make_stream_writer_p<piomatter::active3_pinout>(
+            c, path, geometry, compact, delta);
+    case Active3BGR:
+        return make_stream_writer_p<piomatter::active3_pinout_bgr>(
+            c, path, geometry, compact, delta);
+    }
+    throw std::runtime_error(py::str("Invalid pinout {!r}")
+                                 .attr("format")(p)
+                                 .template cast<std::string>());
+}
+
+// Create a stream file writer, raising OSError if the file can't be created
+std::unique_ptr<stream_writer_base>
+make_stream_writer(Colorspace c, Pinout p, const std::string &path,
+                   const piomatter::matrix_geometry &geometry, bool compact,
+                   bool delta) {
+    try {
+        return make_stream_writer_s(c, p, path, geometry, compact, delta);
+    } catch (const std::system_error &e) {
+        raise_os_error(e, path);
+    }
+}
+
+template <class pinout>
+py::dict estimate_p(const piomatter::matrix_geometry &geometry,
+                    double pixel_clock) {
+    check_lane_count<pinout>(geometry);
+    auto e = piomatter::estimate_streams<pinout>(geometry, pixel_clock);
+    py::dict result;
+    result["bytes_per_schedule"] = e.bytes_per_schedule;
+    result["cycles_per_refresh"] = e.cycles_per_refresh;
+    result["refresh_hz"] = e.refresh_hz;
+    result["duty_cycle"] = e.duty_cycle;
+    return result;
+}
+
+py::dict estimate(const piomatter::matrix_geometry &geometry, Pinout p,
+                  double pixel_clock) {
+    if (pixel_clock <= 0) {
+        throw std::invalid_argument("pixel_clock must be positive");
+    }
+    switch (p) {
+    case AdafruitMatrixBonnet:
+        return estimate_p<piomatter::adafruit_matrix_bonnet_pinout>(
+            geometry, pixel_clock);
+    case AdafruitMatrixBonnetBGR:
+        return estimate_p<piomatter::adafruit_matrix_bonnet_pinout_bgr>(
+            geometry, pixel_clock);
+    case Active3:
+        return estimate_p<piomatter::active3_pinout>(geometry, pixel_clock);
+    case Active3BGR:
+        return estimate_p<piomatter::active3_pinout_bgr>(geometry,
+                                                         pixel_clock);
     }
     throw std::runtime_error(py::str("Invalid pinout {!r}")
                                  .attr("format")(p)
@@ -138,6 +935,35 @@ PYBIND11_MODULE(_piomatter, m) {
         .value("CW", piomatter::orientation::cw,
                "Rotated 90 degress clockwise");
 
+    py::enum_<piomatter::submit_policy>(
+        m, "SubmitPolicy",
+        "Describes what `PioMatter.show` does when no buffer is free")
+        .value("Block", piomatter::submit_policy::block,
+               "Wait for a buffer, so that every frame is displayed")
+        .value("DropOldest", piomatter::submit_policy::drop_oldest,
+               "Wait for a buffer, but only display the newest frame")
+        .value("NeverBlock", piomatter::submit_policy::never_block,
+               "Skip the frame instead of waiting");
+
+    py::enum_<piomatter::present_mode>(
+        m, "PresentMode",
+        "Describes when the refresh thread puts a new frame on display")
+        .value("Immediate", piomatter::present_mode::immediate,
+               "At the next schedule, for the lowest latency")
+        .value("SequenceBoundary", piomatter::present_mode::sequence_boundary,
+               "Only between passes through all of the schedules, so that "
+               "temporal dithering never mixes two frames");
+
+    py::enum_<piomatter::scale_filter>(
+        m, "ScaleFilter",
+        "Describes how `PioMatter` scales its ``scale_from`` rectangle")
+        .value("Box", piomatter::scale_filter::box,
+               "Average all the pixels that fall in each matrix pixel, for "
+               "large reductions such as a screen onto a panel")
+        .value("Bilinear", piomatter::scale_filter::bilinear,
+               "Interpolate between the 4 nearest pixels, which is smoother "
+               "for scales of less than 2 times");
+
     py::enum_<Pinout>(
         m, "Pinout", "Describes the pins used for the connection to the matrix")
         .value("AdafruitMatrixBonnet", Pinout::AdafruitMatrixBonnet,
@@ -158,9 +984,17 @@ PYBIND11_MODULE(_piomatter, m) {
         .value("RGB888Packed", Colorspace::RGB888Packed,
                "3 bytes per pixel in RGB order")
         .value("RGB888", Colorspace::RGB888, "4 bytes per pixel in RGB order")
-        .value("RGB565", Colorspace::RGB565, "2 bytes per pixel in RGB order");
+        .value("RGB565", Colorspace::RGB565, "2 bytes per pixel in RGB order")
+        .value("RGB10", Colorspace::RGB10,
+               "4 bytes per pixel of linear 10-bit channels, with red in bits "
+               "20-29, green in bits 10-19 and blue in bits 0-9")
+        .value("RGB16", Colorspace::RGB16,
+               "3 linear 16-bit channels per pixel in RGB order, of which the "
+               "top 10 bits are shown");
 
-    py::class_<piomatter::matrix_geometry>(m, "Geometry", R"pbdoc(
+    py::class_<piomatter::matrix_geometry,
+               std::shared_ptr<piomatter::matrix_geometry>>(m, "Geometry",
+                                                            R"pbdoc(
 Describe the geometry of a set of panels
 
 ``width`` and ``height`` give the panel resolution in pixels.
@@ -194,6 +1028,8 @@ For panels with more than 2 lanes, or using a custom pixel mapping, the followin
 If 2 or 3 connectors are used, then there are 4 or 6 lanes.
 
 ``map`` is a Python list of integers giving the framebuffer pixel indices for each matrix pixel.
+It may instead be a contiguous numpy array of integers, which is copied without converting
+each element, so large maps are quicker to load.
 )pbdoc")
         .def(py::init([](size_t width, size_t height, size_t n_addr_lines,
                          bool serpentine, piomatter::orientation rotation,
@@ -242,24 +1078,137 @@ If 2 or 3 connectors are used, then there are 4 or 6 lanes.
              py::arg("rotation") = piomatter::orientation::normal,
              py::arg("n_planes") = 10u, py::arg("n_temporal_planes") = 2)
         .def(py::init([](size_t width, size_t height, size_t n_addr_lines,
-                         piomatter::matrix_map map, size_t n_planes,
+                         py::buffer map, size_t n_planes,
                          size_t n_temporal_planes, size_t n_lanes) {
-                 size_t n_lines = n_lanes << n_addr_lines;
-                 size_t pixels_across = width * height / n_lines;
-                 for (auto el : map) {
-                     if ((size_t)el >= width * height) {
-                         throw std::out_of_range("Map element out of range");
-                     }
-                 }
-                 return piomatter::matrix_geometry(pixels_across, n_addr_lines,
-                                                   n_planes, n_temporal_planes,
-                                                   width, height, map, n_lanes);
+                 return make_mapped_geometry(width, height, n_addr_lines,
+                                             map_from_buffer(map), n_planes,
+                                             n_temporal_planes, n_lanes);
              }),
              py::arg("width"), py::arg("height"), py::arg("n_addr_lines"),
              py::arg("map"), py::arg("n_planes") = 10u,
              py::arg("n_temporal_planes") = 0u, py::arg("n_lanes") = 2)
+        .def(py::init(&make_mapped_geometry), py::arg("width"),
+             py::arg("height"), py::arg("n_addr_lines"), py::arg("map"),
+             py::arg("n_planes") = 10u, py::arg("n_temporal_planes") = 0u,
+             py::arg("n_lanes") = 2)
         .def_readonly("width", &piomatter::matrix_geometry::width)
-        .def_readonly("height", &piomatter::matrix_geometry::height);
+        .def_readonly("height", &piomatter::matrix_geometry::height)
+        .def("estimate", &estimate, py::arg("pinout"),
+             py::arg("pixel_clock") = piomatter::default_pixel_clock,
+             R"pbdoc(
+Estimate the cost of displaying this geometry, without opening the PIO device
+
+``pixel_clock`` is in Hz, as for `PioMatter`. Returns a dict with:
+
+``bytes_per_schedule``: the size of the data sent for each schedule (each
+step of temporal dithering), as a list.
+
+``cycles_per_refresh``: the PIO cycles taken to display every schedule once.
+
+``refresh_hz``: how many times per second every schedule can be displayed.
+
+``duty_cycle``: the fraction of the time that the panel is lit, which sets
+its brightness. Each address row is lit for ``1/2**n_addr_lines`` of this.
+
+These assume that the PIO is kept fed at ``pixel_clock``, and are for the
+standard stream format; the compact format sends fewer bytes, depending on
+the image.
+)pbdoc");
+
+    py::class_<piomatter::mapped_framebuffer,
+               std::shared_ptr<piomatter::mapped_framebuffer>>(
+        m, "MappedFramebuffer", R"pbdoc(
+A read-only mapping of an image drawn by the rest of the system
+
+Pass one to `PioMatter` in place of a numpy framebuffer to display a window of
+it directly, without copying it in Python. Each `PioMatter.show`, or
+`PioMatter.start_mirroring` to show frames from a native thread, displays
+what is in the mapping at the time.
+
+``path`` names a Linux framebuffer device, whose whole virtual screen is mapped.
+The default is ``/dev/fb0``. Use `from_dmabuf` to map a DMA-BUF instead.
+)pbdoc")
+        .def(py::init([](const std::string &path) {
+                 return map_framebuffer(path, path);
+             }),
+             py::arg("path") = "/dev/fb0")
+        .def_static(
+            "from_dmabuf",
+            [](int fd, size_t width, size_t height, size_t stride,
+               size_t bits_per_pixel, size_t offset) {
+                return map_framebuffer("dmabuf", fd, width, height, stride,
+                                       bits_per_pixel, offset);
+            },
+            py::arg("fd"), py::arg("width"), py::arg("height"),
+            py::arg("stride"), py::arg("bits_per_pixel"),
+            py::arg("offset") = 0, R"pbdoc(
+Map a DMA-BUF, such as one exported by a display, GPU or video driver
+
+``fd`` is the DMA-BUF file descriptor, which is duplicated, so it may be closed
+afterwards. The image is ``width`` by ``height`` pixels of ``bits_per_pixel``
+bits, with rows ``stride`` bytes apart, starting ``offset`` bytes in. Reads are
+bracketed with ``DMA_BUF_IOCTL_SYNC`` so that the CPU sees what devices wrote.
+)pbdoc")
+        .def_readonly("width", &piomatter::mapped_framebuffer::width)
+        .def_readonly("height", &piomatter::mapped_framebuffer::height)
+        .def_readonly("stride", &piomatter::mapped_framebuffer::stride,
+                      "The distance between rows, in bytes")
+        .def_readonly("bits_per_pixel",
+                      &piomatter::mapped_framebuffer::bits_per_pixel);
+
+    py::class_<stream_writer_base>(m, "StreamFileWriter", R"pbdoc(
+Render frames ahead of time into a file for `PioMatter.play_file`
+
+The file holds each frame's data streams exactly as they are sent to the
+matrix, so playing it costs no rendering at all. ``colorspace``, ``pinout`` and
+``geometry`` are as for `PioMatter`, and ``compact`` must match the setting of
+the matrix that will play the file. With ``delta``, the default, each frame is
+stored as its changes from the previous one when that is smaller, which for
+most video is much smaller.
+
+The file is only complete once `close` has been called, which leaving a
+``with`` block does.
+)pbdoc")
+        .def(py::init(&make_stream_writer), py::arg("path"),
+             py::arg("colorspace"), py::arg("pinout"), py::arg("geometry"),
+             py::arg("compact") = false, py::arg("delta") = true)
+        .def("add_frame", &stream_writer_base::add_frame, py::arg("frame"),
+             py::arg("duration"), R"pbdoc(
+Render a frame and add it to the file, to be shown for ``duration`` seconds
+
+``frame`` is a contiguous buffer holding the same bytes that a `PioMatter`
+framebuffer would for that frame.
+)pbdoc")
+        .def("close", &stream_writer_base::close, R"pbdoc(
+Finish writing the file. Adding frames after this raises an error.
+)pbdoc")
+        .def("__enter__", [](py::object self) { return self; })
+        .def("__exit__",
+             [](stream_writer_base &self, py::args) { self.close(); });
+
+    py::class_<PyShowFuture>(m, "ShowFuture", R"pbdoc(
+The pending result of `PioMatter.show_async`
+
+Call `result` to wait for the frame to be queued for display, or ``await``
+the future from a coroutine.
+)pbdoc")
+        .def("done", &PyShowFuture::done, R"pbdoc(
+Return `True` if the frame has been rendered and queued for display
+)pbdoc")
+        .def("result", &PyShowFuture::result,
+             py::arg("timeout") = py::none(), R"pbdoc(
+Wait for the frame to be rendered and queued for display
+
+Returns the same value as `PioMatter.show`. If ``timeout`` (in seconds) elapses first, `TimeoutError` is raised. If
+displaying the frame failed, `OSError` is raised.
+)pbdoc")
+        .def("__await__", [](py::object self) {
+            auto asyncio = py::module_::import("asyncio");
+            auto loop = asyncio.attr("get_running_loop")();
+            return loop
+                .attr("run_in_executor")(py::none(), self.attr("result"))
+                .attr("__await__")();
+        });
 
     py::class_<PyPiomatter>(m, "PioMatter", R"pbdoc(
 HUB75 matrix driver for Raspberry Pi 5 using PIO
@@ -267,6 +1216,8 @@ HUB75 matrix driver for Raspberry Pi 5 using PIO
 ``colorspace`` controls the colorspace that will be used for data to be displayed.
 It must be one of the `Colorspace` constants. Which to use depends on what data
 your displaying and how it is processed before copying into the framebuffer.
+RGB10 and RGB16 hold linear color that skips the gamma conversion, so content
+that is already gamma corrected keeps all 10 bits when ``n_planes`` is 10.
 
 ``pinout`` defines which pins the panels are wired to. Different pinouts can
 support different hardware breakouts and panels with different color order. The
@@ -276,17 +1227,289 @@ value must be one of the `Pinout` constants.
 
 ``geometry`` controls the size and shape of the panel. The value must be a `Geometry`
 instance.
+
+``render_threads`` sets how many additional threads help `show` render each frame.
+Each takes a band of the panel's rows. The default, 0, renders on the calling thread.
+On a Raspberry Pi 5, values up to 2 leave a core free for the refresh thread.
+
+``n_buffers`` sets how many frame buffers are used, from 2 to 15. One is always
+on display. The default is 3.
+
+``policy`` controls what `show` does when every buffer is in use. It must be one
+of the `SubmitPolicy` constants. The default, ``SubmitPolicy.Block``, waits for a
+buffer, so every frame is displayed. ``SubmitPolicy.DropOldest`` displays only the
+newest of several pending frames, for the lowest latency. ``SubmitPolicy.NeverBlock``
+returns at once, dropping the frame.
+
+``compact`` selects a denser stream encoding in which a run of identical pixels
+takes two words instead of one per pixel. For content with large areas of one
+color, such as text, this about halves the DMA bandwidth needed. It raises the
+refresh rate only where sending data to the PIO peripheral, rather than the pixel
+clock, is the limit; otherwise the refresh rate is unchanged, or slightly lower
+from the longer decoding. The default is `False`.
+
+``pixel_clock`` sets the rate, in Hz, at which pixels are clocked out to the panels.
+The default, 0, uses 2.7MHz, which current Raspberry Pi firmware and kernels can
+sustain.
+
+``calibrate``, when `True` and ``pixel_clock`` is 0, briefly tests increasing pixel
+clocks while the panel is dark, and uses the fastest that the DMA keeps in step,
+up to ``max_pixel_clock``. The clock chosen is available as `pixel_clock`. This
+measures the limit of the DMA, not of the panels: it can't tell whether the panels
+or their cables keep up with the clock.
+
+``max_pixel_clock`` is the fastest pixel clock that ``calibrate`` may choose,
+by default 5.4MHz, which common panels and cables handle. Raise it only for panels
+known to run faster.
+
+``x_offset`` and ``y_offset`` display the geometry's width by height window of a
+larger ``framebuffer`` whose top left corner is at that pixel. The window is read
+in place, so no copy of it is needed. By default, a larger ``framebuffer`` must be
+2-dimensional (3 for RGB888Packed and RGB16), and may be a strided view such as
+``image[y0:y1, x0:x1]`` as long as each row is contiguous. ``stride`` instead
+treats a contiguous ``framebuffer`` as an image whose rows are that many pixels
+apart.
+
+``present_mode`` controls when a new frame replaces the one on display. It must be
+one of the `PresentMode` constants. The default, ``PresentMode.Immediate``, swaps
+at the next schedule. With temporal dithering (``n_temporal_planes``), that can
+mix planes of two frames in one refresh, which shimmers on moving content;
+``PresentMode.SequenceBoundary`` swaps only between refreshes, adding up to one
+refresh of latency. The ``present_latency`` of `stats` measures the result.
+
+``scale_from``, an ``(x, y, width, height)`` rectangle of a larger ``framebuffer``,
+shows that rectangle scaled to the geometry's size, in place of ``x_offset`` and
+``y_offset``. Pixels are scaled as they are converted for the panels, so mirroring
+part of a 1920x1080 screen onto a 128x64 wall reads the screen once per frame and
+makes no scaled copy. ``scale_filter`` must be one of the `ScaleFilter` constants;
+the default, ``ScaleFilter.Box``, averages every pixel of the rectangle. The
+rectangle may be scaled down by up to 256 times.
+
+``framebuffer`` may instead be a `MappedFramebuffer`, whose bits per pixel must
+suit ``colorspace``: 16 for RGB565, 24 for RGB888Packed, 32 for RGB888 or RGB10,
+or 48 for RGB16. The panels then show the window of it at (``x_offset``,
+``y_offset``), or its ``scale_from`` rectangle.
+
+``defer_show``, when `True`, leaves the panels dark until the first `show`
+instead of rendering the framebuffer while starting, for when it isn't filled
+in yet.
+
+The ``geometry`` is used in place rather than copied, and PioMatters whose
+geometries have the same shape and schedules share the timing data made from
+them, so starting several for one large custom map does that work once.
 )pbdoc")
         .def(py::init(&make_piomatter), py::arg("colorspace"),
-             py::arg("pinout"), py::arg("framebuffer"), py::arg("geometry"))
-        .def("show", &PyPiomatter::show, R"pbdoc(
+             py::arg("pinout"), py::arg("framebuffer"), py::arg("geometry"),
+             py::arg("render_threads") = 0, py::arg("n_buffers") = 3,
+             py::arg("policy") = piomatter::submit_policy::block,
+             py::arg("compact") = false, py::arg("pixel_clock") = 0.,
+             py::arg("calibrate") = false, py::arg("x_offset") = 0,
+             py::arg("y_offset") = 0, py::arg("stride") = 0,
+             py::arg("present_mode") = piomatter::present_mode::immediate,
+             py::arg("scale_from") = py::none(),
+             py::arg("scale_filter") = piomatter::scale_filter::box,
+             py::arg("defer_show") = false,
+             py::arg("max_pixel_clock") = piomatter::default_max_pixel_clock)
+        .def(py::init(&make_piomatter_mapped), py::arg("colorspace"),
+             py::arg("pinout"), py::arg("framebuffer"), py::arg("geometry"),
+             py::arg("render_threads") = 0, py::arg("n_buffers") = 3,
+             py::arg("policy") = piomatter::submit_policy::block,
+             py::arg("compact") = false, py::arg("pixel_clock") = 0.,
+             py::arg("calibrate") = false, py::arg("x_offset") = 0,
+             py::arg("y_offset") = 0,
+             py::arg("present_mode") = piomatter::present_mode::immediate,
+             py::arg("scale_from") = py::none(),
+             py::arg("scale_filter") = piomatter::scale_filter::box,
+             py::arg("defer_show") = false,
+             py::arg("max_pixel_clock") = piomatter::default_max_pixel_clock)
+        .def("show", &PyPiomatter::show, py::arg("present_at_ns") = 0,
+             R"pbdoc(
 Update the displayed image
 
 After modifying the content of the framebuffer, call this method to
 update the data actually displayed on the panel. Internally, the
 data is triple-buffered to prevent tearing.
+
+The Python GIL is released while the frame is rendered, so other
+Python threads can run.
+
+By default the frame is displayed as soon as possible. Given a
+``present_at_ns`` time on ``time.CLOCK_TAI``, as from
+``time.clock_gettime_ns(time.CLOCK_TAI)``, it is instead displayed from the
+pass through the schedules that starts nearest that time. When every
+controller of a video wall keeps that clock in step, for instance with PTP,
+giving each the same time swaps their frames together, so that content moving
+across the wall doesn't tear between them. Frames submitted after a timed one
+wait for it to be displayed; allow for the render time, and see the
+``present_error`` and ``presents_late`` `stats`.
+
+Returns `True`, or `False` if the frame was skipped under
+``SubmitPolicy.NeverBlock``.
+)pbdoc")
+        .def("show_async", &PyPiomatter::show_async,
+             py::arg("present_at_ns") = 0, R"pbdoc(
+Update the displayed image without waiting for it to be rendered
+
+The framebuffer is copied, so it may be modified as soon as this returns.
+The copy is made while holding the GIL, so it can't be torn by other Python
+threads writing to the framebuffer. The copy is rendered on a background thread. Returns a `ShowFuture` that
+completes when the frame has been queued for display or skipped. Frames from `show`
+and `show_async` are always displayed in the order they were submitted.
+``present_at_ns`` is as for `show`.
 )pbdoc")
         .def_property_readonly("fps", &PyPiomatter::fps, R"pbdoc(
-The approximate number of matrix refreshes per second.
+The approximate number of schedules sent per second, measured over the most recent one.
+
+A full refresh of the panel consists of one schedule per temporal plane; see
+`stats` for a count of full refreshes.
+)pbdoc")
+        .def_property_readonly("pixel_clock", &PyPiomatter::pixel_clock,
+                               R"pbdoc(
+The pixel clock in use, in Hz.
+)pbdoc")
+        .def("stats", &PyPiomatter::stats, R"pbdoc(
+Return a dict of performance counters and timings
+
+Timings are histograms, each a dict with ``count``, ``total_ns`` and ``buckets``.
+``buckets[0]`` counts durations of 0ns and ``buckets[i]`` those from 2**(i-1) to
+2**i - 1 ns, with the last bucket also counting anything longer.
+
+* ``wait_free``: time `show` spent waiting for a free buffer
+* ``render``: time `show` spent converting and rendering the frame
+* ``encode``: time `show` spent re-encoding the frame for ``compact`` mode
+* ``xfer``: time the refresh thread spent sending each schedule
+* ``present_error``: for frames shown with ``present_at_ns``, how far from that
+  time the pass through the schedules that first displayed them started
+* ``present_latency``: time from `show` being called to the frame starting to
+  reach the panel
+
+Counters:
+
+* ``frames_shown``: frames put on display, not counting those dropped or
+  still queued
+* ``frames_skipped`` (``SubmitPolicy.NeverBlock``) and ``frames_dropped``
+  (``SubmitPolicy.DropOldest``)
+* ``presents_late``: frames shown with ``present_at_ns`` that were ready too
+  late to be displayed from the pass nearest it
+* ``schedules_sent``, ``refreshes`` (passes through all schedules) and
+  ``repeated_refreshes`` (passes that showed no new frame)
+* ``xfer_ioctls``: calls made into the kernel to send schedules
+* ``n_errors`` and ``recent_errors``, the errno values of the most recent
+  transfer errors, oldest first
+)pbdoc")
+        .def("start_mirroring", &PyPiomatter::start_mirroring,
+             py::arg("vsync") = true, py::arg("max_fps") = 0., R"pbdoc(
+Keep showing a `MappedFramebuffer` from a native thread, until `stop_mirroring`
+
+No Python code runs per frame. With ``vsync``, each frame is shown after a
+vertical sync of the framebuffer device, if it reports them. Otherwise frames
+are shown at most ``max_fps`` times per second, or with 0, as fast as the
+refresh takes them. Setting `incremental` makes a mostly static screen cheap
+to mirror.
+)pbdoc")
+        .def("stop_mirroring", &PyPiomatter::stop_mirroring, R"pbdoc(
+Stop the thread started by `start_mirroring`
+
+Raises `OSError` if the mirror had already stopped because of an error.
+)pbdoc")
+        .def_property_readonly("mirroring", &PyPiomatter::mirroring, R"pbdoc(
+`True` while the thread started by `start_mirroring` is showing frames
+)pbdoc")
+        .def("load_sequence", &PyPiomatter::load_sequence, py::arg("frames"),
+             py::arg("durations"), py::arg("loop") = true, R"pbdoc(
+Render a sequence of frames once, then play it without further work in Python
+
+``frames`` is a sequence of contiguous buffers, each holding the same bytes that
+``framebuffer`` would for that frame. ``durations`` gives how long to show each
+frame, in seconds, either as one number for every frame or as a sequence of one
+per frame.
+
+The frames are rendered before this returns, and then played from a native
+thread on its own timer, so the CPU cost of playback is a copy of each frame's
+data stream when it comes up, however many times the sequence repeats.
+Consecutive frames that look the same are only stored once. With ``compact``,
+the frames are stored in the standard encoding and re-encoded as each comes up,
+so that they follow `brightness`.
+
+With ``loop``, the default, the sequence repeats until stopped; otherwise the
+last frame stays on display. Loading another sequence replaces this one, and
+`show`, `show_async` and `stop_sequence` stop it.
+)pbdoc")
+        .def("play_file", &PyPiomatter::play_file, py::arg("path"),
+             py::arg("loop") = true, R"pbdoc(
+Play a stream file written by `StreamFileWriter`, as `load_sequence` plays frames
+
+The file is mapped rather than read, so it may hold more frames than would fit
+in memory; each frame's data streams are read from it as the frame comes up.
+The file must have been written for the same pinout, geometry and ``compact``
+setting as this matrix, or `ValueError` is raised.
+)pbdoc")
+        .def("stop_sequence", &PyPiomatter::stop_sequence, R"pbdoc(
+Stop a sequence started by `load_sequence` or `play_file`, leaving its current
+frame on display
+)pbdoc")
+        .def_property_readonly("playing", &PyPiomatter::playing, R"pbdoc(
+`True` while a sequence started by `load_sequence` or `play_file` is playing
+)pbdoc")
+        .def("reset_stats", &PyPiomatter::reset_stats, R"pbdoc(
+Set all of the counters and timings reported by `stats` to zero
+)pbdoc")
+        .def_property("incremental", &PyPiomatter::incremental,
+                      &PyPiomatter::set_incremental, R"pbdoc(
+Only re-render the parts of the display that changed
+
+When `True`, `show` compares each row of the framebuffer with what was last
+rendered and only re-renders the rows that changed. This is much faster when
+most of the display is static. The default is `False`.
+)pbdoc")
+        .def_property("brightness", &PyPiomatter::brightness,
+                      &PyPiomatter::set_brightness, R"pbdoc(
+The overall brightness, from 0 to 1
+
+Setting it shortens the time each bit plane is lit, keeping the refresh rate
+and every bit of color depth, so it costs no rendering: the frame on display
+is re-sent with its timing changed, and later frames are rendered to match.
+At low settings the dimmest planes are kept lit for at least one pixel clock,
+so very dark colors dim less than bright ones. Frames from `load_sequence` follow
+it too, as do those from `play_file` and stream data, except with ``compact``,
+where they are shown as they were made. The default is 1.
+)pbdoc")
+        .def_property("plane_duty", &PyPiomatter::plane_duty,
+                      &PyPiomatter::set_plane_duty, R"pbdoc(
+Extra scale factors for the time each bit plane is lit, on top of `brightness`
+
+Element ``k`` applies to bit ``k`` of each 10-bit color channel, 9 being the
+most significant. Planes beyond the end of the list are left at 1, so the
+default, an empty list, changes nothing. This can, for instance, adjust the
+response of the lowest planes of a particular panel.
+)pbdoc")
+        .def("set_luts", &PyPiomatter::set_luts, py::arg("luts"),
+             py::arg("regions") = py::none(), R"pbdoc(
+Replace the lookup tables that convert 8-bit colors to the display's 10 bits
+
+Each of ``luts`` is 3 sequences of 256 values from 0 to 1023, giving the output
+for each input value of red, green and blue in turn; `gamma_lut` makes them
+for a gamma curve and white point. Without ``regions``, the first LUT converts
+every pixel. Otherwise ``regions`` is a contiguous numpy array of ``uint8``
+with one element per framebuffer pixel, such as one of shape ``(height,
+width)``, that gives the number of the LUT for that pixel. That lets panels
+from different batches in one display each get their own white point. The
+linear colorspaces, RGB10 and RGB16, have no LUTs to replace.
+
+The LUTs are replaced between two frames, so each frame is converted wholly
+with the old ones or wholly with the new ones; frames shown after this returns
+use the new ones. Frames already loaded by `load_sequence` keep the LUTs
+they were made with.
+)pbdoc")
+        .def_static("gamma_lut", &gamma_tables, py::arg("gamma") = 2.2,
+                    py::arg("white_point") =
+                        std::array<double, 3>{1., 1., 1.},
+                    R"pbdoc(
+Make a LUT for `set_luts` that follows a gamma curve
+
+Each of the 3 elements of ``white_point``, from 0 to 1, scales the output of
+red, green and blue, so that full white on a panel matches others. The
+default, ``gamma=2.2`` and no white point correction, is the conversion every
+PioMatter starts with.
 )pbdoc");
 }
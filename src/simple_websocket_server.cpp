@@ -0,0 +1,546 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "piomatter/ingest.h"
+#include "piomatter/piomatter.h"
+
+// A daemon that shows frames pushed to it over the network, as UDP datagrams
+// (optionally to a multicast group, so that one sender can feed every
+// controller of a wall) or WebSocket binary messages, in the wire format
+// described in piomatter/ingest.h. Received pixels go straight into the
+// framebuffer and are rendered on the piomatter's own thread while the next
+// frame arrives; rendered frames wait in the piomatter's buffers, which
+// absorbs jitter in the network.
+//
+// Usage: simple_server [options], see usage() below
+
+namespace {
+
+struct config {
+    size_t width = 64, height = 32, n_addr_lines = 4;
+    int n_planes = 10, n_temporal_planes = 0;
+    bool serpentine = true;
+    std::string pinout = "bonnet", colorspace = "rgb888";
+    piomatter::piomatter_options options;
+    int udp_port = 5568, websocket_port = 0;
+    std::string group, interface = "0.0.0.0";
+    double report_interval = 10;
+};
+
+volatile sig_atomic_t exit_requested = 0;
+
+void request_exit(int) { exit_requested = 1; }
+
+void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --width N, --height N   size of the display (64x32)\n"
+            "  --addr-lines N          address lines of the panels (4)\n"
+            "  --planes N              bit planes (10)\n"
+            "  --temporal-planes N     temporally dithered planes (0)\n"
+            "  --no-serpentine         chains are not serpentine\n"
+            "  --pinout NAME           bonnet, bonnet-bgr, active3 or "
+            "active3-bgr\n"
+            "  --colorspace NAME       rgb565, rgb888, rgb888-packed, rgb10 "
+            "or rgb16\n"
+            "  --buffers N             frame buffers (3)\n"
+            "  --render-threads N      extra threads that render (0)\n"
+            "  --compact               send compact streams, refusing any from "
+            "the\n"
+            "                          network\n"
+            "  --sequence-boundary     swap frames only between refreshes\n"
+            "  --udp-port N            UDP port, 0 for none (5568)\n"
+            "  --group ADDR            multicast group to join\n"
+            "  --interface ADDR        local address to listen and join on\n"
+            "  --websocket-port N      WebSocket port, 0 for none (0)\n"
+            "  --report SECONDS        statistics interval, 0 for none (10)\n",
+            argv0);
+    exit(2);
+}
+
+config parse_args(int argc, char **argv) {
+    static const option long_options[] = {
+        {"width", required_argument, nullptr, 'w'},
+        {"height", required_argument, nullptr, 'h'},
+        {"addr-lines", required_argument, nullptr, 'a'},
+        {"planes", required_argument, nullptr, 'p'},
+        {"temporal-planes", required_argument, nullptr, 't'},
+        {"no-serpentine", no_argument, nullptr, 'S'},
+        {"pinout", required_argument, nullptr, 'P'},
+        {"colorspace", required_argument, nullptr, 'C'},
+        {"buffers", required_argument, nullptr, 'b'},
+        {"render-threads", required_argument, nullptr, 'r'},
+        {"compact", no_argument, nullptr, 'c'},
+        {"sequence-boundary", no_argument, nullptr, 'B'},
+        {"udp-port", required_argument, nullptr, 'u'},
+        {"group", required_argument, nullptr, 'g'},
+        {"interface", required_argument, nullptr, 'i'},
+        {"websocket-port", required_argument, nullptr, 'W'},
+        {"report", required_argument, nullptr, 'R'},
+        {nullptr, 0, nullptr, 0},
+    };
+    config result;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'w':
+            result.width = atoi(optarg);
+            break;
+        case 'h':
+            result.height = atoi(optarg);
+            break;
+        case 'a':
+            result.n_addr_lines = atoi(optarg);
+            break;
+        case 'p':
+            result.n_planes = atoi(optarg);
+            break;
+        case 't':
+            result.n_temporal_planes = atoi(optarg);
+            break;
+        case 'S':
+            result.serpentine = false;
+            break;
+        case 'P':
+            result.pinout = optarg;
+            break;
+        case 'C':
+            result.colorspace = optarg;
+            break;
+        case 'b':
+            result.options.n_buffers = atoi(optarg);
+            break;
+        case 'r':
+            result.options.render_threads = atoi(optarg);
+            break;
+        case 'c':
+            result.options.compact = true;
+            break;
+        case 'B':
+            result.options.present = piomatter::present_mode::sequence_boundary;
+            break;
+        case 'u':
+            result.udp_port = atoi(optarg);
+            break;
+        case 'g':
+            result.group = optarg;
+            break;
+        case 'i':
+            result.interface = optarg;
+            break;
+        case 'W':
+            result.websocket_port = atoi(optarg);
+            break;
+        case 'R':
+            result.report_interval = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || result.options.n_buffers < 2 ||
+        (!result.udp_port && !result.websocket_port)) {
+        usage(argv[0]);
+    }
+    return result;
+}
+
+[[noreturn]] void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+in_addr parse_address(const std::string &address) {
+    in_addr result;
+    if (inet_pton(AF_INET, address.c_str(), &result) != 1) {
+        fprintf(stderr, "invalid address %s\n", address.c_str());
+        exit(2);
+    }
+    return result;
+}
+
+int open_socket(int type, const config &cfg, int port) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        die("socket");
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    // A multicast receiver binds the group, so that it only gets the wall's
+    // traffic even if other groups share the port
+    addr.sin_addr = parse_address(
+        type == SOCK_DGRAM && !cfg.group.empty() ? cfg.group : cfg.interface);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        die("bind");
+    }
+    return fd;
+}
+
+int open_udp(const config &cfg) {
+    int fd = open_socket(SOCK_DGRAM, cfg, cfg.udp_port);
+    // Room for a few frames, so that a slow render doesn't lose packets
+    int rcvbuf = 8 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (!cfg.group.empty()) {
+        ip_mreq mreq{};
+        mreq.imr_multiaddr = parse_address(cfg.group);
+        mreq.imr_interface = parse_address(cfg.interface);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) != 0) {
+            die("IP_ADD_MEMBERSHIP");
+        }
+    }
+    return fd;
+}
+
+int open_websocket_listener(const config &cfg) {
+    int fd = open_socket(SOCK_STREAM, cfg, cfg.websocket_port);
+    if (listen(fd, 4) != 0) {
+        die("listen");
+    }
+    return fd;
+}
+
+bool send_all(int fd, const void *data, size_t size) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// One WebSocket client. Requests and frames are parsed from what has been
+// read so far; each complete binary message is handed to the assembler.
+struct websocket_client {
+    int fd;
+    bool upgraded = false;
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> message;
+
+    explicit websocket_client(int fd) : fd(fd) {}
+    ~websocket_client() { close(fd); }
+
+    // Returns false when the connection should be closed
+    template <typename F> bool on_readable(size_t max_message, F &&on_message) {
+        uint8_t buf[65536];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        if (n == 0) {
+            return false;
+        }
+        input.insert(input.end(), buf, buf + n);
+        if (!upgraded) {
+            std::string_view text(reinterpret_cast<char *>(input.data()),
+                                  input.size());
+            size_t end = text.find("\r\n\r\n");
+            if (end == std::string_view::npos) {
+                return input.size() < 8192;
+            }
+            auto response = piomatter::websocket_handshake(text.substr(0, end));
+            if (!response) {
+                const char bad[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+                send_all(fd, bad, sizeof(bad) - 1);
+                return false;
+            }
+            if (!send_all(fd, response->data(), response->size())) {
+                return false;
+            }
+            upgraded = true;
+            input.erase(input.begin(), input.begin() + end + 4);
+        }
+        size_t pos = 0;
+        piomatter::websocket_frame frame;
+        while (parse_websocket_frame(std::span(input).subspan(pos), frame)) {
+            // Clients must mask, and nothing bigger than a frame is expected
+            if (!frame.masked ||
+                frame.payload_size > max_message - message.size()) {
+                return false;
+            }
+            if (input.size() - pos - frame.header_size < frame.payload_size) {
+                break;
+            }
+            uint8_t *payload = &input[pos + frame.header_size];
+            for (size_t i = 0; i < frame.payload_size; i++) {
+                payload[i] ^= frame.mask[i % 4];
+            }
+            pos += frame.header_size + frame.payload_size;
+            switch (frame.opcode) {
+            case piomatter::websocket_binary:
+            case piomatter::websocket_continuation:
+                message.insert(message.end(), payload,
+                               payload + frame.payload_size);
+                if (frame.fin) {
+                    on_message(std::span<const uint8_t>(message));
+                    message.clear();
+                }
+                break;
+            case piomatter::websocket_ping: {
+                auto header = piomatter::websocket_frame_header(
+                    piomatter::websocket_pong, frame.payload_size);
+                if (!send_all(fd, header.data(), header.size()) ||
+                    !send_all(fd, payload, frame.payload_size)) {
+                    return false;
+                }
+                break;
+            }
+            case piomatter::websocket_pong:
+                break;
+            default:
+                return false;
+            }
+        }
+        input.erase(input.begin(), input.begin() + pos);
+        return true;
+    }
+};
+
+template <typename pinout, typename colorspace>
+int run(const config &cfg, const piomatter::matrix_geometry &geometry) {
+    using data_type = typename colorspace::data_type;
+    const size_t n_pixels = geometry.width * geometry.height;
+    std::vector<data_type> framebuffer(
+        colorspace::data_size_in_bytes(n_pixels) / sizeof(data_type));
+    piomatter::piomatter<pinout, colorspace> matter(framebuffer, geometry,
+                                                    cfg.options);
+
+    auto skeleton = piomatter::make_stream_skeleton<pinout>(geometry);
+    const uint64_t format_id =
+        piomatter::stream_format_id<pinout>(skeleton, cfg.options.compact);
+    size_t max_stream_bytes = skeleton.streams.size() * sizeof(uint32_t);
+    for (const auto &stream : skeleton.streams) {
+        max_stream_bytes += stream.size() * sizeof(uint32_t);
+    }
+    const size_t max_message =
+        sizeof(piomatter::ingest_packet_header) +
+        std::max(max_stream_bytes, framebuffer.size() * sizeof(data_type));
+
+    piomatter::frame_assembler assembler(
+        std::span(reinterpret_cast<uint8_t *>(framebuffer.data()),
+                  framebuffer.size() * sizeof(data_type)),
+        max_stream_bytes);
+    uint64_t frames_rejected = 0, show_errors = 0;
+    std::shared_future<int> pending;
+    std::vector<std::span<const uint32_t>> streams;
+
+    auto check_result = [&](int err) {
+        if (err > 0) {
+            show_errors++;
+            fprintf(stderr, "show: %s\n", strerror(err));
+        }
+    };
+    auto on_packet = [&](std::span<const uint8_t> packet) {
+        switch (assembler.add(packet)) {
+        case piomatter::frame_assembler::pixels_ready:
+            // Renders from a copy on the piomatter's thread, so the next
+            // frame can be received into the framebuffer meanwhile
+            if (pending.valid() &&
+                pending.wait_for(std::chrono::seconds(0)) ==
+                    std::future_status::ready) {
+                check_result(pending.get());
+            }
+            pending = matter.show_async();
+            break;
+        case piomatter::frame_assembler::streams_ready:
+            // Compact streams can't be checked against the skeleton, and
+            // any host that can reach the port could send them
+            if (cfg.options.compact || assembler.format_id() != format_id ||
+                !piomatter::split_streams(assembler.streams(),
+                                          skeleton.streams.size(), streams)) {
+                frames_rejected++;
+                break;
+            }
+            try {
+                check_result(matter.show_streams(streams));
+            } catch (const std::invalid_argument &) {
+                frames_rejected++;
+            }
+            break;
+        default:
+            break;
+        }
+    };
+
+    int udp_fd = cfg.udp_port ? open_udp(cfg) : -1;
+    int listen_fd = cfg.websocket_port ? open_websocket_listener(cfg) : -1;
+    std::unique_ptr<websocket_client> client;
+
+    // Drained a batch at a time, so that a burst of fragments costs few system
+    // calls
+    constexpr size_t batch = 32, max_datagram = 65536;
+    std::vector<uint8_t> datagrams(batch * max_datagram);
+    std::vector<iovec> iovecs(batch);
+    std::vector<mmsghdr> msgs(batch);
+    for (size_t i = 0; i < batch; i++) {
+        iovecs[i] = {&datagrams[i * max_datagram], max_datagram};
+        msgs[i].msg_hdr = {};
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    printf("showing %zux%zu frames", geometry.width, geometry.height);
+    if (udp_fd >= 0) {
+        const auto &address = cfg.group.empty() ? cfg.interface : cfg.group;
+        printf(" from UDP %s:%d", address.c_str(), cfg.udp_port);
+    }
+    if (listen_fd >= 0) {
+        printf(" from WebSocket port %d", cfg.websocket_port);
+    }
+    printf("\n");
+
+    auto last_report = std::chrono::steady_clock::now();
+    while (!exit_requested) {
+        pollfd fds[3];
+        nfds_t n_fds = 0;
+        for (int fd : {udp_fd, listen_fd, client ? client->fd : -1}) {
+            if (fd >= 0) {
+                fds[n_fds++] = {fd, POLLIN, 0};
+            }
+        }
+        int r = poll(fds, n_fds, 1000);
+        if (r < 0 && errno != EINTR) {
+            die("poll");
+        }
+        for (nfds_t i = 0; r > 0 && i < n_fds; i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (fds[i].fd == udp_fd) {
+                int n;
+                while ((n = recvmmsg(udp_fd, msgs.data(), batch, MSG_DONTWAIT,
+                                     nullptr)) > 0) {
+                    for (int j = 0; j < n; j++) {
+                        on_packet(std::span<const uint8_t>(
+                            &datagrams[j * max_datagram], msgs[j].msg_len));
+                    }
+                }
+            } else if (fds[i].fd == listen_fd) {
+                int fd = accept4(listen_fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+                // One sender at a time; a new connection replaces the old one
+                if (fd >= 0) {
+                    client = std::make_unique<websocket_client>(fd);
+                }
+            } else if (client &&
+                       !client->on_readable(max_message, on_packet)) {
+                client.reset();
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (cfg.report_interval > 0 &&
+            now - last_report >=
+                std::chrono::duration<double>(cfg.report_interval)) {
+            last_report = now;
+            const auto &s = assembler.stats;
+            printf("packets %llu, frames received %llu, dropped %llu, "
+                   "rejected %llu; packets late %llu, duplicate %llu, "
+                   "invalid %llu; shown %llu, show errors %llu, %.1f "
+                   "schedules/s\n",
+                   (unsigned long long)s.packets,
+                   (unsigned long long)s.frames_received,
+                   (unsigned long long)s.frames_dropped,
+                   (unsigned long long)frames_rejected,
+                   (unsigned long long)s.packets_late,
+                   (unsigned long long)s.packets_duplicate,
+                   (unsigned long long)s.packets_invalid,
+                   (unsigned long long)matter.stats.frames_shown.load(),
+                   (unsigned long long)show_errors, matter.fps.load());
+            fflush(stdout);
+        }
+    }
+    if (udp_fd >= 0) {
+        close(udp_fd);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    return 0;
+}
+
+template <typename pinout>
+int run_p(const config &cfg, const piomatter::matrix_geometry &geometry) {
+    if (cfg.colorspace == "rgb565") {
+        return run<pinout, piomatter::colorspace_rgb565>(cfg, geometry);
+    }
+    if (cfg.colorspace == "rgb888") {
+        return run<pinout, piomatter::colorspace_rgb888>(cfg, geometry);
+    }
+    if (cfg.colorspace == "rgb888-packed") {
+        return run<pinout, piomatter::colorspace_rgb888_packed>(cfg,
+                                                                geometry);
+    }
+    if (cfg.colorspace == "rgb10") {
+        return run<pinout, piomatter::colorspace_rgb10>(cfg, geometry);
+    }
+    if (cfg.colorspace == "rgb16") {
+        return run<pinout, piomatter::colorspace_rgb16>(cfg, geometry);
+    }
+    fprintf(stderr, "unknown colorspace %s\n", cfg.colorspace.c_str());
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    config cfg = parse_args(argc, argv);
+
+    struct sigaction sa {};
+    sa.sa_handler = request_exit;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    try {
+        // Two lanes, as on a single HUB75 connector
+        size_t pixels_across = cfg.width * cfg.height >> (cfg.n_addr_lines + 1);
+        piomatter::matrix_geometry geometry(
+            pixels_across, cfg.n_addr_lines, cfg.n_planes,
+            cfg.n_temporal_planes, cfg.width, cfg.height, cfg.serpentine,
+            piomatter::orientation_normal);
+        if (cfg.pinout == "bonnet") {
+            return run_p<piomatter::adafruit_matrix_bonnet_pinout>(cfg,
+                                                                 geometry);
+        }
+        if (cfg.pinout == "bonnet-bgr") {
+            return run_p<piomatter::adafruit_matrix_bonnet_pinout_bgr>(
+                cfg, geometry);
+        }
+        if (cfg.pinout == "active3") {
+            return run_p<piomatter::active3_pinout>(cfg, geometry);
+        }
+        if (cfg.pinout == "active3-bgr") {
+            return run_p<piomatter::active3_pinout_bgr>(cfg, geometry);
+        }
+        fprintf(stderr, "unknown pinout %s\n", cfg.pinout.c_str());
+        return 2;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}